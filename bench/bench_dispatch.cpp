@@ -0,0 +1,193 @@
+#include "pch.h"
+
+#include "Config.hpp"
+#include "Utils.hpp"
+#include "Vm.hpp"
+#include <chrono>
+
+// Runs scripts headless and times Run() + Update() frames.
+// Built twice by CMake: bench_dispatch_goto (computed goto) and
+// bench_dispatch_switch (USE_SWITCH_DISPATCH), run both on the same scripts.
+// -batch draws through render_batch_hook instead of the per-process hooks,
+// -jit turns the JIT on (hot chunks get compiled while the script runs).
+// bench_dispatch_aot links the scripts compiled by bulang-aot (bench_aot.cpp),
+// bench_dispatch_unfused skips the superinstruction pass (NO_SUPERINSTRUCTIONS),
+// bench_opcode_pairs also prints the most executed opcode pairs.
+
+static const int screenWidth = 800;
+static const int screenHeight = 450;
+
+static int native_rand(VirtualMachine *vm, int argc, Value *args)
+{
+    vm->push(NUMBER(Random()));
+    return 1;
+}
+
+static int native_clock(VirtualMachine *vm, int argc, Value *args)
+{
+    vm->push(NUMBER((double)clock() / CLOCKS_PER_SEC));
+    return 1;
+}
+
+static int native_mouse_x(VirtualMachine *vm, int argc, Value *args)
+{
+    vm->push(NUMBER(screenWidth / 2));
+    return 1;
+}
+
+static int native_mouse_y(VirtualMachine *vm, int argc, Value *args)
+{
+    vm->push(NUMBER(screenHeight / 2));
+    return 1;
+}
+
+static int native_true(VirtualMachine *vm, int argc, Value *args)
+{
+    vm->push(BOOLEAN(true));
+    return 1;
+}
+
+static int native_nop(VirtualMachine *vm, int argc, Value *args)
+{
+    return 0;
+}
+
+static double drawn = 0;
+
+static void render_batch(const RenderBatch *batch)
+{
+    for (u32 i = 0; i < batch->count; i++)
+    {
+        drawn += batch->x[i] + batch->y[i];
+    }
+}
+
+static void registerNatives(VirtualMachine &vm)
+{
+    // the stubs are safe on worker threads, rand() is not
+    vm.registerFunction("write", native_nop, -1, true);
+    vm.registerFunction("writeln", native_nop, -1, true);
+    vm.registerFunction("clock", native_clock, 0, true);
+    vm.registerFunction("rand", native_rand, 0);
+    vm.registerFunction("text", native_nop, 4, true);
+    vm.registerFunction("key_down", native_true, 1, true);
+    vm.registerFunction("key_press", native_true, 1, true);
+    vm.registerFunction("mouse_down", native_true, 1, true);
+    vm.registerFunction("mouse_press", native_true, 1, true);
+    vm.registerFunction("mouse_release", native_true, 1, true);
+    vm.registerFunction("mouse_x", native_mouse_x, 0, true);
+    vm.registerFunction("mouse_y", native_mouse_y, 0, true);
+
+    vm.registerInteger("screenWidth", screenWidth);
+    vm.registerInteger("screenHeight", screenHeight);
+}
+
+static double runScript(const String &source, int frames, int threads, bool batch, bool jit, u32 *processes)
+{
+    srand(1);
+
+    VirtualMachine vm;
+    registerNatives(vm);
+    vm.setThreads(threads);
+    if (jit)
+        vm.enableJit();
+    if (batch)
+        vm.hooks.render_batch_hook = render_batch;
+
+    if (!vm.Compile(source))
+        return -1;
+
+    auto start = std::chrono::steady_clock::now();
+
+    vm.Run();
+    u32 peak = 0;
+    for (int i = 0; i < frames && vm.size() > 0; i++)
+    {
+        vm.Update();
+        if (vm.size() > peak)
+            peak = vm.size();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    *processes = peak;
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 600;
+    int repeat = 5;
+    int threads = 1;
+    bool batch = false;
+    bool jit = false;
+
+    Vector<const char *> scripts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-batch") == 0)
+            batch = true;
+        else if (strcmp(argv[i], "-jit") == 0)
+            jit = true;
+        else
+            scripts.push_back(argv[i]);
+    }
+    if (scripts.empty())
+    {
+        scripts.push_back("proc.pc");
+        scripts.push_back("bunny.pc");
+    }
+
+#if defined(BULANG_AOT)
+    const char *mode = "aot";
+#elif defined(NO_SUPERINSTRUCTIONS)
+    const char *mode = "unfused";
+#elif defined(USE_COMPUTED_GOTO)
+    const char *mode = "computed goto";
+#else
+    const char *mode = "switch";
+#endif
+
+    // the scripts print and the VM logs to stdout, keep the report on stderr
+    FILE *quiet = freopen("/dev/null", "w", stdout);
+    (void)quiet;
+
+    for (size_t i = 0; i < scripts.size(); i++)
+    {
+        char *text = LoadTextFile(scripts[i]);
+        if (!text)
+        {
+            fprintf(stderr, "Failed to load %s\n", scripts[i]);
+            return 1;
+        }
+        String source(text);
+        FreeTextFile(text);
+
+        double best = 0;
+        u32 processes = 0;
+        for (int r = 0; r < repeat; r++)
+        {
+            double ms = runScript(source, frames, threads, batch, jit, &processes);
+            if (ms < 0)
+            {
+                fprintf(stderr, "Failed to compile %s\n", scripts[i]);
+                return 1;
+            }
+            if (r == 0 || ms < best)
+                best = ms;
+        }
+        fprintf(stderr, "%-14s%-4s %-10s frames %4d  threads %2d  render %-9s processes %6u  best %9.3f ms\n",
+                mode, jit ? "+jit" : "", scripts[i], frames, threads, batch ? "batch" : "per-proc", processes, best);
+    }
+
+#ifdef OPCODE_PAIR_STATS
+    PrintOpcodePairs(stderr, 30);
+#endif
+
+    return 0;
+}
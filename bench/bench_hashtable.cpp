@@ -0,0 +1,282 @@
+#include "pch.h"
+
+#include "Config.hpp"
+#include "Utils.hpp"
+#include "Vector.hpp"
+#include "Map.hpp"
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+// HashTable (open addressing) against the chained table it replaced and
+// std::unordered_map<std::string>, on tables the size of our keyword, native
+// and global maps and a bigger one. Times inserts, hits and misses per key.
+
+// The previous HashTable: one node per entry, fixed 128 byte keys.
+template <typename T>
+class ChainedTable
+{
+private:
+    struct Node
+    {
+        char key[128]{'\0'};
+        size_t len;
+        T value;
+        Node *next;
+    };
+
+    Node **table;
+    u32 capacity;
+    u32 size;
+
+    u32 HashStr(const char *index) const
+    {
+        u32 iIndex = 2166136261u;
+        while (*index)
+        {
+            iIndex ^= *index++;
+            iIndex *= 16777619;
+        }
+        iIndex = (iIndex >> 16) ^ iIndex;
+        return iIndex & (capacity - 1);
+    }
+
+    void resizeTable(u32 newCapacity)
+    {
+        u32 oldCapacity = capacity;
+        capacity = newCapacity;
+        Node **newTable = new Node *[newCapacity]();
+        for (u32 i = 0; i < oldCapacity; ++i)
+        {
+            Node *node = table[i];
+            while (node)
+            {
+                Node *next = node->next;
+                u32 index = HashStr(node->key);
+                node->next = newTable[index];
+                newTable[index] = node;
+                node = next;
+            }
+        }
+        delete[] table;
+        table = newTable;
+    }
+
+public:
+    ChainedTable() : capacity(16), size(0)
+    {
+        table = new Node *[capacity]();
+    }
+
+    ~ChainedTable()
+    {
+        for (u32 i = 0; i < capacity; ++i)
+        {
+            Node *node = table[i];
+            while (node)
+            {
+                Node *next = node->next;
+                delete node;
+                node = next;
+            }
+        }
+        delete[] table;
+    }
+
+    void insert(const char *key, const T &value)
+    {
+        if ((float)(size + 1) / capacity > 0.75f)
+            resizeTable(capacity * 2);
+
+        u32 index = HashStr(key);
+        Node *node = new Node();
+        node->len = strlen(key);
+        memcpy(node->key, key, node->len + 1);
+        node->value = value;
+        node->next = table[index];
+        table[index] = node;
+        ++size;
+    }
+
+    bool find(const char *key, T &value) const
+    {
+        Node *node = table[HashStr(key)];
+        while (node)
+        {
+            if (matchString(key, node->key, node->len))
+            {
+                value = node->value;
+                return true;
+            }
+            node = node->next;
+        }
+        return false;
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double nsPer(Clock::time_point start, u32 operations)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / operations;
+}
+
+struct Result
+{
+    double insert;
+    double hit;
+    double miss;
+    u64 found;
+};
+
+static void keepBest(Result &best, const Result &result, int r)
+{
+    if (r == 0 || result.insert < best.insert)
+        best.insert = result.insert;
+    if (r == 0 || result.hit < best.hit)
+        best.hit = result.hit;
+    if (r == 0 || result.miss < best.miss)
+        best.miss = result.miss;
+    best.found = result.found;
+}
+
+static Result runHashTable(const Vector<std::string> &keys, const Vector<std::string> &lookups,
+                        const Vector<std::string> &misses, int rounds)
+{
+    Result result = {};
+    u32 n = (u32)keys.size();
+
+    auto start = Clock::now();
+    HashTable<u32> table;
+    for (u32 i = 0; i < n; i++)
+        table.insert(keys[i].c_str(), (u32)keys[i].size(), i);
+    result.insert = nsPer(start, n);
+
+    u32 value = 0;
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+            result.found += table.find(lookups[i].c_str(), (u32)lookups[i].size(), value) ? value : 0;
+    result.hit = nsPer(start, n * rounds);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+            result.found += table.find(misses[i].c_str(), (u32)misses[i].size(), value);
+    result.miss = nsPer(start, n * rounds);
+    return result;
+}
+
+static Result runChained(const Vector<std::string> &keys, const Vector<std::string> &lookups,
+                        const Vector<std::string> &misses, int rounds)
+{
+    Result result = {};
+    u32 n = (u32)keys.size();
+
+    auto start = Clock::now();
+    ChainedTable<u32> *table = new ChainedTable<u32>();
+    for (u32 i = 0; i < n; i++)
+        table->insert(keys[i].c_str(), i);
+    result.insert = nsPer(start, n);
+
+    u32 value = 0;
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+            result.found += table->find(lookups[i].c_str(), value) ? value : 0;
+    result.hit = nsPer(start, n * rounds);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+            result.found += table->find(misses[i].c_str(), value);
+    result.miss = nsPer(start, n * rounds);
+
+    delete table;
+    return result;
+}
+
+static Result runStd(const Vector<std::string> &keys, const Vector<std::string> &lookups,
+                        const Vector<std::string> &misses, int rounds)
+{
+    Result result = {};
+    u32 n = (u32)keys.size();
+
+    auto start = Clock::now();
+    std::unordered_map<std::string, u32> table;
+    for (u32 i = 0; i < n; i++)
+        table.emplace(keys[i], i);
+    result.insert = nsPer(start, n);
+
+    // the lexer and parser look up by const char *, pay for the std::string
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+        {
+            auto it = table.find(lookups[i].c_str());
+            result.found += it != table.end() ? it->second : 0;
+        }
+    result.hit = nsPer(start, n * rounds);
+
+    start = Clock::now();
+    for (int r = 0; r < rounds; r++)
+        for (u32 i = 0; i < n; i++)
+            result.found += table.find(misses[i].c_str()) != table.end();
+    result.miss = nsPer(start, n * rounds);
+    return result;
+}
+
+static void report(const char *name, u32 keys, const Result &best)
+{
+    fprintf(stderr, "%-14s keys %6u  insert %7.2f ns  hit %7.2f ns  miss %7.2f ns  (%llu)\n",
+            name, keys, best.insert, best.hit, best.miss, (unsigned long long)best.found);
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 5;
+    u32 operations = 4000000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-ops") == 0 && i + 1 < argc)
+            operations = (u32)atoi(argv[++i]);
+    }
+
+    static const u32 sizes[] = {32, 256, 4096, 65536};
+    for (u32 size : sizes)
+    {
+        Vector<std::string> keys;
+        Vector<std::string> misses;
+        char buffer[64];
+        for (u32 i = 0; i < size; i++)
+        {
+            snprintf(buffer, sizeof(buffer), "identifier_%u", i * 7919u);
+            keys.push_back(buffer);
+            snprintf(buffer, sizeof(buffer), "missing_%u", i * 7919u);
+            misses.push_back(buffer);
+        }
+        // look up in another order than insertion, the chained table's
+        // nodes would otherwise be walked in allocation order
+        Vector<std::string> lookups;
+        for (u32 i = 0; i < size; i++)
+            lookups.push_back(keys[(u32)(((u64)i * 40503u) % size)]);
+        int rounds = (int)(operations / size);
+        if (rounds < 1)
+            rounds = 1;
+
+        Result open = {}, chained = {}, standard = {};
+        for (int r = 0; r < repeat; r++)
+        {
+            keepBest(open, runHashTable(keys, lookups, misses, rounds), r);
+            keepBest(chained, runChained(keys, lookups, misses, rounds), r);
+            keepBest(standard, runStd(keys, lookups, misses, rounds), r);
+        }
+        report("HashTable", size, open);
+        report("chained", size, chained);
+        report("unordered_map", size, standard);
+    }
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "pch.h"
+
+#include "Config.hpp"
+#include "Utils.hpp"
+#include "Vm.hpp"
+#include <chrono>
+
+// Startup: VirtualMachine::Compile of a script against Load of the same
+// program saved as .pcb and against Compile hitting the compile cache, each
+// into a fresh vm with the host natives. Runs the bench scripts and a
+// generated one with -functions declarations, the size of a bigger game.
+
+static int native_nop(VirtualMachine *vm, int argc, Value *args)
+{
+    return 0;
+}
+
+static void registerNatives(VirtualMachine &vm)
+{
+    static const char *names[] = {"write", "writeln", "clock", "rand", "text", "key_down", "key_press",
+                                  "mouse_down", "mouse_press", "mouse_release", "mouse_x", "mouse_y"};
+    static const int arities[] = {-1, -1, 0, 0, 4, 1, 1, 1, 1, 1, 0, 0};
+    for (size_t i = 0; i < sizeof(arities) / sizeof(arities[0]); i++)
+        vm.registerFunction(names[i], native_nop, arities[i]);
+    vm.registerInteger("screenWidth", 800);
+    vm.registerInteger("screenHeight", 450);
+}
+
+static String generate(int functions)
+{
+    String source = "program generated;\n";
+    char line[256];
+    for (int i = 0; i < functions; i++)
+    {
+        snprintf(line, sizeof(line),
+                 "def f%d(a, b)\n{\n    var sum = 0;\n    var i = 0;\n    while (i < a)\n    {\n"
+                 "        if (i %% 3 == 0) { sum = sum + b * %d; } else { sum = sum - %d.5; }\n"
+                 "        i = i + 1;\n    }\n    return sum + \"f%d\";\n}\n",
+                 i, i, i, i);
+        source += line;
+    }
+    for (int i = 0; i < functions; i++)
+    {
+        snprintf(line, sizeof(line), "var r%d = f%d(%d, 2);\n", i, i, i % 7);
+        source += line;
+    }
+    return source;
+}
+
+// ms of the best run, -1 if it failed
+static double timeCompile(const String &source, int repeat, const char *cache)
+{
+    double best = -1;
+    for (int r = 0; r < repeat; r++)
+    {
+        VirtualMachine vm;
+        registerNatives(vm);
+        vm.setCompileCache(cache);
+        auto start = std::chrono::steady_clock::now();
+        if (!vm.Compile(source))
+            return -1;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (best < 0 || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+static double timeLoad(const char *path, int repeat)
+{
+    double best = -1;
+    for (int r = 0; r < repeat; r++)
+    {
+        VirtualMachine vm;
+        registerNatives(vm);
+        auto start = std::chrono::steady_clock::now();
+        if (!vm.Load(path))
+            return -1;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (best < 0 || ms < best)
+            best = ms;
+    }
+    return best;
+}
+
+// kept between runs, the same sources map to the same files
+static const char *cacheDirectory = "bench_startup_cache";
+
+static bool save(const String &source, const char *path)
+{
+    VirtualMachine vm;
+    registerNatives(vm);
+    return vm.Compile(source) && vm.Save(path);
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 20;
+    int functions = 500;
+
+    Vector<const char *> scripts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-functions") == 0 && i + 1 < argc)
+            functions = atoi(argv[++i]);
+        else
+            scripts.push_back(argv[i]);
+    }
+    if (scripts.empty())
+    {
+        scripts.push_back("proc.pc");
+        scripts.push_back("bunny.pc");
+        scripts.push_back("main.pc");
+    }
+
+    // the VM logs to stdout, keep the report on stderr
+    FILE *quiet = freopen("/dev/null", "w", stdout);
+    (void)quiet;
+
+    const char *path = "bench_startup.pcb";
+    for (size_t i = 0; i <= scripts.size(); i++)
+    {
+        String source;
+        String name;
+        if (i < scripts.size())
+        {
+            char *text = LoadTextFile(scripts[i]);
+            if (!text)
+            {
+                fprintf(stderr, "Failed to load %s\n", scripts[i]);
+                return 1;
+            }
+            source = text;
+            name = scripts[i];
+            FreeTextFile(text);
+        }
+        else
+        {
+            source = generate(functions);
+            name = "generated";
+        }
+
+        if (!save(source, path))
+        {
+            fprintf(stderr, "Failed to compile %s\n", name.c_str());
+            return 1;
+        }
+        double compiled = timeCompile(source, repeat, nullptr);
+        double loaded = timeLoad(path, repeat);
+        // the first run fills the cache, the best is a hit
+        double cached = timeCompile(source, repeat + 1, cacheDirectory);
+        fprintf(stderr, "%-10s source %8zu bytes  compile %8.3f ms  load .pcb %8.3f ms  cached compile %8.3f ms\n",
+                name.c_str(), source.length(), compiled, loaded, cached);
+    }
+    remove(path);
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include "pch.h"
+
+#include "Config.hpp"
+#include "Utils.hpp"
+#include "Vm.hpp"
+#include <chrono>
+#include <new>
+
+// Counts heap allocations while compiling scripts (lexer + parser) and while
+// running string concatenation through op_add.
+// Built twice by CMake: bench_string (inline String storage) and
+// bench_string_heap (STRING_INLINE=1, every non-empty String on the heap),
+// the difference between the two is what the small-string buffer removes.
+
+static u64 allocations = 0;
+static u64 allocated = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    allocated += size;
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static const char *concatScript =
+    "program concat;\n"
+    "var i = 0;\n"
+    "var s = \"\";\n"
+    "var t = \"\";\n"
+    "while (i < 20000)\n"
+    "{\n"
+    "    s = \"id\" + i;\n"
+    "    t = s + \"_\" + \"name\";\n"
+    "    i = i + 1;\n"
+    "}\n";
+
+static int native_nop(VirtualMachine *vm, int argc, Value *args)
+{
+    return 0;
+}
+
+// only resolved by the compiler, the concat script calls none of them
+static void registerNatives(VirtualMachine &vm)
+{
+    static const char *names[] = {"write", "writeln", "clock", "toInt", "toString", "text",
+                                  "key_down", "key_press", "mouse_down", "mouse_press",
+                                  "mouse_release", "mouse_x", "mouse_y", "rand"};
+    static const int argcs[] = {-1, -1, 0, 1, 1, 4, 1, 1, 1, 1, 1, 0, 0, 0};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        vm.registerFunction(names[i], native_nop, argcs[i]);
+    }
+    vm.registerInteger("screenWidth", 800);
+    vm.registerInteger("screenHeight", 450);
+}
+
+struct Sample
+{
+    u64 allocations;
+    u64 bytes;
+    double ms;
+};
+
+static void report(const char *phase, const char *name, const Sample &best)
+{
+    fprintf(stderr, "%-8s %-10s inline %3d  allocations %9llu  bytes %11llu  best %9.3f ms\n",
+            phase, name, STRING_INLINE, (unsigned long long)best.allocations,
+            (unsigned long long)best.bytes, best.ms);
+}
+
+static void keep(Sample &best, const Sample &sample, int r)
+{
+    if (r == 0 || sample.ms < best.ms)
+        best.ms = sample.ms;
+    best.allocations = sample.allocations;
+    best.bytes = sample.bytes;
+}
+
+static bool compileScript(const String &source, Sample *sample)
+{
+    VirtualMachine vm;
+    registerNatives(vm);
+
+    u64 count = allocations;
+    u64 bytes = allocated;
+    auto start = std::chrono::steady_clock::now();
+
+    bool ok = vm.Compile(source);
+
+    auto end = std::chrono::steady_clock::now();
+    sample->allocations = allocations - count;
+    sample->bytes = allocated - bytes;
+    sample->ms = std::chrono::duration<double, std::milli>(end - start).count();
+    return ok;
+}
+
+static bool runConcat(Sample *sample)
+{
+    VirtualMachine vm;
+    if (!vm.Compile(concatScript))
+        return false;
+
+    u64 count = allocations;
+    u64 bytes = allocated;
+    auto start = std::chrono::steady_clock::now();
+
+    vm.Run();
+
+    auto end = std::chrono::steady_clock::now();
+    sample->allocations = allocations - count;
+    sample->bytes = allocated - bytes;
+    sample->ms = std::chrono::duration<double, std::milli>(end - start).count();
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = 5;
+
+    Vector<const char *> scripts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+            repeat = atoi(argv[++i]);
+        else
+            scripts.push_back(argv[i]);
+    }
+    if (scripts.empty())
+    {
+        scripts.push_back("proc.pc");
+        scripts.push_back("bunny.pc");
+        scripts.push_back("main.pc");
+    }
+
+    // the VM logs to stdout, keep the report on stderr
+    FILE *quiet = freopen("/dev/null", "w", stdout);
+    (void)quiet;
+
+    for (size_t i = 0; i < scripts.size(); i++)
+    {
+        char *text = LoadTextFile(scripts[i]);
+        if (!text)
+        {
+            fprintf(stderr, "Failed to load %s\n", scripts[i]);
+            return 1;
+        }
+        String source(text);
+        FreeTextFile(text);
+
+        Sample best = {};
+        for (int r = 0; r < repeat; r++)
+        {
+            Sample sample;
+            if (!compileScript(source, &sample))
+            {
+                fprintf(stderr, "Failed to compile %s\n", scripts[i]);
+                return 1;
+            }
+            keep(best, sample, r);
+        }
+        report("compile", scripts[i], best);
+    }
+
+    Sample best = {};
+    for (int r = 0; r < repeat; r++)
+    {
+        Sample sample;
+        if (!runConcat(&sample))
+        {
+            fprintf(stderr, "Failed to compile the concat script\n");
+            return 1;
+        }
+        keep(best, sample, r);
+    }
+    report("op_add", "concat", best);
+
+    return 0;
+}
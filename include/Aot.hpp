@@ -0,0 +1,231 @@
+#pragma once
+#include "Vm.hpp"
+
+// Ahead-of-time compiled chunks. bulang-aot (tools/bulang_aot.cpp) compiles
+// scripts like the host does and writes every verified chunk as one C++
+// function with a label per instruction: jumps are gotos, operands are
+// immediates, numbers take an inline path and everything else calls the Aot
+// helpers below, which do what Task::Run does for that opcode.
+//
+// The host links the generated file, its AotModule registers the bodies at
+// startup and VirtualMachine::Compile attaches a body to each chunk whose
+// name and hash (code, constants and the names it refers to) match. A body
+// keeps the frame layout, the instruction budget and the FRAME/yield points
+// of the interpreter: it leaves with ip at the next instruction and a switch
+// over every instruction start resumes it there.
+
+// the frame a body runs, synced with the task around every helper call
+struct AotContext
+{
+    Task *task; // the running task, a process runs its prototype's code
+    Frame *frame;
+    Value *sp;
+    u8 *code;
+    const Value *constants;
+    Value *globals;
+    VirtualMachine *vm;
+    u32 slot;     // engine slot of a process
+    u32 executed; // instructions of this Run so far
+    bool parallel; // on a worker thread, globals wait for the serial phase
+};
+
+struct AotChunk
+{
+    const char *name;
+    u64 hash;
+    AotBody body;
+};
+
+// one per generated file, a static instance links its chunks in
+struct AotModule
+{
+    const AotChunk *chunks;
+    u32 count;
+    AotModule *next;
+
+    AotModule(const AotChunk *chunks, u32 count);
+};
+
+// a body ran out of the instruction budget, Run returns RUNNING
+static const int AOT_YIELD = 8;
+
+class Aot
+{
+public:
+    // identity of a compiled chunk, the same in bulang-aot and in the host
+    static u64 hash(const Task *task);
+    static AotBody find(const char *name, u64 hash);
+    // attaches the linked bodies to the compiled chunks of vm
+    static void attach(VirtualMachine *vm);
+    // writes the verified chunks of vm as C++, prefix keeps the names of
+    // several scripts in one file apart; false if nothing was written
+    static bool write(VirtualMachine *vm, FILE *out, const char *prefix);
+
+    // Task::Run for a top frame with a native body
+    static u8 run(Task *task, AotBody body);
+
+    // called by the bodies with c synced; OK continues, anything else
+    // is returned from Run as it is
+    static u8 binary(AotContext &c, u8 op);
+    static u8 unary(AotContext &c, u8 op);
+    static u8 simple(AotContext &c, u8 op, u8 operand);
+    static u8 global(AotContext &c, u8 op, u16 slot);
+    static u8 readGlobal(AotContext &c, u16 slot);
+    static u8 engineError(AotContext &c, u8 local);
+    static u8 frame(AotContext &c);
+    static u8 callNative(AotContext &c, u16 index, u8 argCount);
+    // runs a native callee in place, OK once it returned
+    static u8 callScript(AotContext &c, u16 index, u8 argCount);
+    // these leave the body
+    static u8 callProcess(AotContext &c, u16 index, u8 argCount);
+    static u8 ret(AotContext &c);
+    static u8 returnProcess(AotContext &c);
+
+    static Value nil() { return VirtualMachine::DEFAULT; }
+};
+
+static inline double AotMod(double a, double divisor)
+{
+    double result = fmod(a, divisor);
+    if (result != 0 && ((a < 0) != (divisor < 0)))
+    {
+        result += divisor;
+    }
+    return result;
+}
+
+// What the generated code is written in. at/next are the offsets of the
+// instruction and of the one after it, n the instructions it counts as.
+
+#define AOT_ENTER()                        \
+    Value *sp = c.sp;                      \
+    Value *slots = c.frame->slots;         \
+    const Value *k = c.constants;          \
+    u32 executed = c.executed;             \
+    (void)k;                               \
+    (void)slots;
+
+#define AOT_SAVE(next) (c.sp = sp, c.executed = executed, c.frame->ip = c.code + (next))
+#define AOT_LOAD() (sp = c.sp, slots = c.frame->slots, executed = c.executed)
+
+#define AOT_CALL(next, call)         \
+    {                                \
+        AOT_SAVE(next);              \
+        u8 status = (call);          \
+        if (status != OK)            \
+            return status;           \
+        AOT_LOAD();                  \
+    }
+#define AOT_LEAVE(next, call)        \
+    {                                \
+        AOT_SAVE(next);              \
+        return (call);               \
+    }
+
+#define AOT_NEXT(n, next)                              \
+    if ((executed += (n)) >= instructionsPerFrame)     \
+    {                                                  \
+        AOT_SAVE(next);                                \
+        return AOT_YIELD;                              \
+    }
+#define AOT_GOTO(n, target)         \
+    {                               \
+        AOT_NEXT(n, target);        \
+        goto L##target;             \
+    }
+
+#define AOT_PUSH(value) (*sp++ = (value))
+
+#define AOT_NUMBER_OP(op, next, guard, expression)                   \
+    {                                                                \
+        bool numbers = IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1]);       \
+        double x = numbers ? AS_NUMBER(sp[-2]) : 0;                  \
+        double y = numbers ? AS_NUMBER(sp[-1]) : 0;                  \
+        if (numbers && (guard))                                      \
+        {                                                            \
+            sp--;                                                    \
+            sp[-1] = expression;                                     \
+        }                                                            \
+        else                                                         \
+            AOT_CALL(next, Aot::binary(c, OpCode::op));              \
+    }
+
+#define AOT_EQUAL()                                    \
+    {                                                  \
+        Value b = *--sp;                               \
+        sp[-1] = BOOLEAN(MatchValue(sp[-1], b));       \
+    }
+
+#define AOT_COMPARE_JUMP(op, compare, next, target)                  \
+    {                                                                \
+        bool result;                                                 \
+        if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1]))                  \
+        {                                                            \
+            result = AS_NUMBER(sp[-2]) compare AS_NUMBER(sp[-1]);    \
+            sp -= 2;                                                 \
+        }                                                            \
+        else                                                         \
+        {                                                            \
+            AOT_CALL(next, Aot::binary(c, OpCode::op));              \
+            result = !isFalsey(*--sp);                               \
+        }                                                            \
+        if (!result)                                                 \
+            AOT_GOTO(3, target);                                     \
+        AOT_NEXT(3, next);                                           \
+    }
+
+#define AOT_LOCAL_SET(slot)               \
+    {                                     \
+        WRITE_BARRIER(sp[-1]);            \
+        slots[slot] = sp[-1];             \
+    }
+#define AOT_LOCAL_STORE(slot)             \
+    {                                     \
+        Value value = *--sp;              \
+        WRITE_BARRIER(value);             \
+        slots[slot] = value;              \
+    }
+
+#define AOT_GLOBAL(next, slot, name)                             \
+    Value name = c.globals[slot];                                \
+    if (c.parallel || IS_UNDEFINED(name))                        \
+        AOT_CALL(next, Aot::readGlobal(c, slot));
+
+#define AOT_ADD_VALUE(next, value)                                   \
+    {                                                                \
+        Value b = (value);                                           \
+        if (IS_NUMBER(sp[-1]) && IS_NUMBER(b))                       \
+        {                                                            \
+            sp[-1] = NUMBER(AS_NUMBER(sp[-1]) + AS_NUMBER(b));       \
+        }                                                            \
+        else                                                         \
+        {                                                            \
+            *sp++ = b;                                               \
+            AOT_CALL(next, Aot::binary(c, OpCode::ADD));             \
+        }                                                            \
+    }
+
+#define AOT_LOCAL_INC(next, slot, value)                             \
+    {                                                                \
+        Value b = (value);                                           \
+        if (IS_NUMBER(slots[slot]) && IS_NUMBER(b))                  \
+        {                                                            \
+            slots[slot] = NUMBER(AS_NUMBER(slots[slot]) + AS_NUMBER(b)); \
+        }                                                            \
+        else                                                         \
+        {                                                            \
+            *sp++ = slots[slot];                                     \
+            *sp++ = b;                                               \
+            AOT_CALL(next, Aot::binary(c, OpCode::ADD));             \
+            AOT_LOCAL_STORE(slot);                                   \
+        }                                                            \
+    }
+
+#define AOT_ENGINE(local) (c.vm->getEngineColumn(local)[c.slot])
+#define AOT_ENGINE_SET(next, local, drop)                            \
+    {                                                                \
+        if (!IS_NUMBER(sp[-1]))                                      \
+            AOT_CALL(next, Aot::engineError(c, local));              \
+        AOT_ENGINE(local) = AS_NUMBER(sp[-1]);                       \
+        sp -= (drop);                                                \
+    }
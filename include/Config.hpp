@@ -17,6 +17,12 @@ typedef uint64_t u64;
 #define DEBUG_BREAK_IF(_CONDITION_)
 #endif
 
+// Task::Run dispatch: GCC/Clang jump from handler to handler through a label
+// table (computed goto). Define USE_SWITCH_DISPATCH to force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(USE_SWITCH_DISPATCH)
+#define USE_COMPUTED_GOTO
+#endif
+
 inline size_t CalculateCapacityGrow(size_t capacity, size_t minCapacity)
 {
     if (capacity < minCapacity)
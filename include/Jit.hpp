@@ -0,0 +1,57 @@
+#pragma once
+#include "Aot.hpp"
+
+// Baseline JIT (x86-64 Linux). The interpreter counts calls into a chunk and
+// the loop back edges in it; once a verified chunk is hot, tierUp (between
+// Runs, never on worker threads) stitches a stencil per instruction into
+// executable memory. Stencils are fixed machine code with holes for the
+// operands, jump targets and helper addresses: locals, constants, number math
+// and compares inline, the rest calls the Aot helpers or a small C++ stencil.
+//
+// The result is an AotBody, Task::Run runs it like an AOT compiled chunk: same
+// frame layout, instruction budget and FRAME yields, resumed through a table
+// from bytecode offset to code. A quickened _NUM opcode is compiled as a
+// guess, when its guard fails the code deoptimizes: the chunk goes back to the
+// interpreter at that instruction and may get compiled again once it's hot.
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+#define USE_JIT
+#endif
+
+// calls plus loop iterations before a chunk is compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// a chunk that deoptimized this often stays interpreted
+#define JIT_MAX_DEOPTS 3
+
+class Jit
+{
+    // one mapping per compiled chunk, kept until the vm goes away: a
+    // deoptimized body may still be running further down the frames
+    struct Block
+    {
+        void *memory;
+        size_t size;
+    };
+    Vector<Block> blocks;
+
+    void consider(Task *task);
+
+public:
+    Jit();
+    ~Jit();
+
+    // a chunk crossed JIT_THRESHOLD, set by the interpreter (workers too)
+    bool pending;
+    u32 compiled;
+
+    // compiles the chunks that got hot since the last call
+    void tierUp(VirtualMachine *vm);
+    // native code for the chunk of task, nullptr for one it can't compile
+    AotBody compile(Task *task);
+
+    // called by the code of a failed guard with c synced at the instruction
+    static u8 deopt(AotContext &c);
+};
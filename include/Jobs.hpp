@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Config.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+typedef void (*JobFunction)(void *user, u32 index);
+
+// Fixed set of worker threads running an index range [0, count) per call.
+// Each worker starts on its own slice and takes batches off the front of it;
+// once empty it steals the back half of the busiest slice left.
+// The calling thread works as worker 0, so run() returns when every index is done.
+class JobPool
+{
+private:
+    struct alignas(64) Range
+    {
+        std::mutex lock;
+        u32 begin;
+        u32 end;
+    };
+
+    std::thread *threads;
+    Range *ranges;
+    u32 count;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    u64 generation;
+    u32 pending;
+    bool quit;
+
+    JobFunction function;
+    void *user;
+
+    bool take(u32 worker, u32 &begin, u32 &end);
+    bool steal(u32 worker);
+    void work(u32 worker);
+    void loop(u32 worker);
+
+public:
+    JobPool();
+    ~JobPool();
+
+    // count includes the calling thread, 0 or 1 means no workers
+    void start(u32 count);
+    void stop();
+
+    u32 size() const { return count; }
+
+    void run(u32 jobs, JobFunction function, void *user);
+};
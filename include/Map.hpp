@@ -2,324 +2,335 @@
 
 #pragma once
 
+// One entry per key in insertion order. The key bytes live in the table's key
+// pool (offset, not pointer, so the pool can grow), the hash is cached.
+// hash 0 marks an erased entry, it is dropped at the next rehash.
 template <typename T>
-class HashNode
+struct HashEntry
 {
-public:
-    char key[128]{'\0'};
-    size_t len;
+    u32 hash;
+    u32 len;
+    u32 key;
     T value;
-    HashNode *next;
-
-    HashNode(const char *k, const T &v) : value(v), next(nullptr)
-    {
-        len = strlen(k);
-        memcpy(key, k, len + 1);
-        key[len] = '\0';
-    }
-    ~HashNode()
-    {
-        next = nullptr;
-    }
 };
 
+// Open addressing with Robin Hood probing over a dense entry array.
+// A slot holds the cached hash and the entry index, so probes compare hashes
+// and lengths before touching key bytes and a lookup never calls strlen when
+// the caller passes the length. Iteration walks the entries in insertion order.
 template <typename T>
 class HashTable
 {
 private:
-    HashNode<T> **table;
+    struct Slot
+    {
+        u32 hash; // 0 = empty
+        u32 entry;
+    };
 
-    u32 capacity;
+    Slot *slots;
+    u32 capacity; // slots, power of 2
+    u32 mask;
+
+    HashEntry<T> *entries;
+    u32 count; // entries used, erased ones included
+    u32 limit; // entries before a rehash, 3/4 of capacity
     u32 size;
-    HashNode<T> *m_Iter;
+
+    char *keys;
+    u32 keysUsed;
+    u32 keysCapacity;
+
     u32 m_IterIndex;
 
-    const float loadFactorThreshold = 0.75f;
-
-    // u32 HashStr(const char *index) const
-    // {
-    //     u32 iIndex = 2166136261u;
-    //     while (*index)
-    //     {
-    //         iIndex ^= *index;
-    //         iIndex *= 16777619;
-    //         index++;
-    //     }
-    //     iIndex = (iIndex >> 16) ^ iIndex;
-    //     return iIndex & (capacity - 1); // capacity must be a power of 2
-    // }
-
-    u32 HashStr(const char *index) const
+    static u32 HashStr(const char *key, u32 len)
     {
-        u32 iIndex = 2166136261u;
-        while (*index)
+        u32 hash = 2166136261u;
+        for (u32 i = 0; i < len; i++)
         {
-            iIndex ^= *index++;
-            iIndex *= 16777619;
+            hash ^= (u8)key[i];
+            hash *= 16777619;
+        }
+        // linear probing needs the low bits mixed, FNV alone clusters them
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6b;
+        hash ^= hash >> 13;
+        return hash ? hash : 1;
+    }
+
+    u32 distance(u32 index, u32 hash) const
+    {
+        return (index - (hash & mask)) & mask;
+    }
 
-            if (*index)
+    // slot index of key, or capacity when missing
+    u32 lookup(const char *key, u32 len, u32 hash) const
+    {
+        u32 index = hash & mask;
+        for (u32 dist = 0;; dist++)
+        {
+            const Slot &slot = slots[index];
+            if (slot.hash == 0 || distance(index, slot.hash) < dist)
+                return capacity;
+            if (slot.hash == hash)
             {
-                iIndex ^= *index++;
-                iIndex *= 16777619;
+                const HashEntry<T> &entry = entries[slot.entry];
+                if (entry.len == len && memcmp(keys + entry.key, key, len) == 0)
+                    return index;
             }
+            index = (index + 1) & mask;
+        }
+    }
 
-            if (*index)
+    void place(u32 hash, u32 entry)
+    {
+        Slot current = {hash, entry};
+        u32 index = hash & mask;
+        for (u32 dist = 0;; dist++)
+        {
+            Slot &slot = slots[index];
+            if (slot.hash == 0)
             {
-                iIndex ^= *index++;
-                iIndex *= 16777619;
+                slot = current;
+                return;
             }
-
-            if (*index)
+            u32 other = distance(index, slot.hash);
+            if (other < dist)
             {
-                iIndex ^= *index++;
-                iIndex *= 16777619;
+                Slot temp = slot;
+                slot = current;
+                current = temp;
+                dist = other;
             }
+            index = (index + 1) & mask;
         }
-        iIndex = (iIndex >> 16) ^ iIndex;
-        return iIndex & (capacity - 1); // capacity must be a power of 2
     }
 
-    void resizeTable(u32 newCapacity)
+    // backward shift, no tombstones in the slot array
+    void unplace(u32 index)
     {
-        u32 oldCapacity = capacity;
-        capacity = newCapacity;
-        size = 0; // size will be recalculated during rehashing
+        u32 next = (index + 1) & mask;
+        while (slots[next].hash && distance(next, slots[next].hash) > 0)
+        {
+            slots[index] = slots[next];
+            index = next;
+            next = (next + 1) & mask;
+        }
+        slots[index].hash = 0;
+    }
+
+    u32 storeKey(const char *key, u32 len)
+    {
+        if (keysUsed + len + 1 > keysCapacity)
+        {
+            u32 newCapacity = keysCapacity ? keysCapacity : 64;
+            while (newCapacity < keysUsed + len + 1)
+                newCapacity *= 2;
+            char *newKeys = new char[newCapacity];
+            if (keysUsed)
+                memcpy(newKeys, keys, keysUsed);
+            delete[] keys;
+            keys = newKeys;
+            keysCapacity = newCapacity;
+        }
+        u32 offset = keysUsed;
+        memcpy(keys + offset, key, len);
+        keys[offset + len] = '\0';
+        keysUsed += len + 1;
+        return offset;
+    }
 
-        HashNode<T> **newTable = new HashNode<T> *[newCapacity]();
-        for (size_t i = 0; i < oldCapacity; ++i)
+    // drops erased entries and their key bytes, grows when still full
+    void resizeTable(u32 newCapacity)
+    {
+        HashEntry<T> *newEntries = new HashEntry<T>[newCapacity / 4 * 3];
+        char *newKeys = keysCapacity ? new char[keysCapacity] : nullptr;
+        u32 used = 0;
+        u32 live = 0;
+        for (u32 i = 0; i < count; i++)
         {
-            HashNode<T> *currentNode = table[i];
-            while (currentNode)
-            {
-                u32 newIndex = HashStr(currentNode->key);
-                HashNode<T> *temp = currentNode;
-                currentNode = currentNode->next;
+            HashEntry<T> &entry = entries[i];
+            if (!entry.hash)
+                continue;
+            HashEntry<T> &moved = newEntries[live++];
+            moved = entry;
+            moved.key = used;
+            memcpy(newKeys + used, keys + entry.key, entry.len + 1);
+            used += entry.len + 1;
+        }
 
-                temp->next = newTable[newIndex];
-                newTable[newIndex] = temp;
-                size++;
-            }
+        delete[] entries;
+        delete[] keys;
+        delete[] slots;
+
+        entries = newEntries;
+        keys = newKeys;
+        keysUsed = used;
+        count = live;
+        size = live;
+
+        capacity = newCapacity;
+        mask = capacity - 1;
+        limit = capacity / 4 * 3;
+        slots = new Slot[capacity]();
+        for (u32 i = 0; i < count; i++)
+        {
+            place(entries[i].hash, i);
         }
-        delete[] table;
-        table = newTable;
+    }
+
+    u32 entryAt(const char *key, u32 len) const
+    {
+        u32 index = lookup(key, len, HashStr(key, len));
+        return index == capacity ? count : slots[index].entry;
+    }
+
+    void removeAt(u32 index)
+    {
+        entries[slots[index].entry].hash = 0;
+        unplace(index);
+        --size;
     }
 
 public:
-    HashTable(u32 Capacity = 16) : capacity(Capacity), size(0), m_Iter(nullptr), m_IterIndex(0)
+    HashTable(u32 Capacity = 16) : entries(nullptr), count(0), size(0), keys(nullptr), keysUsed(0), keysCapacity(0), m_IterIndex(0)
     {
-        table = new HashNode<T> *[capacity]();
+        capacity = 16;
+        while (capacity < Capacity)
+            capacity *= 2;
+        mask = capacity - 1;
+        limit = capacity / 4 * 3;
+        slots = new Slot[capacity]();
+        entries = new HashEntry<T>[limit];
     }
 
     ~HashTable()
     {
-        clear();
-        delete[] table;
+        delete[] slots;
+        delete[] entries;
+        delete[] keys;
     }
 
+    HashTable(const HashTable &) = delete;
+    HashTable &operator=(const HashTable &) = delete;
+
+    u32 length() const { return size; }
+
     T first()
     {
-        if (size == 0)
-            return T();
-        T item = T();
         m_IterIndex = 0;
-        m_Iter = nullptr;
-
-        for (size_t i = 0; i < capacity; i++)
-        {
-            HashNode<T> *pCurrItem = table[i];
-            while (pCurrItem)
-            {
-                if (!item)
-                    item = pCurrItem->value;
-                else
-                {
-                    m_Iter = pCurrItem;
-                    m_IterIndex = i;
-                    return item;
-                }
-                pCurrItem = pCurrItem->next;
-            }
-        }
-        return item;
+        return next();
     }
 
     T next()
     {
-        if (!m_Iter)
-            return T();
-        T item = m_Iter->value;
-        if (m_Iter->next)
+        while (m_IterIndex < count)
         {
-            m_Iter = m_Iter->next;
-            return item;
+            const HashEntry<T> &entry = entries[m_IterIndex++];
+            if (entry.hash)
+                return entry.value;
         }
-        for (size_t i = m_IterIndex + 1; i < capacity; i++)
-        {
-            if (table[i])
-            {
-                m_Iter = table[i];
-                m_IterIndex = i;
-                return item;
-            }
-        }
-        m_Iter = nullptr;
-        m_IterIndex = 0;
-        return item;
+        return T();
     }
 
-    void insert(const char *key, const T &value)
+    // a key already in the table gets the new value
+    void insert(const char *key, u32 len, const T &value)
     {
-        if ((float)(size + 1) / capacity > loadFactorThreshold)
+        u32 hash = HashStr(key, len);
+        u32 index = lookup(key, len, hash);
+        if (index != capacity)
         {
-            u32 newCapacity = CalculateCapacityGrow(capacity * 2, 8);
-            resizeTable(newCapacity);
+            entries[slots[index].entry].value = value;
+            return;
         }
 
-        u32 index = HashStr(key);
-        HashNode<T> *newNode = new HashNode<T>(key, value);
-        newNode->next = table[index];
-        table[index] = newNode;
+        if (count == limit)
+            resizeTable(size + 1 > capacity / 2 ? capacity * 2 : capacity);
+
+        HashEntry<T> &entry = entries[count];
+        entry.hash = hash;
+        entry.len = len;
+        entry.key = storeKey(key, len);
+        entry.value = value;
+        place(hash, count);
+        ++count;
         ++size;
     }
 
+    void insert(const char *key, const T &value)
+    {
+        insert(key, (u32)strlen(key), value);
+    }
+
+    bool find(const char *key, u32 len, T &value) const
+    {
+        u32 entry = entryAt(key, len);
+        if (entry == count)
+            return false;
+        value = entries[entry].value;
+        return true;
+    }
+
     bool find(const char *key, T &value) const
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        while (currentNode)
-        {
-            if (matchString(key, currentNode->key, currentNode->len))
-            // if (strcmp(currentNode->key, key) == 0)
-            {
-                value = currentNode->value;
-                return true;
-            }
-            currentNode = currentNode->next;
-        }
-        return false;
+        return find(key, (u32)strlen(key), value);
     }
 
-    T read(const char *key) 
+    T read(const char *key)
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        while (currentNode)
+        u32 entry = entryAt(key, (u32)strlen(key));
+        if (entry == count)
         {
-            if (matchString(key, currentNode->key, currentNode->len))
-            {
-                return currentNode->value;
-                
-            }
-            currentNode = currentNode->next;
+            DEBUG_BREAK_IF(true);
+            return T();
         }
-        DEBUG_BREAK_IF(true);
-        return T();
+        return entries[entry].value;
+    }
+
+    bool contains(const char *key, u32 len) const
+    {
+        return entryAt(key, len) != count;
     }
 
     bool contains(const char *key) const
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        while (currentNode)
-        {
-            if (matchString(key, currentNode->key, currentNode->len))
-          //   if (strcmp(currentNode->key, key) == 0)
-            {
-                return true;
-            }
-            currentNode = currentNode->next;
-        }
-        return false;
+        return contains(key, (u32)strlen(key));
     }
 
     void erase(const char *key)
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        HashNode<T> *prevNode = nullptr;
-        while (currentNode)
-        {
-            if (matchString(key, currentNode->key, currentNode->len))
-            // if (strcmp(currentNode->key, key) == 0)
-            {
-                if (prevNode)
-                {
-                    prevNode->next = currentNode->next;
-                }
-                else
-                {
-                    table[index] = currentNode->next;
-                }
-                delete currentNode;
-                --size;
-                return;
-            }
-            prevNode = currentNode;
-            currentNode = currentNode->next;
-        }
+        u32 len = (u32)strlen(key);
+        u32 index = lookup(key, len, HashStr(key, len));
+        if (index != capacity)
+            removeAt(index);
     }
 
     bool change(const char *key, T value)
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        while (currentNode)
-        {
-            if (matchString(key, currentNode->key, currentNode->len))
-            // if (strcmp(currentNode->key, key) == 0)
-            {
-                currentNode->value = value;
-                return true;
-            }
-            currentNode = currentNode->next;
-        }
-        return false;
+        u32 entry = entryAt(key, (u32)strlen(key));
+        if (entry == count)
+            return false;
+        entries[entry].value = value;
+        return true;
     }
 
     bool remove(const char *key, T &value)
     {
-        u32 index = HashStr(key);
-        HashNode<T> *currentNode = table[index];
-        HashNode<T> *prevNode = nullptr;
-        while (currentNode)
-        {
-            if (matchString(key, currentNode->key, currentNode->len))
-            // if (strcmp(currentNode->key, key) == 0)
-            {
-                if (prevNode)
-                {
-                    prevNode->next = currentNode->next;
-                }
-                else
-                {
-                    table[index] = currentNode->next;
-                }
-                value = currentNode->value;
-                delete currentNode;
-                --size;
-                return true;
-            }
-            prevNode = currentNode;
-            currentNode = currentNode->next;
-        }
-        return false;
+        u32 len = (u32)strlen(key);
+        u32 index = lookup(key, len, HashStr(key, len));
+        if (index == capacity)
+            return false;
+        value = entries[slots[index].entry].value;
+        removeAt(index);
+        return true;
     }
 
     void clear()
     {
-        for (size_t i = 0; i < capacity; ++i)
-        {
-            HashNode<T> *currentNode = table[i];
-            while (currentNode)
-            {
-                HashNode<T> *nextNode = currentNode->next;
-                delete currentNode;
-                currentNode = nextNode;
-            }
-            table[i] = nullptr;
-        }
+        memset(slots, 0, capacity * sizeof(Slot));
+        count = 0;
         size = 0;
-        m_Iter = nullptr;
+        keysUsed = 0;
         m_IterIndex = 0;
     }
 
@@ -327,50 +338,46 @@ public:
     {
     private:
         HashTable &hashTable;
-        size_t bucketIndex;
-        HashNode<T> *currentNode;
+        u32 index;
+
+        void skip()
+        {
+            while (index < hashTable.count && !hashTable.entries[index].hash)
+                ++index;
+        }
 
     public:
-        Iterator(HashTable &ht, size_t index, HashNode<T> *node)
-            : hashTable(ht), bucketIndex(index), currentNode(node) {}
+        Iterator(HashTable &ht, u32 index) : hashTable(ht), index(index)
+        {
+            skip();
+        }
 
         Iterator &operator++()
         {
-            if (currentNode)
-            {
-                currentNode = currentNode->next;
-            }
-            while (!currentNode && ++bucketIndex < hashTable.capacity)
-            {
-                currentNode = hashTable.table[bucketIndex];
-            }
+            ++index;
+            skip();
             return *this;
         }
 
         bool operator!=(const Iterator &other) const
         {
-            return bucketIndex != other.bucketIndex || currentNode != other.currentNode;
+            return index != other.index;
         }
 
-        std::pair<const std::string &, T &> operator*()
+        std::pair<const char *, T &> operator*()
         {
-            return {currentNode->key, currentNode->value};
+            HashEntry<T> &entry = hashTable.entries[index];
+            return {hashTable.keys + entry.key, entry.value};
         }
     };
 
     Iterator begin()
     {
-        size_t index = 0;
-        HashNode<T> *node = nullptr;
-        while (index < capacity && !(node = table[index]))
-        {
-            ++index;
-        }
-        return Iterator(*this, index, node);
+        return Iterator(*this, 0);
     }
 
     Iterator end()
     {
-        return Iterator(*this, capacity, nullptr);
+        return Iterator(*this, count);
     }
-};
\ No newline at end of file
+};
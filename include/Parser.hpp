@@ -11,8 +11,20 @@
 class VirtualMachine;
 class Task;
 class Process;
+struct Compiler;
 
 
+// a call whose argument count can only be checked once every
+// function/process has been declared
+struct CallSite
+{
+    String name;
+    u16 index;
+    u8 argCount;
+    bool isProcess;
+    int line;
+};
+
 class Parser
 {
 private:
@@ -24,6 +36,12 @@ private:
     HashTable<u16> process;
     Vector<Token> tokens;
     HashTable<u32> globals;
+    Vector<CallSite> calls;
+
+    u32 globalSlot(const String &name);
+    u16 functionIndex(const String &name);
+    u16 processIndex(const String &name);
+    void checkCalls();
 
     int current;
     bool panicMode;
@@ -86,6 +104,7 @@ private:
     void printStatement();
     void variableDeclaration();
     void variable(bool canAssign);
+    bool isEngineLocal(int index);
 
     void ifStatement();
     void switchStatement();
@@ -106,6 +125,7 @@ private:
     u8 makeConstant(const Value &value);
     void emitByte(u8 byte);
     void emitBytes(u8 byte1, u8 byte2);
+    void emitShort(u8 instruction, u16 value);
     void emitReturn();
     void emitConstant(const Value &value);
     void emitLoop(int loopStart);
@@ -124,9 +144,11 @@ private:
     
     bool IsGlobalScope();
     Task *currentTask;
+    Compiler *compiler;
     bool hasReturned;///dummy , but needed 4 now
 
     void setTask(Task* task);
+    void releaseCompilers();
 
 public:
     Parser();
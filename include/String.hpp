@@ -19,44 +19,59 @@ inline char toupper(char c)
 
 const size_t NPOS = 0xffffffff;
 
+// Bytes of inline storage, terminator included. Shorter strings never touch the heap.
+#ifndef STRING_INLINE
+#define STRING_INLINE 24
+#endif
+
 class String
 {
 public:
-    String() : m_length(0), m_capacity(1)
+    String() : m_length(0), m_capacity(STRING_INLINE), m_buffer(m_local)
     {
-        m_buffer = new char[1];
-        m_buffer[0] = '\0';
-        
+        m_local[0] = '\0';
     }
 
-    String(const String &str) : m_length(str.m_length), m_capacity(str.m_capacity)
+    String(const String &str) : m_length(str.m_length)
     {
-     
-        m_buffer = new char[m_capacity];
+        allocate(m_length + 1);
         std::memcpy(m_buffer, str.m_buffer, m_length + 1);
     }
 
-    String(const char *str) : m_length(0), m_capacity(0), m_buffer(nullptr)
+    String(String &&str) noexcept : m_length(str.m_length)
+    {
+        if (str.m_buffer == str.m_local)
+        {
+            m_capacity = STRING_INLINE;
+            m_buffer = m_local;
+            std::memcpy(m_local, str.m_local, m_length + 1);
+        }
+        else
+        {
+            m_capacity = str.m_capacity;
+            m_buffer = str.m_buffer;
+            str.reset();
+        }
+    }
+
+    String(const char *str) : m_length(0)
     {
         if (str)
         {
             m_length = strlen(str);
-            m_capacity = m_length + 1;
-            m_buffer = new char[m_capacity];
+            allocate(m_length + 1);
             std::memcpy(m_buffer, str, m_length + 1);
         }
         else
         {
-            m_length = 0;
-            m_capacity = 1;
-            m_buffer = new char[1];
+            allocate(1);
             m_buffer[0] = '\0';
         }
     }
 
-    String(const char *str, size_t length) : m_length(length), m_capacity(length + 1)
+    String(const char *str, size_t length) : m_length(length)
     {
-        m_buffer = new char[m_capacity];
+        allocate(length + 1);
         std::memcpy(m_buffer, str, length);
         m_buffer[length] = '\0';
     }
@@ -103,17 +118,16 @@ public:
         *this = tempBuffer;
     }
 
-    String(char c) : m_length(1), m_capacity(2)
+    String(char c) : m_length(1)
     {
-        m_buffer = new char[m_capacity];
+        allocate(2);
         m_buffer[0] = c;
         m_buffer[1] = '\0';
     }
 
     ~String()
     {
-       
-        delete[] m_buffer;
+        release();
     }
 
     static String toString(int number)
@@ -124,7 +138,7 @@ public:
 
     void compact()
     {
-        if (m_capacity)
+        if (m_buffer != m_local)
             reserve(m_length + 1);
     }
 
@@ -133,11 +147,13 @@ public:
         if (this == &str)
             return *this;
 
-        delete[] m_buffer;
-
+        // keep the current buffer when the copy fits
+        if (m_capacity < str.m_length + 1)
+        {
+            release();
+            allocate(str.m_length + 1);
+        }
         m_length = str.m_length;
-        m_capacity = str.m_capacity;
-        m_buffer = new char[m_capacity];
         std::memcpy(m_buffer, str.m_buffer, m_length + 1);
 
         return *this;
@@ -148,16 +164,23 @@ public:
         if (this == &str)
             return *this;
 
-        delete[] m_buffer;
+        // an inline source always fits, every buffer holds at least STRING_INLINE
+        if (str.m_buffer == str.m_local)
+        {
+            m_length = str.m_length;
+            std::memcpy(m_buffer, str.m_local, m_length + 1);
+            str.m_length = 0;
+            str.m_local[0] = '\0';
+            return *this;
+        }
+
+        release();
 
         m_length = str.m_length;
         m_capacity = str.m_capacity;
         m_buffer = str.m_buffer;
 
-        str.m_length = 0;
-        str.m_capacity = 1;
-        str.m_buffer = new char[1];
-        str.m_buffer[0] = '\0';
+        str.reset();
 
         return *this;
     }
@@ -685,6 +708,37 @@ private:
     size_t m_length;
     size_t m_capacity;
     char *m_buffer;
+    char m_local[STRING_INLINE];
+
+    // points m_buffer at storage for size bytes, inline when it fits
+    void allocate(size_t size)
+    {
+        if (size <= STRING_INLINE)
+        {
+            m_capacity = STRING_INLINE;
+            m_buffer = m_local;
+        }
+        else
+        {
+            m_capacity = size;
+            m_buffer = new char[size];
+        }
+    }
+
+    void release()
+    {
+        if (m_buffer != m_local)
+            delete[] m_buffer;
+    }
+
+    // back to the empty inline state, the heap buffer is owned elsewhere now
+    void reset()
+    {
+        m_length = 0;
+        m_capacity = STRING_INLINE;
+        m_buffer = m_local;
+        m_local[0] = '\0';
+    }
 
     void Move(size_t dest, size_t src, size_t count)
     {
@@ -706,45 +760,41 @@ private:
     {
         if (newCapacity < m_length + 1)
             newCapacity = m_length + 1;
+        if (newCapacity <= STRING_INLINE)
+        {
+            if (m_buffer == m_local)
+                return;
+            std::memcpy(m_local, m_buffer, m_length + 1);
+            delete[] m_buffer;
+            m_buffer = m_local;
+            m_capacity = STRING_INLINE;
+            return;
+        }
         if (newCapacity == m_capacity)
             return;
 
         char *newBuffer = new char[newCapacity];
-        if (m_length)
-            std::memcpy(newBuffer, m_buffer, m_length + 1);
+        std::memcpy(newBuffer, m_buffer, m_length + 1);
 
-        delete[] m_buffer;
+        release();
         m_buffer = newBuffer;
         m_capacity = newCapacity;
     }
     void resize(size_t newLength)
     {
-        if (!m_capacity)
+        if (m_capacity < newLength + 1)
         {
-            if (!newLength)
-                return;
-
-            // Calculate initial capacity
-            m_capacity = newLength + 1;
-            if (m_capacity < 8)
-                m_capacity = 8;
-
-            m_buffer = new char[m_capacity];
-        }
-        else
-        {
-            if (newLength && m_capacity < newLength + 1)
-            {
-                // Increase the capacity with half each time it is exceeded
-                while (m_capacity < newLength + 1)
-                    m_capacity += (m_capacity + 1) >> 1;
-
-                char *newBuffer = new char[m_capacity];
-                if (m_length)
-                    std::memcpy(newBuffer, m_buffer, m_length);
-                delete[] m_buffer;
-                m_buffer = newBuffer;
-            }
+            // Increase the capacity with half each time it is exceeded
+            size_t newCapacity = m_capacity;
+            while (newCapacity < newLength + 1)
+                newCapacity += (newCapacity + 1) >> 1;
+
+            char *newBuffer = new char[newCapacity];
+            if (m_length)
+                std::memcpy(newBuffer, m_buffer, m_length);
+            release();
+            m_buffer = newBuffer;
+            m_capacity = newCapacity;
         }
 
         m_buffer[newLength] = '\0';
@@ -752,23 +802,32 @@ private:
     }
 };
 
+// size the result once, instead of copying lhs and growing it for rhs
 inline String operator+(const String &lhs, const String &rhs)
 {
-    String result(lhs);
+    String result;
+    result.reserve(lhs.m_length + rhs.m_length + 1);
+    result += lhs;
     result += rhs;
     return result;
 }
 
 inline String operator+(const char *lhs, const String &rhs)
 {
-    String result(lhs);
+    size_t length = std::strlen(lhs);
+    String result;
+    result.reserve(length + rhs.m_length + 1);
+    result.append(lhs, length);
     result += rhs;
     return result;
 }
 
 inline String operator+(const String &lhs, const char *rhs)
 {
-    String result(lhs);
-    result += rhs;
+    size_t length = std::strlen(rhs);
+    String result;
+    result.reserve(lhs.m_length + length + 1);
+    result += lhs;
+    result.append(rhs, length);
     return result;
 }
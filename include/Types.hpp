@@ -6,6 +6,8 @@
 #include "Vector.hpp"
 #include "Map.hpp"
 
+#include <mutex>
+
 class VirtualMachine;
 struct Value;
 class Task;
@@ -25,6 +27,8 @@ struct Traceable
 
     virtual void mark()  { marked = true; }
     virtual void unmark() { marked = false; }
+    // shade every object this one references (Arena::shade), none for strings
+    virtual void trace() {}
 
     static void *operator new(size_t size);
     static void operator delete(void *ptr, size_t size);
@@ -33,6 +37,8 @@ struct Traceable
 struct StringObject : public Traceable
 {
     String string;
+    u32 hash;      // of string, set once, strings don't change after creation
+    bool interned; // unique by contents, see Arena::intern
     StringObject(const String &str);
     StringObject(const char *str);
     StringObject(double value);
@@ -40,8 +46,101 @@ struct StringObject : public Traceable
     ~StringObject();
 };
 
+u32 HashString(const char *chars, size_t length);
+
+inline bool StringEquals(const StringObject *a, const StringObject *b)
+{
+    if (a == b)
+        return true;
+    // two interned strings are only equal if they are the same object
+    if ((a->interned && b->interned) || a->hash != b->hash)
+        return false;
+    return a->string == b->string;
+}
 
 
+
+#ifdef NAN_BOXING
+
+// 8-byte Value: a number is stored as its raw double bits, everything else
+// lives in the payload of a quiet NaN. Objects set the sign bit and keep the
+// (48-bit) pointer in the low bits; nil/false/true are small tags.
+struct Value
+{
+    u64 bits;
+};
+
+static_assert(sizeof(Value) == 8, "NaN-boxed Value must be 8 bytes");
+
+#define SIGN_BIT ((u64)0x8000000000000000)
+#define QNAN ((u64)0x7ffc000000000000)
+
+#define TAG_NONE 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+#define NONE_VAL ((u64)(QNAN | TAG_NONE))
+#define FALSE_VAL ((u64)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((u64)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL ((u64)(QNAN | TAG_UNDEFINED))
+
+inline Value numberToValue(double number)
+{
+    Value value;
+    memcpy(&value.bits, &number, sizeof(double));
+    return value;
+}
+
+inline double valueToNumber(Value value)
+{
+    double number;
+    memcpy(&number, &value.bits, sizeof(double));
+    return number;
+}
+
+inline Value objectToValue(StringObject *obj)
+{
+    return Value{SIGN_BIT | QNAN | (u64)(uintptr_t)obj};
+}
+
+#define INTEGER(value) numberToValue(static_cast<double>(value))
+#define NUMBER(value) numberToValue(value)
+#define STRING(value) objectToValue(new StringObject(value))
+#define INTERNED(value) objectToValue(Arena::as().intern(value))
+#define BOOLEAN(value) (Value{(value) ? TRUE_VAL : FALSE_VAL})
+#define NONE() (Value{NONE_VAL})
+#define UNDEFINED() (Value{UNDEFINED_VAL})
+
+#define AS_INTEGER(value) (static_cast<int>(valueToNumber(value)))
+#define AS_NUMBER(value) (valueToNumber(value))
+#define AS_BOOLEAN(value) ((value).bits == TRUE_VAL)
+#define AS_STRING(value) ((StringObject *)(uintptr_t)((value).bits & ~(SIGN_BIT | QNAN)))
+#define AS_RAW_STRING(value) (AS_STRING(value)->string.c_str())
+
+#define IS_BOOLEAN(value) (((value).bits | 1) == TRUE_VAL)
+#define IS_NUMBER(value) (((value).bits & QNAN) != QNAN)
+#define IS_STRING(value) (((value).bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_NONE(value) ((value).bits == NONE_VAL)
+#define IS_UNDEFINED(value) ((value).bits == UNDEFINED_VAL)
+
+#define IS_OBJECT(value) IS_STRING(value)
+
+inline ValueType VALUE_TYPE(const Value &value)
+{
+    if (IS_NUMBER(value))
+        return ValueType::VNUMBER;
+    if (IS_STRING(value))
+        return ValueType::VSTRING;
+    if (IS_BOOLEAN(value))
+        return ValueType::VBOOLEAN;
+    if (IS_NONE(value))
+        return ValueType::VNONE;
+    return ValueType::VUNDEFINED;
+}
+
+#else
+
 struct Value
 {
 
@@ -60,10 +159,14 @@ struct Value
     (Value{ ValueType::VNUMBER, {.number = value}})
 #define STRING(value) \
     (Value{ ValueType::VSTRING, {.string = new StringObject(value)}})
+#define INTERNED(value) \
+    (Value{ ValueType::VSTRING, {.string = Arena::as().intern(value)}})
 #define BOOLEAN(value) \
     (Value{ ValueType::VBOOLEAN, {.boolean = value}})
 #define NONE() \
     (Value{ ValueType::VNONE, {.number = 0}})
+#define UNDEFINED() \
+    (Value{ ValueType::VUNDEFINED, {.number = 0}})
 
 
 #define AS_INTEGER(value) (static_cast<int>((value).number))
@@ -77,24 +180,38 @@ struct Value
 #define IS_NUMBER(value) ((value).type == ValueType::VNUMBER)
 #define IS_STRING(value) ((value).type == ValueType::VSTRING)
 #define IS_NONE(value) ((value).type == ValueType::VNONE)
+#define IS_UNDEFINED(value) ((value).type == ValueType::VUNDEFINED)
 
 
 
 #define IS_OBJECT(value) ((value).type == ValueType::VSTRING)
-#define MARK(value)                  \
-    {                                \
-        if (IS_OBJECT(value))        \
-            AS_STRING(value)->mark() \
+
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
+#define MARK(value)                   \
+    {                                 \
+        if (IS_OBJECT(value))         \
+            AS_STRING(value)->mark(); \
     }
-#define UNMARK(value)                  \
-    {                                  \
-        if (IS_OBJECT(value))          \
-            AS_STRING(value)->unmark() \
+#define UNMARK(value)                   \
+    {                                   \
+        if (IS_OBJECT(value))           \
+            AS_STRING(value)->unmark(); \
+    }
+
+// incremental GC: a value stored into a global or a local, or pushed by a
+// native, is shaded while marking so an already scanned root can't hide it
+#define WRITE_BARRIER(value)              \
+    {                                     \
+        if (Arena::marking)               \
+            Arena::as().shade(value);     \
     }
 
 inline Value Clone(const Value &value)
 {
-    switch (value.type)
+    switch (VALUE_TYPE(value))
     {
     case ValueType::VNUMBER:
         return NUMBER(AS_NUMBER(value));
@@ -107,19 +224,22 @@ inline Value Clone(const Value &value)
     }
 }
 
+// what == means for numbers, every tier compares with this
+static const double NUMBER_TOLERANCE = 0.01953; // TODO: use epsilon error margin
+
+inline bool MatchNumber(double value, double with)
+{
+    return fabs(value - with) < NUMBER_TOLERANCE;
+}
+
 inline bool MatchValue(const Value &value, const Value &with)
 {
-    if (value.type != with.type)
+    if (VALUE_TYPE(value) != VALUE_TYPE(with))
         return false;
     if (IS_STRING(value) && IS_STRING(with))
-    {
-        if (AS_STRING(value)->string.length() != AS_STRING(with)->string.length())
-            return false;
-        return AS_STRING(value)->string == AS_STRING(with)->string;
-    }
+        return StringEquals(AS_STRING(value), AS_STRING(with));
     else if (IS_NUMBER(value) && IS_NUMBER(with))
-        return fabs(AS_NUMBER(value) - AS_NUMBER(with)) < 0.01953; // TODO: use epsilon error margin
-    // return AS_NUMBER(value) == AS_NUMBER(with);
+        return MatchNumber(AS_NUMBER(value), AS_NUMBER(with));
     else if (IS_BOOLEAN(value) && IS_BOOLEAN(with))
         return AS_BOOLEAN(value) == AS_BOOLEAN(with);
 
@@ -134,7 +254,7 @@ inline bool isFalsey(Value value)
         return true;
     if (IS_BOOLEAN(value))
     {
-        return !value.boolean;
+        return !AS_BOOLEAN(value);
     }
     if (IS_STRING(value))
         return AS_STRING(value)->string.length() == 0;
@@ -146,9 +266,23 @@ inline bool isFalsey(Value value)
     return false;
 }
 
+// line table entry: the bytes from offset up to the next entry come from line
+struct LineStart
+{
+    u32 offset;
+    int line;
+};
+
+// body of an ahead-of-time compiled chunk, see Aot.hpp
+struct AotContext;
+typedef u8 (*AotBody)(AotContext &c);
+
 class Chunk
 {
     u32 m_capacity;
+    u32 m_lineCapacity;
+
+    void addLine(u32 offset, int line);
 
 public:
     Chunk(u32 capacity = 512);
@@ -160,15 +294,38 @@ public:
 
     void write(u8 instruction, int line);
 
+    // source line of the byte at offset, a binary search: errors only
+    int getLine(u32 offset) const;
+    // rebuilds the line table from one line per byte (the peephole pass)
+    void setLines(const int *perByte, u32 count);
+
     u32 capacity() const { return m_capacity; }
 
     u8 operator[](u32 index);
 
     bool clone(Chunk *other);
+    // replaces code and line table with copies, for a program being loaded
+    bool assign(const u8 *code, u32 count, const LineStart *lines, u32 lineCount);
 
     u8 *code;
-    int *lines;
+    LineStart *lines; // run-length, one entry per change of line
+    u32 lineCount;
     u32 count;
+
+    // set by Task::verify, a verified chunk runs without stack checks
+    // and its frame never holds more than maxStack values
+    bool verified;
+    u32 maxStack;
+
+    // set by VirtualMachine::Compile when a linked AOT module has this chunk,
+    // or by the JIT once it's hot; Task::Run then runs it in place of the
+    // interpreter loop
+    AotBody native;
+
+    // calls into the chunk plus loop iterations in it, and how often its
+    // JIT code bailed out (see Jit.hpp)
+    u32 hotness;
+    u8 deopts;
 };
 class TraceList
 {
@@ -200,6 +357,9 @@ public:
 
     Traceable *pop();
 
+    void set(size_t index, Traceable *obj) { m_data[index] = obj; }
+    void truncate(size_t size) { m_size = size; }
+
     Traceable *operator[](size_t index) { return m_data[index]; }
     Traceable &operator[](size_t index) const { return *m_data[index]; }
 
@@ -272,6 +432,49 @@ public:
     size_t size() { return m_data.size(); }
 };
 
+// weak set of the interned strings: open addressing on the cached hash, an
+// entry goes away when the GC frees its string
+class StringTable
+{
+private:
+    StringObject **entries;
+    u32 capacity;
+    u32 used; // live entries plus tombstones
+
+    void grow();
+
+public:
+    StringTable();
+    ~StringTable();
+
+    StringObject *find(const char *chars, size_t length, u32 hash);
+    void insert(StringObject *string);
+    void remove(StringObject *string);
+    void clear();
+};
+
+// a collection cycle starts once bytesAllocated reaches the threshold, which
+// is then reset to GC_HEAP_GROW times what survived (never below
+// GC_MIN_THRESHOLD). The cycle runs in steps of GC_STEP_WORK roots or objects
+// for up to the frame budget (ms) given to Update; if allocation outruns it
+// past GC_HEAP_GROW times the threshold the cycle is finished at once
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD (1024 * 256)
+#endif
+#define GC_HEAP_GROW 2
+#ifndef GC_STEP_WORK
+#define GC_STEP_WORK 256
+#endif
+#define GC_FRAME_BUDGET 1.0
+#define GC_PAUSE_SAMPLES 1024
+
+enum class GCPhase
+{
+    IDLE = 0,
+    MARK,
+    SWEEP,
+};
+
 class Arena
 {
 
@@ -287,18 +490,59 @@ private:
 
     clock_t start_time;
 
+    // process pools, summed over every VM
+    size_t poolNew;
+    size_t poolRecycled;
+    size_t poolFree;
+    size_t poolFreeBytes;
+    size_t poolReturned;
+
+    // collections and their pause times, in ms
+    size_t collections;
+    size_t freedObjects;
+    double lastPause;
+    double maxPause;
+    double totalPause;
+    Vector<double> pauses; // last GC_PAUSE_SAMPLES steps, a ring
+    u32 pauseNext;
+
     u64 next_id;
-    TraceList objects;
-    TraceList roots;
+    TraceList objects; // every live object, by id
+
+    // tri-color marking: white is unmarked, gray is marked and waiting in
+    // gray for trace(), black is marked and traced
+    GCPhase phase;
+    Vector<Traceable *> gray;
+    u32 rootCursor;
+
+    // sweep compacts objects[0, sweepEnd) in place, objects born during the
+    // sweep sit after sweepEnd and are moved down when it ends
+    size_t sweepRead;
+    size_t sweepWrite;
+    size_t sweepEnd;
+
+    // set while processes run on worker threads
+    bool threaded;
+    std::mutex mutex;
+
+    // objects the host holds outside any VM, see add()/remove()
+    Vector<Traceable *> roots;
+
+    // machines whose stacks, globals and constants are roots
+    Vector<VirtualMachine *> machines;
+
+    StringTable strings;
 
 
     Arena();
     ~Arena();
 
-    void remove_root(Traceable *obj); // remove from roots and delete
-    void mark_from(Traceable *obj);
-    void mark();
-    void sweep();
+    void begin();
+    size_t mark(size_t work);
+    size_t sweep(size_t work);
+    void finish();
+    void step(size_t work);
+    void record(double pause);
     double get_elapsed_time();
 
 public:
@@ -308,6 +552,9 @@ public:
         return arena;
     }
 
+    // true while a cycle is marking, the write barrier only runs then
+    static bool marking;
+
     void cleanup();
     void clear();
 
@@ -316,15 +563,53 @@ public:
     void *allocate(size_t size);
     void deallocate(void *ptr, size_t size);
     void queue(Traceable *obj);
-    void remove(Traceable *obj); // remove & delete
 
-    void add(Traceable *obj) { roots.push_back(obj); }
+    // pin an object the host keeps across Update calls, remove() unpins it
+    // and the next collection frees it if nothing else reaches it
+    void add(Traceable *obj)
+    {
+        roots.push_back(obj);
+        if (marking)
+            shade(obj);
+    }
+    void remove(Traceable *obj);
+
+    void attach(VirtualMachine *vm);
+    void detach(VirtualMachine *vm);
+
+    // the one StringObject with these contents, made on first use; for
+    // identifiers and constants, runtime strings are not interned
+    StringObject *intern(const char *chars, size_t length);
+    StringObject *intern(const char *chars);
+    StringObject *intern(const String &string);
+    void unintern(StringObject *string) { strings.remove(string); }
+
+    void set_threaded(bool threaded) { this->threaded = threaded; }
+
+    void pool_acquire(size_t size, bool recycled);
+    void pool_release(size_t size);
+    void pool_return(size_t size);
 
     size_t get_total_objects() { return totalObjects; }
 
     size_t get_bytes_allocated() { return bytesAllocated; }
 
-    void gc();
+    size_t get_collections() { return collections; }
+    double get_last_pause() { return lastPause; }
+    double get_max_pause() { return maxPause; }
+    // pause of the given percentile (0..100) over the recent steps
+    double get_pause_percentile(double percentile);
+
+    // gray a white object; roots go through it and so does the write barrier
+    void shade(Traceable *obj);
+    void shade(const Value &value);
+
+    // start a cycle if the threshold was crossed and advance the current one
+    // for about budget ms; only call it where every live value is on a task
+    // stack, in globals or in constants (between slices)
+    void gc(double budget = GC_FRAME_BUDGET);
+    // run a whole cycle now
+    void collect();
 
 
 };
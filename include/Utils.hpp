@@ -23,6 +23,11 @@ void Log(int severity, const char* fmt, va_list args);
 char *LoadTextFile(const char *fileName);
 void FreeTextFile(char *text);
 
+// whole file read-only in memory (mmap where there is one), nullptr if it
+// can't be opened or is empty; give the size back to UnmapFile
+const void *MapFile(const char *fileName, size_t *size);
+void UnmapFile(const void *data, size_t size);
+
 
 static inline bool matchString(const char *str1, const char *str2,size_t bLen)
 {
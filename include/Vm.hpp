@@ -3,6 +3,7 @@
 #include "Token.hpp"
 #include "Lexer.hpp"
 #include "Parser.hpp"
+#include "Jobs.hpp"
 
 
 
@@ -58,6 +59,9 @@ enum OpCode
     LOCAL_GET,
     LOCAL_SET,
 
+    ENGINE_GET,
+    ENGINE_SET,
+
 
 
     SWITCH,
@@ -88,17 +92,63 @@ enum OpCode
     JUMP,
     JUMP_IF_FALSE,
     JUMP_IF_TRUE,
+
+    // superinstructions, only written by Task::optimize
+    POP_JUMP_IF_FALSE,
+    JUMP_IF_NOT_LESS,
+    JUMP_IF_NOT_LESS_EQUAL,
+    JUMP_IF_NOT_GREATER,
+    JUMP_IF_NOT_GREATER_EQUAL,
+    LOCAL_STORE,
+    ENGINE_STORE,
+    GLOBAL_STORE,
+    ADD_LOCAL,
+    ADD_GLOBAL,
+    ADD_CONST,
+    ADD_LOCAL_LOCAL,
+    LOCAL_INC_CONST,
+
+    // number-only forms, Task::Run writes them over the generic op once it
+    // saw numbers there and back when the guard fails
+    ADD_NUM,
+    SUBTRACT_NUM,
+    MULTIPLY_NUM,
+    DIVIDE_NUM,
+    EQUAL_NUM,
+    NOT_EQUAL_NUM,
+    LESS_NUM,
+    LESS_EQUAL_NUM,
+    GREATER_NUM,
+    GREATER_EQUAL_NUM,
     COUNT,
 };
 
+// bytes of an instruction, opcode included; 0 for an unknown opcode
+u32 InstructionSize(u8 instruction);
+
+#ifdef OPCODE_PAIR_STATS
+// executed opcode pairs, counted in Task::Run; not thread safe, run with one thread
+void PrintOpcodePairs(FILE *out, u32 top);
+#endif
+
 class Task;
 class Process;
 class VirtualMachine;
+class Aot;
+class Jit;
+class Bytecode;
 
 #define MAX_FRAMES 64
 //#define STACK_MAX (MAX_FRAMES * UINT8_MAX)
 #define STACK_MAX (256)
 
+// runtime stack and frames start small and double on demand up to the max
+#define STACK_MIN (16)
+#define FRAMES_MIN (4)
+// results a native can always push; inside a native the stack doesn't grow,
+// pushes past its capacity fail
+#define NATIVE_STACK_ROOM (8)
+
 // 256                   = 42920 bytes
 // 512                   = 47016 bytes
 //MAX_FRAMES * UINT8_MAX = 299944 bytes
@@ -110,27 +160,12 @@ static const int TERMINATED = 3;
 static const int PAUSED = 4;
 
 static const int OK = 5;
+static const int DEFERRED = 6; // parallel update: finish this turn in the serial phase
+static const int SWITCH_LOOP = 7; // the new top frame runs in another loop, Run enters it
 
+// instructions a task runs per Run call
+static const size_t instructionsPerFrame = 30;
 
-struct Scope 
-{
-
-
-    int level;
-    HashTable<Value> variables;
-    Scope();
-    Scope( int level);
-    virtual ~Scope();
-    bool define(const char *name, Value value);
-    void insert(const char *name, Value value);
-    bool get(const char *name, Value &value);
-    bool contains(const char* name) const;
-    bool assign(const char* name, Value value);
-
-
-    void print();
-    void clear();
-};
 
 struct  Local
 {
@@ -140,6 +175,21 @@ struct  Local
     bool isArg;
 } ;
 
+// parser bookkeeping for a task being compiled; released once the program
+// is compiled, so running tasks and process instances don't carry it
+struct Compiler
+{
+    Local locals[UINT8_MAX];
+    int localCount{0};
+    int scopeDepth{0};
+
+    int loopStart{-1};
+    int exitJump{-1};
+
+    int breakJumpCount{-1};
+    int breakJumps[UINT8_MAX]{-1};
+};
+
 struct Frame
 {
     Task  *task;
@@ -159,34 +209,26 @@ class Task
 private:
     friend class VirtualMachine;
     friend class Parser;
+    friend class TimerWheel;
+    friend class Aot;
+    friend class Jit;
+    friend class Bytecode;
 
     bool PanicMode;
 
-    
-    
-    
-    Vector<u8> codes;
-
-    int loopStart{-1};
-    int exitJump{-1};
-
-    int breakJumpCount{-1};
-    int breakJumps[UINT8_MAX]{-1};
-    int frameDepth;
+    Compiler *compiler;
 
-    
-    double frame_counter;
-    clock_t last_frame_time;
+    // frame(n) percent carried over to the next FRAME, and the Update tick
+    // a paused task sleeps until
+    u32 frameCredit;
+    u64 wakeTick;
 
     u8 state;
-    u8 frameStep;
-
-    int scopeDepth;
-
-    bool mainTask;
 
     u8 argsCount;
 
+    u32 resumeBudget;
+
     void beginScope();
     void exitScope(int line);
 
@@ -205,11 +247,13 @@ private:
     u32 constantInstruction(const char *name, u32 offset);
     u32 simpleInstruction(const char *name, u32 offset);
     u32 byteInstruction(const char *name, u32 offset);
+    u32 twoByteInstruction(const char *name, u32 offset);
     u32 jumpInstruction(const char *name, u32 sign, u32 offset);
     u32 varInstruction(const char *name, u32 offset);
+    u32 callInstruction(const char *name, u32 offset);
 
     u8 op_add();
-    u8 op_mod(int line);
+    u8 op_mod();
     u8 op_not_equal();
     u8 op_less();
     u8 op_greater();
@@ -224,9 +268,9 @@ protected:
     TaskType type;
 
     int frameCount;
-    Local locals[UINT8_MAX];
-    int localCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    u32 stackCapacity;
+    Value *stack;
     Value *stackTop;
     bool m_done;
     Task *parent;
@@ -235,7 +279,17 @@ protected:
     bool isReturned;
     Chunk *chunk;
     Vector<Value> constants;
-    Frame frames[MAX_FRAMES];
+    Frame *frames;
+
+    bool growStack(u32 count);
+    bool growFrames();
+
+    // source line of the instruction the top frame is running
+    int currentLine() const;
+
+    // the interpreter loop, with stack checks for unverified chunks
+    template <bool CHECKED>
+    u8 execute();
 
     int declareVariable(const String &string, bool isArg = false);
     int addLocal(const char *name, u32 len, bool isArg = false);
@@ -250,17 +304,24 @@ protected:
     void pop(u32 count);
     void PrintStack();
 
+    u32 markRoots();
+
 public:
     Task(VirtualMachine *vm, const char *name);
     virtual ~Task();
 
     void init_frames();
-
-    u8 Pause();
+    void init_frames(Task *code);
 
     u8 Run();
     void write_byte(u8 byte, int line);
 
+    // fuses common instruction sequences of the compiled chunk into superinstructions
+    void optimize();
+    // checks the compiled chunk for a frame that starts with depth values
+    // (the arguments) and records its max stack depth, see Verifier.cpp
+    bool verify(u32 depth);
+
     u8 addConst(Value v);
     u8 addConstString(const char *str);
     u8 addConstNumber(double number);
@@ -299,10 +360,34 @@ const int IY     = 3;
 const int ITYPE     = 4;
 
 
+// engine locals (id, graph, x, y) of every live process, one column per local
+// indexed by the process slot. ENGINE_GET/ENGINE_SET read and write them in
+// place, hosts can run over a whole column; free slots have id -1
+class EngineLocals
+{
+private:
+    Vector<double> columns[DEFAULT_COUNT];
+    Vector<u32> freeSlots;
+    u32 slots;
+
+public:
+    EngineLocals();
+
+    u32 acquire();
+    void release(u32 slot);
+    void clear();
+
+    double *column(int local) { return columns[local].pointer(); }
+    const double *column(int local) const { return columns[local].pointer(); }
+
+    u32 size() const { return slots; }
+};
+
 struct Instance 
 {
     u32 ID;
-    double locals[32];
+    u32 slot;
+    EngineLocals *engine;
     String name;
     Instance *father;
     Instance *son;
@@ -317,7 +402,12 @@ struct Instance
         son = nullptr;
         smallBrother = nullptr;
         bigBrother = nullptr;
+        engine = nullptr;
+        slot = 0;
     }
+
+    double get(int local) const { return engine->column(local)[slot]; }
+    void set(int local, double value) { engine->column(local)[slot] = value; }
 };
 
 
@@ -349,6 +439,62 @@ public:
     u32 count() const { return m_count; }
 };
 
+// free list of Process-sized blocks: dead instances are reused by the next
+// spawn instead of going back to the system allocator, until more than
+// highWater blocks sit idle
+#define PROCESS_POOL_HIGH_WATER 1024
+
+class ProcessPool
+{
+private:
+    struct Slot
+    {
+        Slot *next;
+    };
+
+    Slot *freeList;
+    u32   freeCount;
+    u32   highWater;
+
+public:
+    ProcessPool();
+    ~ProcessPool();
+
+    void *acquire();
+    void release(void *ptr);
+    void trim(u32 keep);
+
+    void setHighWater(u32 count);
+    u32 getHighWater() const { return highWater; }
+    u32 available() const { return freeCount; }
+};
+
+// sleeping processes, hashed by wake tick into TIMER_WHEEL_SIZE buckets.
+// Update only visits the bucket of the current tick; a process due more than
+// one turn of the wheel away stays in its bucket until its tick comes round
+#define TIMER_WHEEL_SIZE 256
+
+// the most percent one frame(n) adds, keeps frameCredit (under 100 between
+// frames) in a u32
+#define FRAME_MAX_PERCENT 4000000000.0
+
+class TimerWheel
+{
+private:
+    Process *buckets[TIMER_WHEEL_SIZE];
+    u32 sleeping;
+
+public:
+    TimerWheel();
+
+    void add(Process *p);
+    void remove(Process *p);
+    void wake(u64 tick);
+    void clear();
+
+    u32 count() const { return sleeping; }
+};
+
 class Process : public Task 
 {
 
@@ -356,10 +502,19 @@ private:
 friend class VirtualMachine;
 friend class Task;
 friend class ProcessList;
+friend class TimerWheel;
+friend class Aot;
+friend class Jit;
 
     Process *next;
     Process *prev;
 
+    Process *timerNext;
+    Process *timerPrev;
+    bool isSleeping;
+
+    u32 gcSlot; // index in VirtualMachine::gcProcesses
+
 protected:
     bool isCreated;
     
@@ -387,6 +542,18 @@ public:
 
 };
 
+// every created instance of one Update, in process-list order, as parallel
+// columns: x[i], y[i], graph[i] and id[i] belong to instances[i]
+struct RenderBatch
+{
+    u32 count;
+    Instance *const *instances;
+    const u32 *id;
+    const double *x;
+    const double *y;
+    const double *graph;
+};
+
 struct Hook
 {
     void (* instance_create_hook)(Instance *);
@@ -394,6 +561,10 @@ struct Hook
     void (* instance_pre_execute_hook)(Instance *);
     void (* instance_pos_execute_hook)(Instance *);
     void (* process_exec_hook)(Instance *);
+
+    // when set, replaces the three per-process render hooks above with one
+    // call at the end of Update; the batch is only valid during the call
+    void (* render_batch_hook)(const RenderBatch *);
 };
 
 void default_instance_create_hook(Instance *instance);
@@ -408,7 +579,8 @@ struct NativeFunctionObject
     NativeFunction func;
     String name;
     int arity;
-    NativeFunctionObject(NativeFunction func, const char *name, int arity);
+    bool threadSafe;
+    NativeFunctionObject(NativeFunction func, const char *name, int arity, bool threadSafe);
     int call(VirtualMachine *vm, int argc, Value *args);
 };
 
@@ -417,23 +589,87 @@ struct NativeFunctionObject
 
 class VirtualMachine
 {
+    friend class Arena;
     friend class Process;
+    friend class ProcessList;
     friend class Task;
     friend class Lexer;
     friend class Parser;
     friend class ScopeStack;
+    friend class Aot;
+    friend class Jit;
+    friend class Bytecode;
 
     Parser parser;
 
     Vector<Task *> taskes;
     HashTable<Task *> taskesMap;
 
-    HashTable<NativeFunctionObject *> nativeFunctions;
-    HashTable<FunctionObject *> functionsMap;
+    // call targets, indexed by the operand the parser emits for CALL,
+    // CALL_SCRIPT and CALL_PROCESS
+    Vector<NativeFunctionObject *> natives;
+    HashTable<u32> nativeSlots;
+    Vector<FunctionObject *> functions;
+    Vector<Task *> processes;
+
+    // declared before the process lists so they outlive them
+    ProcessPool pool;
+    EngineLocals engine;
+
+    // render_batch_hook columns, filled by Process::render
+    Vector<Instance *> batchInstances;
+    Vector<u32> batchId;
+    Vector<double> batchX;
+    Vector<double> batchY;
+    Vector<double> batchGraph;
+
+    void flushBatch();
+
+    // Update count, FRAME sleeps are measured in it
+    u64 tick;
+    TimerWheel timers;
+
+    // parallel Update: processes in list order, their Run() result, workers
+    JobPool jobs;
+    Vector<Process *> runQueue;
+    Vector<u8> runStates;
+    bool parallelPhase;
+
+    // task whose native call is running on this thread
+    static thread_local Task *nativeTask;
+
+    static void runProcessJob(void *user, u32 index);
+    void endTurn(Process *process, u8 state);
     ProcessList cleaner;
 
+    // compiles hot chunks, nullptr until enableJit; tierUp runs it at the
+    // points where no task is running
+    Jit *jit;
+    void tierUp();
+
+    // setCompileCache directory, empty when off; the .pcb of a source there
+    // and whether it can be loaded as it is (see Bytecode.cpp)
+    String compileCache;
+    String cachePath(const String &source);
+    bool isCached(const char *path);
 
-    Scope *global;
+    // incremental GC root scan: globals, tasks, functions, then the processes
+    // alive when the cycle began (a freed one is nulled out)
+    Vector<Process *> gcProcesses;
+    u32 gcStage;
+    u32 gcCursor;
+
+    void beginMark();
+    bool markRoots(size_t &work);
+
+
+    // globals live in a flat array indexed by the slot the parser resolved,
+    // the name map is only used at compile time and by the host API
+    Vector<Value> globals;
+    Vector<String> globalNames;
+    HashTable<u32> globalSlots;
+
+    u32 globalSlot(const char *name);
 
     static Value DEFAULT;
 
@@ -447,18 +683,16 @@ class VirtualMachine
     bool isHalt;
     bool isDone;
 
-    FunctionObject* newFunction(const char *name);
-    bool getFunction(const char *name,FunctionObject **func);
-
-
+    FunctionObject* newFunction(const char *name, u16 index);
 
-    Task *newTask(const char *name);
+    Task *newTask(const char *name, u16 index);
     Task *getCurrentTask();
     Task *getTask(const char *name);
 
     Task *addTask(const char *name);
     
     Process *AddProcess(const char *name);
+    void FreeProcess(Process *process);
 
     void setMainTask();
     void switchTask(Task *task);
@@ -468,8 +702,6 @@ class VirtualMachine
     void Warning(const char *format, ...);
     void Info(const char *format, ...);
 
-    int callNativeFunction(const char *name, Value *args, u8 argCount);
-
     u8 RunTask();
 
 
@@ -490,14 +722,26 @@ public:
     
     bool Run();
     bool Compile(String source);
+    // the compiled program as a .pcb file (see Bytecode.cpp). Save right
+    // after Compile; Load takes the place of Compile in a vm that registered
+    // the same natives and globals, in the same order
+    bool Save(const char *path);
+    bool Load(const char *path);
+    // opt-in: Compile loads the program from directory when the same source
+    // was compiled there before with the same natives and globals, and
+    // saves it there otherwise; nullptr or "" turns it off
+    void setCompileCache(const char *directory);
     bool IsReady();
-    bool Update();
+    // gcBudget: ms the incremental GC may take at the end of the frame
+    bool Update(double gcBudget = GC_FRAME_BUDGET);
 
 
     Task *getMainTask();
     void disassemble();
 
-    void registerFunction(const char *name, NativeFunction func, size_t arity);
+    // threadSafe natives may run on worker threads during a parallel Update,
+    // the others wait for the serial phase
+    void registerFunction(const char *name, NativeFunction func, size_t arity, bool threadSafe = false);
     bool registerVariable(const char *name, Value value);
     bool registerNumber(const char *name, double value);
     bool registerInteger(const char *name, int value);
@@ -505,6 +749,8 @@ public:
     bool registerBoolean(const char *name, bool value);
     bool registerNil(const char *name);
     bool ContainsVariable(const char *name);
+    bool getVariable(const char *name, Value &value);
+    bool setVariable(const char *name, Value value);
 
 
     bool  push(Value v);
@@ -538,6 +784,22 @@ public:
 
 
     size_t size() { return processList.count(); }
+    u32 sleeping() const { return timers.count(); }
+
+    // engine local column (IID, IGRAPH, IX, IY) over every process slot
+    double *getEngineColumn(int local) { return engine.column(local); }
+    u32 getEngineSlots() const { return engine.size(); }
+    u64 getTick() const { return tick; }
+
+    void setProcessPoolHighWater(u32 count) { pool.setHighWater(count); }
+
+    // run processes on count threads (the caller included) in Update, 0/1 is serial
+    void setThreads(u32 count) { jobs.start(count); }
+
+    // compile hot functions and process bodies to machine code (see Jit.hpp),
+    // false where there's no JIT (not x86-64 Linux, or NO_JIT)
+    bool enableJit();
+    u32 getThreads() const { return jobs.size() > 1 ? jobs.size() : 1; }
 
     Hook hooks;
 };
@@ -0,0 +1,856 @@
+#include "pch.h"
+#include "Vm.hpp"
+#include "Aot.hpp"
+
+extern void debugValue(const Value &v);
+extern const char *opcodeNames[];
+extern const char *engineLocalNames[DEFAULT_COUNT];
+
+static AotModule *modules = nullptr;
+
+AotModule::AotModule(const AotChunk *chunks, u32 count) : chunks(chunks), count(count), next(modules)
+{
+    modules = this;
+}
+
+static void mix(u64 &hash, const void *data, size_t size)
+{
+    const u8 *bytes = (const u8 *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+}
+
+static void mixName(u64 &hash, const String &name)
+{
+    mix(hash, name.c_str(), name.length() + 1);
+}
+
+u64 Aot::hash(const Task *task)
+{
+    u64 hash = 14695981039346656037ull;
+    const Chunk *chunk = task->chunk;
+    const VirtualMachine *vm = task->vm;
+
+    mixName(hash, task->name);
+    mix(hash, chunk->code, chunk->count);
+
+    for (u32 i = 0; i < task->constants.size(); i++)
+    {
+        const Value &value = task->constants[i];
+        u8 type = (u8)VALUE_TYPE(value);
+        mix(hash, &type, 1);
+        if (IS_NUMBER(value))
+        {
+            double number = AS_NUMBER(value);
+            mix(hash, &number, sizeof(number));
+        }
+        else if (IS_STRING(value))
+        {
+            mixName(hash, AS_STRING(value)->string);
+        }
+        else if (IS_BOOLEAN(value))
+        {
+            u8 boolean = AS_BOOLEAN(value) ? 1 : 0;
+            mix(hash, &boolean, 1);
+        }
+    }
+
+    // operands are slots of the compiling vm, what they name has to match
+    for (u32 offset = 0; offset < chunk->count;)
+    {
+        const u8 *at = chunk->code + offset;
+        u32 size = InstructionSize(at[0]);
+        if (size == 0 || offset + size > chunk->count)
+            break;
+        u32 index = size >= 3 ? (u32)((at[1] << 8) | at[2]) : 0;
+        switch ((OpCode)at[0])
+        {
+        case OpCode::GLOBAL_DEFINE:
+        case OpCode::GLOBAL_GET:
+        case OpCode::GLOBAL_ASSIGN:
+        case OpCode::GLOBAL_STORE:
+        case OpCode::ADD_GLOBAL:
+            if (index < vm->globalNames.size())
+                mixName(hash, vm->globalNames[index]);
+            break;
+        case OpCode::CALL:
+            if (index < vm->natives.size())
+                mixName(hash, vm->natives[index]->name);
+            break;
+        case OpCode::CALL_SCRIPT:
+            if (index < vm->functions.size() && vm->functions[index])
+                mixName(hash, vm->functions[index]->name);
+            break;
+        case OpCode::CALL_PROCESS:
+            if (index < vm->processes.size() && vm->processes[index])
+                mixName(hash, vm->processes[index]->name);
+            break;
+        default:
+            break;
+        }
+        offset += size;
+    }
+    return hash;
+}
+
+AotBody Aot::find(const char *name, u64 hash)
+{
+    for (AotModule *module = modules; module; module = module->next)
+    {
+        for (u32 i = 0; i < module->count; i++)
+        {
+            const AotChunk &chunk = module->chunks[i];
+            if (chunk.hash == hash && strcmp(chunk.name, name) == 0)
+                return chunk.body;
+        }
+    }
+    return nullptr;
+}
+
+void Aot::attach(VirtualMachine *vm)
+{
+    if (!modules)
+        return;
+    // only verified chunks were written, the bodies push without checks
+    for (u32 i = 0; i < vm->taskes.size(); i++)
+    {
+        Task *task = vm->taskes[i];
+        if (task->chunk->verified)
+            task->chunk->native = find(task->name.c_str(), hash(task));
+    }
+    for (u32 i = 0; i < vm->functions.size(); i++)
+    {
+        FunctionObject *function = vm->functions[i];
+        if (function && function->chunk->verified)
+            function->chunk->native = find(function->name.c_str(), hash(function));
+    }
+}
+
+//***************************************************************************************************************** */
+
+u8 Aot::run(Task *task, AotBody body)
+{
+    Frame *frame = &task->frames[task->frameCount - 1];
+    Chunk *chunk = frame->task->chunk;
+
+    if (task->state == PAUSED)
+    {
+        task->state = RUNNING;
+    }
+    if (frame->slots + chunk->maxStack > task->stack + task->stackCapacity)
+    {
+        if (!task->growStack((u32)(frame->slots + chunk->maxStack - task->stackTop)))
+        {
+            task->vm->Error("Stack overflow in '%s'", frame->task->name.c_str());
+            return ABORTED;
+        }
+        frame = &task->frames[task->frameCount - 1];
+    }
+
+    AotContext c;
+    c.task = task;
+    c.frame = frame;
+    c.sp = task->stackTop;
+    c.code = chunk->code;
+    c.constants = frame->task->constants.pointer();
+    c.globals = task->vm->globals.pointer();
+    c.vm = task->vm;
+    c.parallel = task->vm->parallelPhase;
+    c.slot = task->type == TaskType::TPROCESS ? static_cast<Process *>(task)->instance.slot : 0;
+    c.executed = task->resumeBudget;
+    task->resumeBudget = 0;
+
+    u8 status = body(c);
+    task->stackTop = c.sp;
+    if (status == AOT_YIELD)
+    {
+        task->resumeBudget = c.executed - instructionsPerFrame;
+        task->state = RUNNING;
+        return RUNNING;
+    }
+    return status;
+}
+
+// a helper that can't run while processes are on worker threads puts ip back
+// on its instruction, the serial phase of Update runs it again
+#define AOT_DEFER(size)                           \
+    if (vm->parallelPhase)                        \
+    {                                             \
+        c.frame->ip -= (size);                    \
+        task->resumeBudget = c.executed;          \
+        return DEFERRED;                          \
+    }
+
+// the new top frame runs wherever Run finds it, the call or return counts
+// as NEXT would count it
+static u8 handOver(AotContext &c, u32 &resumeBudget, u8 &state)
+{
+    if (++c.executed >= instructionsPerFrame)
+    {
+        resumeBudget = c.executed - instructionsPerFrame;
+        state = RUNNING;
+        return RUNNING;
+    }
+    resumeBudget = c.executed;
+    return SWITCH_LOOP;
+}
+
+u8 Aot::binary(AotContext &c, u8 op)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    task->stackTop = c.sp;
+    u8 status = OK;
+    switch ((OpCode)op)
+    {
+    case OpCode::ADD:
+    case OpCode::ADD_NUM:
+        status = task->op_add();
+        break;
+    case OpCode::MOD:
+        status = task->op_mod();
+        break;
+    case OpCode::NOT_EQUAL:
+    case OpCode::NOT_EQUAL_NUM:
+        status = task->op_not_equal();
+        break;
+    case OpCode::LESS:
+    case OpCode::LESS_NUM:
+        status = task->op_less();
+        break;
+    case OpCode::LESS_EQUAL:
+    case OpCode::LESS_EQUAL_NUM:
+        status = task->op_less_equal();
+        break;
+    case OpCode::GREATER:
+    case OpCode::GREATER_NUM:
+        status = task->op_greater();
+        break;
+    case OpCode::GREATER_EQUAL:
+    case OpCode::GREATER_EQUAL_NUM:
+        status = task->op_greater_equal();
+        break;
+    case OpCode::XOR:
+        status = task->op_xor();
+        break;
+    case OpCode::EQUAL:
+    case OpCode::EQUAL_NUM:
+    {
+        Value b = task->pop();
+        Value a = task->pop();
+        task->push(BOOLEAN(MatchValue(a, b)));
+        break;
+    }
+    default:
+    {
+        // the number path is inline, what gets here is an error
+        Value b = task->peek(0);
+        Value a = task->peek(1);
+        bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+        switch ((OpCode)op)
+        {
+        case OpCode::SUBTRACT:
+        case OpCode::SUBTRACT_NUM:
+            vm->Error("invalid  'subtract' operands [line %d]", task->currentLine());
+            task->state = ABORTED;
+            break;
+        case OpCode::MULTIPLY:
+        case OpCode::MULTIPLY_NUM:
+            vm->Error("invalid 'multiply' operands [line %d]", task->currentLine());
+            break;
+        case OpCode::DIVIDE:
+        case OpCode::DIVIDE_NUM:
+            if (numbers)
+                vm->Error("division by zero [line %d]", task->currentLine());
+            else
+                vm->Error("invalid 'divide' operands [line %d]", task->currentLine());
+            break;
+        case OpCode::POWER:
+            vm->Error("invalid 'power' operands [line %d]", task->currentLine());
+            break;
+        default:
+            vm->Error(" %s running unknown '%d' opcode", task->name.c_str(), (int)op);
+            break;
+        }
+        status = ABORTED;
+        break;
+    }
+    }
+    c.sp = task->stackTop;
+    return status;
+}
+
+u8 Aot::unary(AotContext &c, u8 op)
+{
+    c.vm->Error("invalid 'negate' operands, Operand must be a number.");
+    return ABORTED;
+}
+
+u8 Aot::simple(AotContext &c, u8 op, u8 operand)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    switch ((OpCode)op)
+    {
+    case OpCode::PRINT:
+    {
+        AOT_DEFER(1);
+        Value value = *--c.sp;
+        debugValue(value);
+        printf("\n");
+        return OK;
+    }
+    case OpCode::PROGRAM:
+        if (!IS_STRING(c.constants[operand]))
+        {
+            vm->Error("Program  name must be string [line %d]", task->currentLine());
+            task->state = ABORTED;
+            return ABORTED;
+        }
+        return OK;
+    case OpCode::CLONE:
+        AOT_DEFER(1);
+        INFO("CLONE %s", task->name.c_str());
+        return OK;
+    case OpCode::HALT:
+    default:
+        vm->Warning("Halt!");
+        task->isReturned = true;
+        task->state = ABORTED;
+        return ABORTED;
+    }
+}
+
+u8 Aot::global(AotContext &c, u8 op, u16 slot)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    AOT_DEFER(3);
+    Value value = c.sp[-1];
+    switch ((OpCode)op)
+    {
+    case OpCode::GLOBAL_DEFINE:
+        if (!IS_UNDEFINED(vm->globals[slot]))
+        {
+            vm->Error("Already a global variable with '%s' name.", vm->globalNames[slot].c_str());
+            return ABORTED;
+        }
+        WRITE_BARRIER(value);
+        vm->globals[slot] = value;
+        c.sp--;
+        return OK;
+    case OpCode::GLOBAL_STORE:
+        c.sp--;
+        // fall through
+    default:
+        if (IS_UNDEFINED(vm->globals[slot]))
+        {
+            vm->Warning("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), task->currentLine());
+        }
+        else
+        {
+            WRITE_BARRIER(vm->globals[slot]);
+            WRITE_BARRIER(value);
+            vm->globals[slot] = value;
+        }
+        return OK;
+    }
+}
+
+// a global read the inline path can't do: on a worker thread it waits for the
+// serial phase like a write, otherwise the global is undefined
+u8 Aot::readGlobal(AotContext &c, u16 slot)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    AOT_DEFER(3);
+    vm->Error("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), task->currentLine());
+    return ABORTED;
+}
+
+u8 Aot::engineError(AotContext &c, u8 local)
+{
+    if (local == IID)
+        c.vm->Error("Variable  ID is read-only");
+    else
+        c.vm->Error("Variable '%s' must be a number", engineLocalNames[local]);
+    return ABORTED;
+}
+
+u8 Aot::frame(AotContext &c)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    // the first frame fires the create hook
+    if (task->type == TaskType::TPROCESS && !static_cast<Process *>(task)->isCreated)
+    {
+        AOT_DEFER(1);
+    }
+    Value constant = *--c.sp;
+    if (!IS_NUMBER(constant))
+    {
+        vm->Error("frame percent must be a number [line %d]", task->currentLine());
+        return ABORTED;
+    }
+    double percent = AS_NUMBER(constant);
+    if (percent > FRAME_MAX_PERCENT)
+    {
+        percent = FRAME_MAX_PERCENT;
+    }
+    if (percent > 0)
+    {
+        task->frameCredit += (u32)percent;
+    }
+    task->stackTop = c.sp;
+    task->create();
+
+    u32 ticks = task->frameCredit / 100;
+    task->frameCredit %= 100;
+    if (ticks == 0)
+    {
+        return OK;
+    }
+    task->wakeTick = vm->tick + ticks;
+    task->state = PAUSED;
+    return PAUSED;
+}
+
+u8 Aot::callNative(AotContext &c, u16 index, u8 argCount)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    NativeFunctionObject *native = vm->natives[index];
+    if (!native->threadSafe)
+    {
+        AOT_DEFER(4);
+    }
+
+    task->stackTop = c.sp;
+    if (!task->growStack(NATIVE_STACK_ROOM))
+    {
+        vm->Error("Stack overflow calling '%s' [line %d]", native->name.c_str(), task->currentLine());
+        return ABORTED;
+    }
+    Value *args = task->stackTop - argCount;
+    VirtualMachine::nativeTask = task;
+    int count = native->call(vm, argCount, args);
+    VirtualMachine::nativeTask = nullptr;
+    c.sp = task->stackTop;
+    if (count == -1)
+    {
+        return ABORTED;
+    }
+    if (count > c.sp - args - argCount)
+    {
+        vm->Error("Native '%s' returned more values than it pushed [line %d]", native->name.c_str(), task->currentLine());
+        return ABORTED;
+    }
+    Value result = count > 0 ? c.sp[-1] : NONE();
+    c.sp -= argCount + count;
+    *c.sp++ = result;
+    // the native may have grown the stack or registered a global
+    c.frame = &task->frames[task->frameCount - 1];
+    c.globals = vm->globals.pointer();
+    return OK;
+}
+
+u8 Aot::callScript(AotContext &c, u16 index, u8 argCount)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    FunctionObject *callTask = vm->functions[index];
+
+    if (!task->growFrames())
+    {
+        vm->Error("Frames  overflow .");
+        return ABORTED;
+    }
+    Frame *frame = &task->frames[task->frameCount++];
+    frame->task = callTask;
+    frame->ip = callTask->chunk->code;
+    frame->slots = c.sp - argCount;
+    u8 status = handOver(c, task->resumeBudget, task->state);
+    AotBody body = __atomic_load_n(&callTask->chunk->native, __ATOMIC_RELAXED);
+    if (status != SWITCH_LOOP || !body)
+    {
+        return status;
+    }
+
+    // a native callee runs from here and its RETURN comes back to the
+    // caller's body; anything else (a yield, an interpreted frame on top)
+    // unwinds to Run, the frames hold all the state to resume from
+    int depth = task->frameCount - 1;
+    task->stackTop = c.sp;
+    for (;;)
+    {
+        status = run(task, body);
+        if (status != SWITCH_LOOP)
+            break;
+        if (task->frameCount == depth)
+        {
+            c.frame = &task->frames[depth - 1];
+            c.sp = task->stackTop;
+            c.globals = vm->globals.pointer();
+            c.executed = task->resumeBudget;
+            task->resumeBudget = 0;
+            return OK;
+        }
+        body = __atomic_load_n(&task->frames[task->frameCount - 1].task->chunk->native, __ATOMIC_RELAXED);
+        if (!body)
+            break;
+    }
+    c.sp = task->stackTop;
+    return status;
+}
+
+u8 Aot::ret(AotContext &c)
+{
+    Task *task = c.task;
+    Value result = *--c.sp;
+    task->frameCount--;
+    if (task->frameCount == 0)
+    {
+        task->isReturned = true;
+        INFO("main %s", c.frame->task->name.c_str());
+        task->stackTop = c.sp;
+        task->PrintStack();
+        c.sp = task->stack;
+        task->state = TERMINATED;
+        return TERMINATED;
+    }
+    c.sp = c.frame->slots;
+    *c.sp++ = result;
+    return handOver(c, task->resumeBudget, task->state);
+}
+
+u8 Aot::callProcess(AotContext &c, u16 index, u8 argCount)
+{
+    Task *task = c.task;
+    VirtualMachine *vm = c.vm;
+    AOT_DEFER(4);
+    Task *callTask = vm->processes[index];
+
+    Process *process = vm->AddProcess(callTask->name.c_str());
+    for (int i = 0; i < DEFAULT_COUNT; i++)
+    {
+        process->push(NONE());
+    }
+    process->init_frames(callTask);
+
+    for (int i = argCount - 1; i >= 0; i--)
+    {
+        WRITE_BARRIER(c.sp[-1 - i]);
+        process->push(c.sp[-1 - i]);
+    }
+    c.sp -= argCount;
+
+    if (task->type == TaskType::TPROCESS)
+    {
+        process->set_parent(static_cast<Process *>(task));
+    }
+
+    vm->processList.add(process);
+    *c.sp++ = INTEGER((int)process->ID);
+    process->set_defaults();
+    return RUNNING;
+}
+
+u8 Aot::returnProcess(AotContext &c)
+{
+    Task *task = c.task;
+    task->isReturned = true;
+    c.sp = c.frame->slots;
+    task->state = TERMINATED;
+    return TERMINATED;
+}
+
+#undef AOT_DEFER
+
+//***************************************************************************************************************** */
+
+static u32 readShort(const u8 *at)
+{
+    return (u32)((at[1] << 8) | at[2]);
+}
+
+// one instruction of a body, false for an opcode Run doesn't implement;
+// out == nullptr only checks
+static bool writeInstruction(FILE *out, const u8 *code, u32 at)
+{
+    const u8 *ins = code + at;
+    u8 op = ins[0];
+    u32 next = at + InstructionSize(op);
+    u32 target = 0;
+    if (InstructionSize(op) == 3)
+    {
+        target = op == OpCode::JUMP_BACK ? next - readShort(ins) : next + readShort(ins);
+    }
+    u32 count = 1; // instructions it stands for, as NEXT_FUSED counts
+    bool falls = true;
+
+#define EMIT(...) (out ? fprintf(out, __VA_ARGS__) : 0)
+    switch ((OpCode)op)
+    {
+    case OpCode::CONST:
+    case OpCode::PUSH:
+        EMIT("AOT_PUSH(k[%u]);", ins[1]);
+        break;
+    case OpCode::POP:
+        EMIT("sp--;");
+        break;
+    case OpCode::TRUE:
+        EMIT("AOT_PUSH(BOOLEAN(true));");
+        break;
+    case OpCode::FALSE:
+        EMIT("AOT_PUSH(BOOLEAN(false));");
+        break;
+    case OpCode::NIL:
+        EMIT("AOT_PUSH(Aot::nil());");
+        break;
+    case OpCode::NOW:
+        EMIT("AOT_PUSH(NUMBER(time_now()));");
+        break;
+    case OpCode::DUP:
+        EMIT("Value value = sp[-1]; AOT_PUSH(value);");
+        break;
+    case OpCode::NOT:
+        EMIT("sp[-1] = BOOLEAN(isFalsey(sp[-1]));");
+        break;
+    case OpCode::NEGATE:
+        EMIT("if (IS_NUMBER(sp[-1])) sp[-1] = NUMBER(-AS_NUMBER(sp[-1])); else AOT_CALL(%u, Aot::unary(c, OpCode::NEGATE));", next);
+        break;
+    case OpCode::EVAL_EQUAL:
+        EMIT("bool result = MatchValue(sp[-2], sp[-1]); AOT_PUSH(BOOLEAN(result));");
+        break;
+    case OpCode::EQUAL:
+        EMIT("AOT_EQUAL();");
+        break;
+
+    case OpCode::ADD:
+    case OpCode::ADD_NUM:
+        EMIT("AOT_NUMBER_OP(ADD, %u, true, NUMBER(x + y));", next);
+        break;
+    case OpCode::SUBTRACT:
+    case OpCode::SUBTRACT_NUM:
+        EMIT("AOT_NUMBER_OP(SUBTRACT, %u, true, NUMBER(x - y));", next);
+        break;
+    case OpCode::MULTIPLY:
+    case OpCode::MULTIPLY_NUM:
+        EMIT("AOT_NUMBER_OP(MULTIPLY, %u, true, NUMBER(x * y));", next);
+        break;
+    case OpCode::DIVIDE:
+    case OpCode::DIVIDE_NUM:
+        EMIT("AOT_NUMBER_OP(DIVIDE, %u, y != 0, NUMBER(x / y));", next);
+        break;
+    case OpCode::MOD:
+        EMIT("AOT_NUMBER_OP(MOD, %u, y != 0, NUMBER(AotMod(x, y)));", next);
+        break;
+    case OpCode::POWER:
+        EMIT("AOT_NUMBER_OP(POWER, %u, true, NUMBER(pow(x, y)));", next);
+        break;
+    case OpCode::EQUAL_NUM:
+        EMIT("AOT_NUMBER_OP(EQUAL, %u, true, BOOLEAN(MatchNumber(x, y)));", next);
+        break;
+    case OpCode::NOT_EQUAL:
+    case OpCode::NOT_EQUAL_NUM:
+        EMIT("AOT_NUMBER_OP(NOT_EQUAL, %u, true, BOOLEAN(x != y));", next);
+        break;
+    case OpCode::LESS:
+    case OpCode::LESS_NUM:
+        EMIT("AOT_NUMBER_OP(LESS, %u, true, BOOLEAN(x < y));", next);
+        break;
+    case OpCode::LESS_EQUAL:
+    case OpCode::LESS_EQUAL_NUM:
+        EMIT("AOT_NUMBER_OP(LESS_EQUAL, %u, true, BOOLEAN(x <= y));", next);
+        break;
+    case OpCode::GREATER:
+    case OpCode::GREATER_NUM:
+        EMIT("AOT_NUMBER_OP(GREATER, %u, true, BOOLEAN(x > y));", next);
+        break;
+    case OpCode::GREATER_EQUAL:
+    case OpCode::GREATER_EQUAL_NUM:
+        EMIT("AOT_NUMBER_OP(GREATER_EQUAL, %u, true, BOOLEAN(x >= y));", next);
+        break;
+    case OpCode::XOR:
+        EMIT("AOT_CALL(%u, Aot::binary(c, OpCode::XOR));", next);
+        break;
+
+    case OpCode::HALT:
+    case OpCode::PROGRAM:
+    case OpCode::PRINT:
+    case OpCode::CLONE:
+        EMIT("AOT_CALL(%u, Aot::simple(c, OpCode::%s, %u));", next, opcodeNames[op], op == OpCode::PROGRAM ? ins[1] : 0);
+        break;
+
+    case OpCode::GLOBAL_STORE:
+        count = 2;
+        // fall through
+    case OpCode::GLOBAL_DEFINE:
+    case OpCode::GLOBAL_ASSIGN:
+        EMIT("AOT_CALL(%u, Aot::global(c, OpCode::%s, %u));", next, opcodeNames[op], readShort(ins));
+        break;
+    case OpCode::GLOBAL_GET:
+        EMIT("AOT_GLOBAL(%u, %u, value); AOT_PUSH(value);", next, readShort(ins));
+        break;
+    case OpCode::ADD_GLOBAL:
+        EMIT("AOT_GLOBAL(%u, %u, value); AOT_ADD_VALUE(%u, value);", next, readShort(ins), next);
+        count = 2;
+        break;
+
+    case OpCode::LOCAL_GET:
+        EMIT("AOT_PUSH(slots[%u]);", ins[1]);
+        break;
+    case OpCode::LOCAL_SET:
+        EMIT("AOT_LOCAL_SET(%u);", ins[1]);
+        break;
+    case OpCode::LOCAL_STORE:
+        EMIT("AOT_LOCAL_STORE(%u);", ins[1]);
+        count = 2;
+        break;
+    case OpCode::ADD_LOCAL:
+        EMIT("AOT_ADD_VALUE(%u, slots[%u]);", next, ins[1]);
+        count = 2;
+        break;
+    case OpCode::ADD_CONST:
+        EMIT("AOT_ADD_VALUE(%u, k[%u]);", next, ins[1]);
+        count = 2;
+        break;
+    case OpCode::ADD_LOCAL_LOCAL:
+        EMIT("AOT_PUSH(slots[%u]); AOT_ADD_VALUE(%u, slots[%u]);", ins[1], next, ins[2]);
+        count = 3;
+        break;
+    case OpCode::LOCAL_INC_CONST:
+        EMIT("AOT_LOCAL_INC(%u, %u, k[%u]);", next, ins[1], ins[2]);
+        count = 5;
+        break;
+
+    case OpCode::ENGINE_GET:
+        EMIT("AOT_PUSH(NUMBER(AOT_ENGINE(%u)));", ins[1]);
+        break;
+    case OpCode::ENGINE_STORE:
+        count = 2;
+        // fall through
+    case OpCode::ENGINE_SET:
+        if (ins[1] == IID)
+            EMIT("AOT_CALL(%u, Aot::engineError(c, IID));", next);
+        else
+            EMIT("AOT_ENGINE_SET(%u, %u, %u);", next, ins[1], count == 2 ? 1 : 0);
+        break;
+
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_BACK:
+        EMIT("AOT_GOTO(1, %u);", target);
+        falls = false;
+        break;
+    case OpCode::JUMP_IF_FALSE:
+        EMIT("if (isFalsey(sp[-1])) AOT_GOTO(1, %u);", target);
+        break;
+    case OpCode::POP_JUMP_IF_FALSE:
+        EMIT("if (isFalsey(*--sp)) AOT_GOTO(2, %u);", target);
+        count = 2;
+        break;
+    case OpCode::JUMP_IF_NOT_LESS:
+        EMIT("AOT_COMPARE_JUMP(LESS, <, %u, %u);", next, target);
+        falls = false;
+        break;
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+        EMIT("AOT_COMPARE_JUMP(LESS_EQUAL, <=, %u, %u);", next, target);
+        falls = false;
+        break;
+    case OpCode::JUMP_IF_NOT_GREATER:
+        EMIT("AOT_COMPARE_JUMP(GREATER, >, %u, %u);", next, target);
+        falls = false;
+        break;
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+        EMIT("AOT_COMPARE_JUMP(GREATER_EQUAL, >=, %u, %u);", next, target);
+        falls = false;
+        break;
+
+    case OpCode::FRAME:
+        EMIT("AOT_CALL(%u, Aot::frame(c));", next);
+        break;
+    case OpCode::CALL:
+        EMIT("AOT_CALL(%u, Aot::callNative(c, %u, %u));", next, readShort(ins), ins[3]);
+        break;
+    case OpCode::CALL_SCRIPT:
+        // the call and the return count themselves
+        EMIT("AOT_CALL(%u, Aot::callScript(c, %u, %u));", next, readShort(ins), ins[3]);
+        falls = false;
+        break;
+    case OpCode::CALL_PROCESS:
+        EMIT("AOT_LEAVE(%u, Aot::callProcess(c, %u, %u));", next, readShort(ins), ins[3]);
+        falls = false;
+        break;
+    case OpCode::RETURN:
+        EMIT("AOT_LEAVE(%u, Aot::ret(c));", next);
+        falls = false;
+        break;
+    case OpCode::RETURN_PROCESS:
+        EMIT("AOT_LEAVE(%u, Aot::returnProcess(c));", next);
+        falls = false;
+        break;
+
+    default:
+        return false;
+    }
+    if (falls)
+        EMIT(" AOT_NEXT(%u, %u);", count, next);
+#undef EMIT
+    return true;
+}
+
+bool Aot::write(VirtualMachine *vm, FILE *out, const char *prefix)
+{
+    Vector<Task *> chunks;
+    for (u32 i = 0; i < vm->taskes.size(); i++)
+        chunks.push_back(vm->taskes[i]);
+    for (u32 i = 0; i < vm->functions.size(); i++)
+        if (vm->functions[i])
+            chunks.push_back(vm->functions[i]);
+
+    Vector<u32> written;
+    for (u32 n = 0; n < chunks.size(); n++)
+    {
+        Task *task = chunks[n];
+        const Chunk *chunk = task->chunk;
+        if (!chunk->verified)
+            continue;
+
+        // a chunk with an opcode Run doesn't run either stays with it
+        const u8 *code = chunk->code;
+        bool ok = true;
+        for (u32 offset = 0; offset < chunk->count && ok; offset += InstructionSize(code[offset]))
+            ok = writeInstruction(nullptr, code, offset);
+        if (!ok)
+            continue;
+
+        fprintf(out, "// %s\nstatic u8 %s_%u(AotContext &c)\n{\n    AOT_ENTER();\n", task->name.c_str(), prefix, n);
+        fprintf(out, "    switch ((u32)(c.frame->ip - c.code))\n    {\n");
+        for (u32 offset = 0; offset < chunk->count; offset += InstructionSize(code[offset]))
+            fprintf(out, "    case %u: goto L%u;\n", offset, offset);
+        fprintf(out, "    default: return ABORTED;\n    }\n");
+        for (u32 offset = 0; offset < chunk->count; offset += InstructionSize(code[offset]))
+        {
+            fprintf(out, "L%u: { ", offset);
+            writeInstruction(out, code, offset);
+            fprintf(out, " } // %s\n", opcodeNames[code[offset]]);
+        }
+        fprintf(out, "    return ABORTED;\n}\n\n");
+        written.push_back(n);
+    }
+    if (written.size() == 0)
+        return false;
+
+    fprintf(out, "static const AotChunk %s_chunks[] = {\n", prefix);
+    for (u32 i = 0; i < written.size(); i++)
+    {
+        Task *task = chunks[written[i]];
+        fprintf(out, "    {\"%s\", 0x%016llxull, %s_%u},\n", task->name.c_str(), (unsigned long long)hash(task), prefix, written[i]);
+    }
+    fprintf(out, "};\nstatic AotModule %s_module(%s_chunks, %u);\n\n", prefix, prefix, (u32)written.size());
+    return true;
+}
@@ -0,0 +1,474 @@
+#include "pch.h"
+#include "Vm.hpp"
+#include "Aot.hpp"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#define mkdir(path, mode) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Precompiled programs (.pcb). VirtualMachine::Save writes what Compile leaves
+// behind and Load maps the file and builds the same tasks from it, without
+// the lexer and the parser. Numbers are in the byte order of the machine
+// that wrote the file:
+//
+//   header     "BUPC", PCB_VERSION, OpCode::COUNT, file size, checksum of
+//              the rest (FNV-1a)
+//   globals    count, then each name by slot
+//   natives    count, then each name and arity by call index
+//   tasks      process and function counts, then __main__, the process
+//              prototypes and the functions by index: name, argument count,
+//              verified flag, constants, code and line table
+//
+// A string is its length and its bytes. Code and line table are stored the
+// way the chunk holds them (superinstructions fused, lines run-length), so
+// loading only copies them out of the mapping. Constants are tagged values,
+// a file works with either Value layout.
+//
+// Globals and natives are slots in the code: the loading vm has to resolve
+// every name in the file to the same slot, or the load fails. Chunks are
+// verified again; one that was verified when saved and isn't now means the
+// file is damaged.
+//
+// The compile cache (setCompileCache) is a directory of these files, named
+// by a hash of everything Compile depends on. Compile loads the file of its
+// source when it is there and intact, and saves it when it isn't.
+
+// bump on any change of the layout above or of the bytecode
+#define PCB_VERSION 2
+
+static const char PCB_MAGIC[4] = {'B', 'U', 'P', 'C'};
+// offset of the file size and the checksum in the header, and its size
+static const long PCB_SIZE_AT = 12;
+static const size_t PCB_HEADER = 24;
+
+static const u64 FNV_OFFSET = 14695981039346656037ull;
+
+static void mix(u64 &hash, const void *data, size_t count)
+{
+    const u8 *bytes = (const u8 *)data;
+    for (size_t i = 0; i < count; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+}
+
+struct PcbWriter
+{
+    FILE *out;
+    u32 size;
+    u64 checksum; // of what follows the header
+    bool ok;
+
+    void bytes(const void *data, size_t count)
+    {
+        if (ok && count > 0 && fwrite(data, 1, count, out) != count)
+            ok = false;
+        if (size >= PCB_HEADER)
+            mix(checksum, data, count);
+        size += (u32)count;
+    }
+    void byte(u8 value) { bytes(&value, 1); }
+    void word(u32 value) { bytes(&value, sizeof(value)); }
+    void number(double value) { bytes(&value, sizeof(value)); }
+    void string(const String &value)
+    {
+        word((u32)value.length());
+        bytes(value.c_str(), value.length());
+    }
+};
+
+// reads past the end of the mapping fail once and return zeros from then on
+struct PcbReader
+{
+    const u8 *at;
+    const u8 *end;
+    bool ok;
+
+    const u8 *bytes(size_t count)
+    {
+        if (!ok || (size_t)(end - at) < count)
+        {
+            ok = false;
+            return nullptr;
+        }
+        const u8 *data = at;
+        at += count;
+        return data;
+    }
+    u8 byte()
+    {
+        const u8 *data = bytes(1);
+        return data ? data[0] : 0;
+    }
+    u32 word()
+    {
+        u32 value = 0;
+        const u8 *data = bytes(sizeof(value));
+        if (data)
+            std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    u64 wide()
+    {
+        u64 value = 0;
+        const u8 *data = bytes(sizeof(value));
+        if (data)
+            std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    double number()
+    {
+        double value = 0;
+        const u8 *data = bytes(sizeof(value));
+        if (data)
+            std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+    String string()
+    {
+        u32 length = word();
+        const u8 *data = bytes(length);
+        return data ? String((const char *)data, length) : String();
+    }
+};
+
+class Bytecode
+{
+    static void writeTask(PcbWriter &w, const Task *task);
+    static bool readTask(PcbReader &r, Task *task);
+
+public:
+    static bool save(VirtualMachine *vm, FILE *out);
+    // header, checksum and the global and native slots against vm, without
+    // changing it; report says why a file doesn't fit
+    static bool check(VirtualMachine *vm, PcbReader &r, const char *path, bool report);
+    // builds the program of a checked file
+    static bool load(VirtualMachine *vm, PcbReader &r, const char *path);
+};
+
+void Bytecode::writeTask(PcbWriter &w, const Task *task)
+{
+    const Chunk *chunk = task->chunk;
+
+    w.string(task->name);
+    w.byte(task->argsCount);
+    w.byte(chunk->verified ? 1 : 0);
+
+    w.word((u32)task->constants.size());
+    for (u32 i = 0; i < task->constants.size(); i++)
+    {
+        const Value &value = task->constants[i];
+        w.byte((u8)VALUE_TYPE(value));
+        if (IS_NUMBER(value))
+            w.number(AS_NUMBER(value));
+        else if (IS_STRING(value))
+            w.string(AS_STRING(value)->string);
+        else if (IS_BOOLEAN(value))
+            w.byte(AS_BOOLEAN(value) ? 1 : 0);
+    }
+
+    w.word(chunk->count);
+    w.bytes(chunk->code, chunk->count);
+    w.word(chunk->lineCount);
+    w.bytes(chunk->lines, chunk->lineCount * sizeof(LineStart));
+}
+
+// the rest of a task after its name; leaves the saved verified flag in the chunk
+bool Bytecode::readTask(PcbReader &r, Task *task)
+{
+    task->argsCount = r.byte();
+    bool verified = r.byte() != 0;
+
+    u32 constants = r.word();
+    if (constants > 256)
+        return false;
+    task->constants.clear();
+    for (u32 i = 0; i < constants && r.ok; i++)
+    {
+        switch ((ValueType)r.byte())
+        {
+        case ValueType::VNUMBER:
+            task->constants.push_back(NUMBER(r.number()));
+            break;
+        case ValueType::VSTRING:
+            // the parser interns every string constant
+            task->constants.push_back(INTERNED(r.string()));
+            break;
+        case ValueType::VBOOLEAN:
+            task->constants.push_back(BOOLEAN(r.byte() != 0));
+            break;
+        case ValueType::VNONE:
+            task->constants.push_back(NONE());
+            break;
+        default:
+            return false;
+        }
+    }
+
+    u32 count = r.word();
+    const u8 *code = r.bytes(count);
+    u32 lineCount = r.word();
+    const u8 *lines = r.bytes((size_t)lineCount * sizeof(LineStart));
+    if (!r.ok || !task->chunk->assign(code, count, (const LineStart *)lines, lineCount))
+        return false;
+    task->chunk->verified = verified;
+    return true;
+}
+
+bool Bytecode::save(VirtualMachine *vm, FILE *out)
+{
+    PcbWriter w{out, 0, FNV_OFFSET, true};
+
+    w.bytes(PCB_MAGIC, sizeof(PCB_MAGIC));
+    w.word(PCB_VERSION);
+    w.word(OpCode::COUNT);
+    w.word(0); // size and checksum, written last
+    w.bytes("\0\0\0\0\0\0\0\0", sizeof(u64));
+
+    w.word((u32)vm->globalNames.size());
+    for (u32 i = 0; i < vm->globalNames.size(); i++)
+        w.string(vm->globalNames[i]);
+
+    w.word((u32)vm->natives.size());
+    for (u32 i = 0; i < vm->natives.size(); i++)
+    {
+        w.string(vm->natives[i]->name);
+        w.word((u32)vm->natives[i]->arity);
+    }
+
+    w.word((u32)vm->processes.size());
+    w.word((u32)vm->functions.size());
+    writeTask(w, vm->mainTask);
+    for (u32 i = 0; i < vm->processes.size(); i++)
+        writeTask(w, vm->processes[i]);
+    for (u32 i = 0; i < vm->functions.size(); i++)
+        writeTask(w, vm->functions[i]);
+
+    u32 size = w.size;
+    return w.ok && fseek(out, PCB_SIZE_AT, SEEK_SET) == 0 &&
+           fwrite(&size, sizeof(size), 1, out) == 1 &&
+           fwrite(&w.checksum, sizeof(w.checksum), 1, out) == 1;
+}
+
+#define PCB_FAIL(...)                \
+    {                                \
+        if (report)                  \
+            vm->Error(__VA_ARGS__);  \
+        return false;                \
+    }
+
+bool Bytecode::check(VirtualMachine *vm, PcbReader &r, const char *path, bool report)
+{
+    size_t size = (size_t)(r.end - r.at);
+    const u8 *magic = r.bytes(sizeof(PCB_MAGIC));
+    if (!magic || std::memcmp(magic, PCB_MAGIC, sizeof(PCB_MAGIC)) != 0)
+        PCB_FAIL("%s is not a compiled program", path);
+    u32 version = r.word();
+    u32 opcodes = r.word();
+    if (version != PCB_VERSION || opcodes != OpCode::COUNT)
+        PCB_FAIL("%s was compiled for another version of the vm (%u, this one reads %u)", path, version, PCB_VERSION);
+    u32 fileSize = r.word();
+    u64 checksum = r.wide();
+    u64 sum = FNV_OFFSET;
+    if (r.ok)
+        mix(sum, r.at, (size_t)(r.end - r.at));
+    if (!r.ok || fileSize != size || sum != checksum)
+        PCB_FAIL("%s is damaged", path);
+
+    // a global the vm doesn't have yet gets the next slot when loading
+    u32 globals = r.word();
+    for (u32 i = 0; i < globals && r.ok; i++)
+    {
+        String name = r.string();
+        u32 slot;
+        bool known = vm->globalSlots.find(name.c_str(), slot);
+        if (r.ok && (known ? slot != i : i < vm->globals.size()))
+            PCB_FAIL("%s: global '%s' is slot %u in the file and %u here, register the globals like the compiling vm did",
+                     path, name.c_str(), i, known ? slot : (u32)vm->globals.size());
+    }
+
+    u32 natives = r.word();
+    if (r.ok && natives > vm->natives.size())
+        PCB_FAIL("%s calls %u natives, %u are registered", path, natives, (u32)vm->natives.size());
+    for (u32 i = 0; i < natives && r.ok; i++)
+    {
+        String name = r.string();
+        int arity = (int)r.word();
+        NativeFunctionObject *native = vm->natives[i];
+        if (r.ok && (name != native->name || arity != native->arity))
+            PCB_FAIL("%s: native %u is %s(%d) in the file and %s(%d) here", path, i, name.c_str(), arity, native->name.c_str(), native->arity);
+    }
+    if (!r.ok)
+        PCB_FAIL("%s is damaged", path);
+    return true;
+}
+
+#undef PCB_FAIL
+
+bool Bytecode::load(VirtualMachine *vm, PcbReader &r, const char *path)
+{
+    r.bytes(PCB_HEADER);
+    u32 globals = r.word();
+    for (u32 i = 0; i < globals; i++)
+        vm->globalSlot(r.string().c_str());
+    u32 natives = r.word();
+    for (u32 i = 0; i < natives; i++)
+    {
+        r.string();
+        r.word();
+    }
+
+    u32 processes = r.word();
+    u32 functions = r.word();
+    if (processes > UINT16_MAX + 1 || functions > UINT16_MAX + 1)
+        r.ok = false;
+
+    r.string(); // __main__
+    bool ok = r.ok && readTask(r, vm->mainTask);
+    for (u32 i = 0; i < processes && ok; i++)
+    {
+        String name = r.string();
+        vm->processes.push_back(nullptr);
+        Task *task = vm->newTask(name.c_str(), (u16)i);
+        task->chunk = new Chunk(1);
+        ok = r.ok && readTask(r, task);
+    }
+    for (u32 i = 0; i < functions && ok; i++)
+    {
+        String name = r.string();
+        vm->functions.push_back(nullptr);
+        FunctionObject *function = vm->newFunction(name.c_str(), (u16)i);
+        ok = r.ok && readTask(r, function);
+        function->arity = function->argsCount;
+    }
+    vm->setMainTask();
+
+    // the calls are checked against every task, verify once all are there
+    for (u32 i = 0; i < vm->taskes.size() && ok; i++)
+    {
+        Task *task = vm->taskes[i];
+        bool verified = task->chunk->verified;
+        ok = task->verify(task->type == TaskType::TPROCESS ? DEFAULT_COUNT + task->argsCount : 0) || !verified;
+    }
+    for (u32 i = 0; i < vm->functions.size() && ok; i++)
+    {
+        FunctionObject *function = vm->functions[i];
+        bool verified = function->chunk->verified;
+        ok = function->verify(function->arity) || !verified;
+    }
+    if (!ok || r.at != r.end)
+    {
+        vm->Error("%s is damaged", path);
+        return false;
+    }
+
+    Aot::attach(vm);
+    return true;
+}
+
+bool VirtualMachine::Save(const char *path)
+{
+    bool compiled = mainTask->chunk->count > 0;
+    for (u32 i = 0; i < processes.size(); i++)
+        compiled = compiled && processes[i];
+    for (u32 i = 0; i < functions.size(); i++)
+        compiled = compiled && functions[i];
+    if (!compiled)
+    {
+        Warning("Save %s: no compiled program", path);
+        return false;
+    }
+
+    // written next to path and renamed over it, a failed save (or one racing
+    // another process) never leaves a partial file behind
+    char temp[1024];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    FILE *out = fopen(temp, "wb");
+    if (!out)
+    {
+        Warning("Failed to write %s", temp);
+        return false;
+    }
+    bool ok = Bytecode::save(this, out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temp, path) != 0)
+    {
+        remove(temp);
+        Warning("Failed to write %s", path);
+        return false;
+    }
+    return true;
+}
+
+bool VirtualMachine::Load(const char *path)
+{
+    if (mainTask->chunk->count > 0)
+    {
+        Error("Load %s: the vm already holds a program", path);
+        return false;
+    }
+
+    size_t size = 0;
+    const void *data = MapFile(path, &size);
+    if (!data)
+    {
+        Error("Failed to load %s", path);
+        return false;
+    }
+    PcbReader r{(const u8 *)data, (const u8 *)data + size, true};
+    PcbReader program = r;
+    bool ok = Bytecode::check(this, r, path, true) && Bytecode::load(this, program, path);
+    UnmapFile(data, size);
+    return ok;
+}
+
+void VirtualMachine::setCompileCache(const char *directory)
+{
+    compileCache = directory ? directory : "";
+    if (compileCache.length() > 0)
+        mkdir(directory, 0755); // fails when it's there already
+}
+
+String VirtualMachine::cachePath(const String &source)
+{
+    // what Compile depends on besides the source: the bytecode, and the
+    // slots of the natives and globals registered so far
+    u64 hash = FNV_OFFSET;
+#ifdef NO_SUPERINSTRUCTIONS
+    u32 format[3] = {PCB_VERSION, OpCode::COUNT, 0};
+#else
+    u32 format[3] = {PCB_VERSION, OpCode::COUNT, 1};
+#endif
+    mix(hash, format, sizeof(format));
+    for (u32 i = 0; i < natives.size(); i++)
+    {
+        mix(hash, natives[i]->name.c_str(), natives[i]->name.length() + 1);
+        mix(hash, &natives[i]->arity, sizeof(natives[i]->arity));
+    }
+    for (u32 i = 0; i < globalNames.size(); i++)
+        mix(hash, globalNames[i].c_str(), globalNames[i].length() + 1);
+    mix(hash, source.c_str(), source.length());
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.pcb", (unsigned long long)hash);
+    return compileCache + name;
+}
+
+bool VirtualMachine::isCached(const char *path)
+{
+    size_t size = 0;
+    const void *data = MapFile(path, &size);
+    if (!data)
+        return false;
+    PcbReader r{(const u8 *)data, (const u8 *)data + size, true};
+    bool ok = Bytecode::check(this, r, path, false);
+    UnmapFile(data, size);
+    return ok;
+}
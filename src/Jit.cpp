@@ -0,0 +1,1203 @@
+#include "pch.h"
+#include "Vm.hpp"
+#include "Jit.hpp"
+
+#ifdef USE_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+Jit::Jit() : pending(false), compiled(0)
+{
+}
+
+Jit::~Jit()
+{
+#ifdef USE_JIT
+    for (u32 i = 0; i < blocks.size(); i++)
+        munmap(blocks[i].memory, blocks[i].size);
+#endif
+}
+
+void Jit::consider(Task *task)
+{
+    Chunk *chunk = task->chunk;
+    if (chunk->native || !chunk->verified || chunk->deopts >= JIT_MAX_DEOPTS)
+        return;
+    if (__atomic_load_n(&chunk->hotness, __ATOMIC_RELAXED) < JIT_THRESHOLD)
+        return;
+    chunk->native = compile(task);
+    if (!chunk->native)
+    {
+        // an opcode without a stencil, compiling again won't change that
+        chunk->deopts = JIT_MAX_DEOPTS;
+    }
+}
+
+void Jit::tierUp(VirtualMachine *vm)
+{
+    pending = false;
+    for (u32 i = 0; i < vm->taskes.size(); i++)
+        consider(vm->taskes[i]);
+    for (u32 i = 0; i < vm->functions.size(); i++)
+        if (vm->functions[i])
+            consider(vm->functions[i]);
+}
+
+u8 Jit::deopt(AotContext &c)
+{
+    // workers may be in the same code: they keep running it until they
+    // reach this guard too, Run only reads native between instructions
+    Chunk *chunk = c.frame->task->chunk;
+    __atomic_store_n(&chunk->native, (AotBody) nullptr, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->hotness, 0u, __ATOMIC_RELAXED);
+    u8 deopts = __atomic_load_n(&chunk->deopts, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->deopts, (u8)(deopts + 1), __ATOMIC_RELAXED);
+    c.task->resumeBudget = c.executed;
+    return SWITCH_LOOP;
+}
+
+#ifndef USE_JIT
+
+AotBody Jit::compile(Task *task)
+{
+    return nullptr;
+}
+
+#else
+
+//***************************************************************************************************************** */
+
+// C++ stencils: the opcodes without an inline form, written like the AOT
+// bodies write them. The code syncs c before the call and reloads after it.
+
+#define STENCIL(name) static u8 stencil_##name(AotContext &c, u32 first, u32 second, u32 next)
+#define STENCIL_END()          \
+    c.sp = sp;                 \
+    c.executed = executed;     \
+    return OK;
+
+STENCIL(binary)
+{
+    AOT_ENTER();
+    switch ((OpCode)first)
+    {
+    case OpCode::ADD:
+    case OpCode::ADD_NUM:
+        AOT_NUMBER_OP(ADD, next, true, NUMBER(x + y));
+        break;
+    case OpCode::SUBTRACT:
+    case OpCode::SUBTRACT_NUM:
+        AOT_NUMBER_OP(SUBTRACT, next, true, NUMBER(x - y));
+        break;
+    case OpCode::MULTIPLY:
+    case OpCode::MULTIPLY_NUM:
+        AOT_NUMBER_OP(MULTIPLY, next, true, NUMBER(x * y));
+        break;
+    case OpCode::DIVIDE:
+    case OpCode::DIVIDE_NUM:
+        AOT_NUMBER_OP(DIVIDE, next, y != 0, NUMBER(x / y));
+        break;
+    case OpCode::MOD:
+        AOT_NUMBER_OP(MOD, next, y != 0, NUMBER(AotMod(x, y)));
+        break;
+    case OpCode::POWER:
+        AOT_NUMBER_OP(POWER, next, true, NUMBER(pow(x, y)));
+        break;
+    case OpCode::EQUAL:
+        AOT_EQUAL();
+        break;
+    case OpCode::NOT_EQUAL:
+    case OpCode::NOT_EQUAL_NUM:
+        AOT_NUMBER_OP(NOT_EQUAL, next, true, BOOLEAN(x != y));
+        break;
+    case OpCode::LESS:
+    case OpCode::LESS_NUM:
+        AOT_NUMBER_OP(LESS, next, true, BOOLEAN(x < y));
+        break;
+    case OpCode::LESS_EQUAL:
+    case OpCode::LESS_EQUAL_NUM:
+        AOT_NUMBER_OP(LESS_EQUAL, next, true, BOOLEAN(x <= y));
+        break;
+    case OpCode::GREATER:
+    case OpCode::GREATER_NUM:
+        AOT_NUMBER_OP(GREATER, next, true, BOOLEAN(x > y));
+        break;
+    case OpCode::GREATER_EQUAL:
+    case OpCode::GREATER_EQUAL_NUM:
+        AOT_NUMBER_OP(GREATER_EQUAL, next, true, BOOLEAN(x >= y));
+        break;
+    default:
+        AOT_CALL(next, Aot::binary(c, (u8)first));
+        break;
+    }
+    STENCIL_END();
+}
+
+STENCIL(unary)
+{
+    AOT_ENTER();
+    switch ((OpCode)first)
+    {
+    case OpCode::NOW:
+        AOT_PUSH(NUMBER(time_now()));
+        break;
+    case OpCode::NOT:
+        sp[-1] = BOOLEAN(isFalsey(sp[-1]));
+        break;
+    case OpCode::NEGATE:
+        if (IS_NUMBER(sp[-1]))
+            sp[-1] = NUMBER(-AS_NUMBER(sp[-1]));
+        else
+            AOT_CALL(next, Aot::unary(c, OpCode::NEGATE));
+        break;
+    default: // EVAL_EQUAL
+    {
+        bool result = MatchValue(sp[-2], sp[-1]);
+        AOT_PUSH(BOOLEAN(result));
+        break;
+    }
+    }
+    STENCIL_END();
+}
+
+STENCIL(GLOBAL_GET)
+{
+    AOT_ENTER();
+    AOT_GLOBAL(next, first, value);
+    AOT_PUSH(value);
+    STENCIL_END();
+}
+
+STENCIL(ADD_GLOBAL)
+{
+    AOT_ENTER();
+    AOT_GLOBAL(next, first, value);
+    AOT_ADD_VALUE(next, value);
+    STENCIL_END();
+}
+
+STENCIL(LOCAL_SET)
+{
+    AOT_ENTER();
+    AOT_LOCAL_SET(first);
+    STENCIL_END();
+}
+
+STENCIL(LOCAL_STORE)
+{
+    AOT_ENTER();
+    AOT_LOCAL_STORE(first);
+    STENCIL_END();
+}
+
+STENCIL(ADD_LOCAL)
+{
+    AOT_ENTER();
+    AOT_ADD_VALUE(next, slots[first]);
+    STENCIL_END();
+}
+
+STENCIL(ADD_CONST)
+{
+    AOT_ENTER();
+    AOT_ADD_VALUE(next, k[first]);
+    STENCIL_END();
+}
+
+STENCIL(ADD_LOCAL_LOCAL)
+{
+    AOT_ENTER();
+    AOT_PUSH(slots[first]);
+    AOT_ADD_VALUE(next, slots[second]);
+    STENCIL_END();
+}
+
+STENCIL(LOCAL_INC_CONST)
+{
+    AOT_ENTER();
+    AOT_LOCAL_INC(next, first, k[second]);
+    STENCIL_END();
+}
+
+STENCIL(ENGINE_SET)
+{
+    AOT_ENTER();
+    if (first == IID)
+        AOT_CALL(next, Aot::engineError(c, IID));
+    AOT_ENGINE_SET(next, first, second);
+    STENCIL_END();
+}
+
+#undef STENCIL
+#undef STENCIL_END
+
+// called without syncing c, they can't fail
+static u32 falsey(const Value *value)
+{
+    return isFalsey(*value) ? 1 : 0;
+}
+
+static double engineGet(AotContext &c, u32 local)
+{
+    return AOT_ENGINE(local);
+}
+
+static void engineSet(AotContext &c, u32 local, double value)
+{
+    AOT_ENGINE(local) = value;
+}
+
+//***************************************************************************************************************** */
+
+enum Reg
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// condition codes of jcc/setcc, JMP is the unconditional jump
+enum Cond
+{
+    JMP = -1,
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xA,
+    CC_NP = 0xB,
+};
+
+// registers of the code: the context, the stack pointer, the frame's slots,
+// the constants and the instructions executed so far, all callee saved
+static const int C = RBX;
+static const int SP = R12;
+static const int SLOTS = R13;
+static const int K = R14;
+static const int EXECUTED = R15;
+
+#ifdef NAN_BOXING
+static const s32 VALUE = 8;
+static const s32 PAYLOAD = 0;
+#else
+static const s32 VALUE = (s32)sizeof(Value);
+static const s32 PAYLOAD = (s32)offsetof(Value, number);
+#endif
+
+// the machine code of one chunk while it's built, labels 0..count-1 are the
+// instructions of the chunk
+class Assembler
+{
+    struct Fixup
+    {
+        u32 at;
+        u32 label;
+    };
+    Vector<Fixup> fixups;
+
+public:
+    Vector<u8> code;
+    Vector<s32> labels;
+
+    u32 label()
+    {
+        labels.push_back(-1);
+        return (u32)labels.size() - 1;
+    }
+    void bind(u32 label) { labels[label] = (s32)code.size(); }
+    u32 here() const { return (u32)code.size(); }
+
+    void byte(u8 value) { code.push_back(value); }
+    void imm32(u32 value)
+    {
+        for (int i = 0; i < 4; i++)
+            byte((u8)(value >> (i * 8)));
+    }
+    void imm64(u64 value)
+    {
+        for (int i = 0; i < 8; i++)
+            byte((u8)(value >> (i * 8)));
+    }
+    void rel32(u32 label)
+    {
+        fixups.push_back({here(), label});
+        imm32(0);
+    }
+
+    // [prefix] [REX] opcode ModRM [SIB] disp32, reg is the register or the /digit
+    void mem(u8 prefix, bool wide, u32 opcode, int reg, int base, s32 disp)
+    {
+        if (prefix)
+            byte(prefix);
+        u8 rex = (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0);
+        if (rex)
+            byte(0x40 | rex);
+        if (opcode > 0xff)
+            byte((u8)(opcode >> 8));
+        byte((u8)opcode);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        imm32((u32)disp);
+    }
+    void regs(u8 prefix, bool wide, u32 opcode, int reg, int rm)
+    {
+        if (prefix)
+            byte(prefix);
+        u8 rex = (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+        if (rex)
+            byte(0x40 | rex);
+        if (opcode > 0xff)
+            byte((u8)(opcode >> 8));
+        byte((u8)opcode);
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void load(int reg, int base, s32 disp) { mem(0, true, 0x8B, reg, base, disp); }
+    void store(int base, s32 disp, int reg) { mem(0, true, 0x89, reg, base, disp); }
+    void load32(int reg, int base, s32 disp) { mem(0, false, 0x8B, reg, base, disp); }
+    void store32(int base, s32 disp, int reg) { mem(0, false, 0x89, reg, base, disp); }
+    void lea(int reg, int base, s32 disp) { mem(0, true, 0x8D, reg, base, disp); }
+    void move(int to, int from) { regs(0, true, 0x89, from, to); }
+    void moveImm(int reg, u64 value)
+    {
+        byte(0x48 | (reg >= 8 ? 1 : 0));
+        byte(0xB8 + (reg & 7));
+        imm64(value);
+    }
+    void moveImm32(int reg, u32 value)
+    {
+        if (reg >= 8)
+            byte(0x41);
+        byte(0xB8 + (reg & 7));
+        imm32(value);
+    }
+    void addImm(int reg, int value, bool wide = true)
+    {
+        regs(0, wide, 0x83, 0, reg);
+        byte((u8)value);
+    }
+    void subImm(int reg, int value)
+    {
+        regs(0, true, 0x83, 5, reg);
+        byte((u8)value);
+    }
+    void call(const void *function)
+    {
+        moveImm(RAX, (u64)(uintptr_t)function);
+        byte(0xFF);
+        byte(0xD0);
+    }
+    void setcc(int cond, int reg) { regs(0, false, 0x0F90 | cond, 0, reg); }
+    void jump(int cond, u32 label)
+    {
+        if (cond == JMP)
+        {
+            byte(0xE9);
+        }
+        else
+        {
+            byte(0x0F);
+            byte(0x80 | cond);
+        }
+        rel32(label);
+    }
+
+    bool link()
+    {
+        for (u32 i = 0; i < fixups.size(); i++)
+        {
+            s32 target = labels[fixups[i].label];
+            if (target < 0)
+                return false;
+            u32 rel = (u32)(target - (s32)(fixups[i].at + 4));
+            for (int b = 0; b < 4; b++)
+                code[fixups[i].at + b] = (u8)(rel >> (b * 8));
+        }
+        return true;
+    }
+};
+
+// a yield or a deopt, out of line after the code of the instructions
+struct Stub
+{
+    u32 label;
+    u32 ip;
+    bool deopt;
+};
+
+class Builder
+{
+public:
+    Assembler a;
+    const u8 *code;
+    u32 count;
+    u32 epilogue;
+    u32 aborted;
+    Vector<Stub> stubs;
+    Vector<u32> deopts; // label of the deopt stub of an instruction, 0 for none yet
+    const Value *nil;
+
+    Builder(const Chunk *chunk) : code(chunk->code), count(chunk->count)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            a.label();
+            deopts.push_back(0);
+        }
+        epilogue = a.label();
+        aborted = a.label();
+    }
+
+    u32 stub(u32 ip, bool deopt)
+    {
+        u32 label = a.label();
+        stubs.push_back({label, ip, deopt});
+        return label;
+    }
+    u32 deoptAt(u32 at)
+    {
+        if (!deopts[at])
+            deopts[at] = stub(at, true);
+        return deopts[at];
+    }
+
+    // c.sp, c.executed and ip at the given instruction, as AOT_SAVE
+    void sync(u32 ip)
+    {
+        a.store(C, offsetof(AotContext, sp), SP);
+        a.store32(C, offsetof(AotContext, executed), EXECUTED);
+        a.load(RAX, C, offsetof(AotContext, code));
+        a.lea(RAX, RAX, (s32)ip);
+        a.load(RCX, C, offsetof(AotContext, frame));
+        a.store(RCX, offsetof(Frame, ip), RAX);
+    }
+    void reload()
+    {
+        a.load(SP, C, offsetof(AotContext, sp));
+        a.load(RAX, C, offsetof(AotContext, frame));
+        a.load(SLOTS, RAX, offsetof(Frame, slots));
+        a.load32(EXECUTED, C, offsetof(AotContext, executed));
+    }
+    void prepare(const void *function, u32 first, u32 second, u32 next)
+    {
+        sync(next);
+        a.move(RDI, C);
+        a.moveImm32(RSI, first);
+        a.moveImm32(RDX, second);
+        a.moveImm32(RCX, next);
+        a.call(function);
+    }
+    // AOT_CALL: anything but OK leaves the code with that status
+    void helper(const void *function, u32 first, u32 second, u32 next)
+    {
+        prepare(function, first, second, next);
+        a.byte(0x3C); // cmp al, OK
+        a.byte(OK);
+        a.jump(CC_NE, epilogue);
+        reload();
+    }
+    // AOT_LEAVE
+    void leave(const void *function, u32 first, u32 second, u32 next)
+    {
+        prepare(function, first, second, next);
+        a.jump(JMP, epilogue);
+    }
+    // AOT_NEXT
+    void budget(u32 n, u32 ip)
+    {
+        a.addImm(EXECUTED, (int)n, false);
+        a.regs(0, false, 0x83, 7, EXECUTED);
+        a.byte((u8)instructionsPerFrame);
+        a.jump(CC_AE, stub(ip, false));
+    }
+    // AOT_GOTO
+    void jumpTo(u32 n, u32 target)
+    {
+        budget(n, target);
+        a.jump(JMP, target);
+    }
+
+    // values on the stack, in the slots or the constants
+
+    void guardNumber(int base, s32 disp, u32 fail)
+    {
+#ifdef NAN_BOXING
+        a.load(RAX, base, disp);
+        a.moveImm(RCX, QNAN);
+        a.regs(0, true, 0x21, RCX, RAX); // and rax, rcx
+        a.regs(0, true, 0x39, RCX, RAX); // cmp rax, rcx
+        a.jump(CC_E, fail);
+#else
+        a.mem(0, false, 0x83, 7, base, disp); // cmp dword [type], VNUMBER
+        a.byte((u8)ValueType::VNUMBER);
+        a.jump(CC_NE, fail);
+#endif
+    }
+    void guardBoolean(int base, s32 disp, u32 fail)
+    {
+#ifdef NAN_BOXING
+        a.load(RAX, base, disp);
+        a.regs(0, true, 0x83, 1, RAX); // or rax, 1
+        a.byte(1);
+        a.moveImm(RCX, TRUE_VAL);
+        a.regs(0, true, 0x39, RCX, RAX);
+        a.jump(CC_NE, fail);
+#else
+        a.mem(0, false, 0x83, 7, base, disp);
+        a.byte((u8)ValueType::VBOOLEAN);
+        a.jump(CC_NE, fail);
+#endif
+    }
+    // ZF set for false, the value is a boolean
+    void testBoolean(int base, s32 disp)
+    {
+#ifdef NAN_BOXING
+        a.load(RAX, base, disp);
+        a.moveImm(RCX, FALSE_VAL);
+        a.regs(0, true, 0x39, RCX, RAX);
+#else
+        a.mem(0, false, 0x80, 7, base, disp + PAYLOAD); // cmp byte [boolean], 0
+        a.byte(0);
+#endif
+    }
+    void loadNumber(int xmm, int base, s32 disp) { a.mem(0xF2, false, 0x0F10, xmm, base, disp + PAYLOAD); }
+    void storeNumber(int base, s32 disp, int xmm, bool tagged = false)
+    {
+#ifndef NAN_BOXING
+        if (!tagged)
+        {
+            a.mem(0, false, 0xC7, 0, base, disp);
+            a.imm32((u32)ValueType::VNUMBER);
+        }
+#endif
+        a.mem(0xF2, false, 0x0F11, xmm, base, disp + PAYLOAD);
+    }
+    // al is 0 or 1
+    void storeBoolean(int base, s32 disp)
+    {
+        a.regs(0, false, 0x0FB6, RAX, RAX); // movzx eax, al
+#ifdef NAN_BOXING
+        a.moveImm(RCX, FALSE_VAL);
+        a.regs(0, true, 0x01, RCX, RAX); // TRUE_VAL is FALSE_VAL + 1
+        a.store(base, disp, RAX);
+#else
+        a.mem(0, false, 0xC7, 0, base, disp);
+        a.imm32((u32)ValueType::VBOOLEAN);
+        a.store(base, disp + PAYLOAD, RAX);
+#endif
+    }
+    void pushBoolean(bool value)
+    {
+#ifdef NAN_BOXING
+        a.moveImm(RAX, value ? TRUE_VAL : FALSE_VAL);
+        a.store(SP, 0, RAX);
+#else
+        a.mem(0, false, 0xC7, 0, SP, 0);
+        a.imm32((u32)ValueType::VBOOLEAN);
+        a.mem(0, true, 0xC7, 0, SP, PAYLOAD);
+        a.imm32(value ? 1 : 0);
+#endif
+        a.addImm(SP, VALUE);
+    }
+    void copy(int toBase, s32 toDisp, int fromBase, s32 fromDisp)
+    {
+#ifdef NAN_BOXING
+        a.load(RAX, fromBase, fromDisp);
+        a.store(toBase, toDisp, RAX);
+#else
+        a.mem(0, false, 0x0F10, 0, fromBase, fromDisp); // movups xmm0
+        a.mem(0, false, 0x0F11, 0, toBase, toDisp);
+#endif
+    }
+    void push(int base, s32 disp)
+    {
+        copy(SP, 0, base, disp);
+        a.addImm(SP, VALUE);
+    }
+
+    // jumps to target when the value is falsey
+    void branchFalsey(int base, s32 disp, u32 target)
+    {
+        u32 other = a.label();
+        u32 done = a.label();
+        guardBoolean(base, disp, other);
+        testBoolean(base, disp);
+        a.jump(CC_E, target);
+        a.jump(JMP, done);
+        a.bind(other);
+        a.lea(RDI, base, disp);
+        a.call((const void *)falsey);
+        a.byte(0x84); // test al, al
+        a.byte(0xC0);
+        a.jump(CC_NE, target);
+        a.bind(done);
+    }
+
+    // ucomisd for a compare of xmm0 (left) and xmm1 (right), returns the
+    // condition that holds when it's true, false on NaN as in C
+    int compare(u8 op)
+    {
+        switch (op)
+        {
+        case OpCode::LESS:
+        case OpCode::LESS_NUM:
+            a.regs(0x66, false, 0x0F2E, 1, 0);
+            return CC_A;
+        case OpCode::LESS_EQUAL:
+        case OpCode::LESS_EQUAL_NUM:
+            a.regs(0x66, false, 0x0F2E, 1, 0);
+            return CC_AE;
+        case OpCode::GREATER:
+        case OpCode::GREATER_NUM:
+            a.regs(0x66, false, 0x0F2E, 0, 1);
+            return CC_A;
+        default: // GREATER_EQUAL
+            a.regs(0x66, false, 0x0F2E, 0, 1);
+            return CC_AE;
+        }
+    }
+
+    void loadOperands(u32 fail)
+    {
+        guardNumber(SP, -2 * VALUE, fail);
+        guardNumber(SP, -VALUE, fail);
+        loadNumber(0, SP, -2 * VALUE);
+        loadNumber(1, SP, -VALUE);
+    }
+
+    bool instruction(u32 at);
+    void finish();
+};
+
+static u32 readShort(const u8 *at)
+{
+    return (u32)((at[1] << 8) | at[2]);
+}
+
+static bool isQuickened(u8 op)
+{
+    return op >= OpCode::ADD_NUM && op <= OpCode::GREATER_EQUAL_NUM;
+}
+
+// the stencil of one instruction, false for an opcode without one
+bool Builder::instruction(u32 at)
+{
+    const u8 *ins = code + at;
+    u8 op = ins[0];
+    u32 next = at + InstructionSize(op);
+    u32 target = 0;
+    if (InstructionSize(op) == 3)
+    {
+        target = op == OpCode::JUMP_BACK ? next - readShort(ins) : next + readShort(ins);
+    }
+    u32 countAs = 1; // instructions it stands for, as NEXT_FUSED counts
+    bool falls = true;
+
+    switch ((OpCode)op)
+    {
+    case OpCode::CONST:
+    case OpCode::PUSH:
+        push(K, ins[1] * VALUE);
+        break;
+    case OpCode::LOCAL_GET:
+        push(SLOTS, ins[1] * VALUE);
+        break;
+    case OpCode::POP:
+        a.subImm(SP, VALUE);
+        break;
+    case OpCode::DUP:
+        push(SP, -VALUE);
+        break;
+    case OpCode::TRUE:
+    case OpCode::FALSE:
+        pushBoolean(op == OpCode::TRUE);
+        break;
+    case OpCode::NIL:
+        a.moveImm(RDX, (u64)(uintptr_t)nil);
+        push(RDX, 0);
+        break;
+
+    case OpCode::LOCAL_STORE:
+        countAs = 2;
+        // fall through
+    case OpCode::LOCAL_SET:
+    {
+        // the write barrier only has work while the GC marks
+        u32 slow = a.label();
+        u32 done = a.label();
+        a.moveImm(RAX, (u64)(uintptr_t)&Arena::marking);
+        a.mem(0, false, 0x80, 7, RAX, 0);
+        a.byte(0);
+        a.jump(CC_NE, slow);
+        copy(SLOTS, ins[1] * VALUE, SP, -VALUE);
+        if (op == OpCode::LOCAL_STORE)
+            a.subImm(SP, VALUE);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper(op == OpCode::LOCAL_STORE ? (const void *)stencil_LOCAL_STORE : (const void *)stencil_LOCAL_SET, ins[1], 0, next);
+        a.bind(done);
+        break;
+    }
+
+    case OpCode::ADD:
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::ADD_NUM:
+    case OpCode::SUBTRACT_NUM:
+    case OpCode::MULTIPLY_NUM:
+    case OpCode::DIVIDE_NUM:
+    {
+        // a _NUM opcode saw only numbers so far, anything else deoptimizes
+        u32 slow = isQuickened(op) ? deoptAt(at) : a.label();
+        u32 done = a.label();
+        loadOperands(slow);
+        u32 math;
+        switch ((OpCode)op)
+        {
+        case OpCode::ADD:
+        case OpCode::ADD_NUM:
+            math = 0x0F58;
+            break;
+        case OpCode::SUBTRACT:
+        case OpCode::SUBTRACT_NUM:
+            math = 0x0F5C;
+            break;
+        case OpCode::MULTIPLY:
+        case OpCode::MULTIPLY_NUM:
+            math = 0x0F59;
+            break;
+        default:
+        {
+            math = 0x0F5E;
+            u32 nonzero = a.label();
+            a.regs(0x66, false, 0x0F57, 2, 2); // xorpd xmm2, xmm2
+            a.regs(0x66, false, 0x0F2E, 1, 2); // ucomisd xmm1, xmm2
+            a.jump(CC_P, nonzero);
+            a.jump(CC_E, slow);
+            a.bind(nonzero);
+            break;
+        }
+        }
+        a.regs(0xF2, false, math, 0, 1);
+        a.subImm(SP, VALUE);
+        storeNumber(SP, -VALUE, 0, true);
+        if (!isQuickened(op))
+        {
+            a.jump(JMP, done);
+            a.bind(slow);
+            helper((const void *)stencil_binary, op, 0, next);
+        }
+        a.bind(done);
+        break;
+    }
+
+    case OpCode::NOT_EQUAL:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::EQUAL_NUM:
+    case OpCode::NOT_EQUAL_NUM:
+    case OpCode::LESS_NUM:
+    case OpCode::LESS_EQUAL_NUM:
+    case OpCode::GREATER_NUM:
+    case OpCode::GREATER_EQUAL_NUM:
+    {
+        u32 slow = isQuickened(op) ? deoptAt(at) : a.label();
+        u32 done = a.label();
+        loadOperands(slow);
+        if (op == OpCode::EQUAL_NUM)
+        {
+            // MatchNumber: |x - y| < NUMBER_TOLERANCE, false on NaN
+            u64 tolerance;
+            memcpy(&tolerance, &NUMBER_TOLERANCE, sizeof(tolerance));
+            a.regs(0xF2, false, 0x0F5C, 0, 1); // subsd xmm0, xmm1
+            a.regs(0x66, true, 0x0F7E, 0, RAX); // movq rax, xmm0
+            a.moveImm(RCX, 0x7FFFFFFFFFFFFFFFull);
+            a.regs(0, true, 0x21, RCX, RAX); // and rax, rcx
+            a.regs(0x66, true, 0x0F6E, 0, RAX); // movq xmm0, rax
+            a.moveImm(RCX, tolerance);
+            a.regs(0x66, true, 0x0F6E, 1, RCX); // movq xmm1, rcx
+            a.regs(0x66, false, 0x0F2E, 1, 0); // ucomisd xmm1, xmm0
+            a.setcc(CC_A, RAX);
+        }
+        else if (op == OpCode::NOT_EQUAL_NUM || op == OpCode::NOT_EQUAL)
+        {
+            a.regs(0x66, false, 0x0F2E, 0, 1);
+            a.setcc(CC_NE, RAX);
+            a.setcc(CC_P, RCX);
+            a.regs(0, false, 0x08, RCX, RAX); // or al, cl
+        }
+        else
+        {
+            a.setcc(compare(op), RAX);
+        }
+        a.subImm(SP, VALUE);
+        storeBoolean(SP, -VALUE);
+        if (!isQuickened(op))
+        {
+            a.jump(JMP, done);
+            a.bind(slow);
+            helper((const void *)stencil_binary, op, 0, next);
+        }
+        a.bind(done);
+        break;
+    }
+
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+    {
+        u8 compareOp = op == OpCode::JUMP_IF_NOT_LESS         ? OpCode::LESS
+                       : op == OpCode::JUMP_IF_NOT_LESS_EQUAL ? OpCode::LESS_EQUAL
+                       : op == OpCode::JUMP_IF_NOT_GREATER    ? OpCode::GREATER
+                                                              : OpCode::GREATER_EQUAL;
+        u32 slow = a.label();
+        u32 taken = a.label();
+        u32 fall = a.label();
+        loadOperands(slow);
+        a.subImm(SP, 2 * VALUE);
+        int cond = compare(compareOp);
+        a.jump(cond ^ 1, taken);
+        a.jump(JMP, fall);
+        // the generic compare always pushes a boolean
+        a.bind(slow);
+        helper((const void *)stencil_binary, compareOp, 0, next);
+        a.subImm(SP, VALUE);
+        testBoolean(SP, 0);
+        a.jump(CC_E, taken);
+        a.jump(JMP, fall);
+        a.bind(taken);
+        jumpTo(3, target);
+        a.bind(fall);
+        countAs = 3;
+        break;
+    }
+
+    case OpCode::ADD_LOCAL:
+    case OpCode::ADD_CONST:
+    {
+        u32 slow = a.label();
+        u32 done = a.label();
+        int base = op == OpCode::ADD_LOCAL ? SLOTS : K;
+        guardNumber(SP, -VALUE, slow);
+        guardNumber(base, ins[1] * VALUE, slow);
+        loadNumber(0, SP, -VALUE);
+        a.mem(0xF2, false, 0x0F58, 0, base, ins[1] * VALUE + PAYLOAD);
+        storeNumber(SP, -VALUE, 0, true);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper(op == OpCode::ADD_LOCAL ? (const void *)stencil_ADD_LOCAL : (const void *)stencil_ADD_CONST, ins[1], 0, next);
+        a.bind(done);
+        countAs = 2;
+        break;
+    }
+    case OpCode::ADD_LOCAL_LOCAL:
+    {
+        u32 slow = a.label();
+        u32 done = a.label();
+        guardNumber(SLOTS, ins[1] * VALUE, slow);
+        guardNumber(SLOTS, ins[2] * VALUE, slow);
+        loadNumber(0, SLOTS, ins[1] * VALUE);
+        a.mem(0xF2, false, 0x0F58, 0, SLOTS, ins[2] * VALUE + PAYLOAD);
+        storeNumber(SP, 0, 0);
+        a.addImm(SP, VALUE);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper((const void *)stencil_ADD_LOCAL_LOCAL, ins[1], ins[2], next);
+        a.bind(done);
+        countAs = 3;
+        break;
+    }
+    case OpCode::LOCAL_INC_CONST:
+    {
+        u32 slow = a.label();
+        u32 done = a.label();
+        guardNumber(SLOTS, ins[1] * VALUE, slow);
+        guardNumber(K, ins[2] * VALUE, slow);
+        loadNumber(0, SLOTS, ins[1] * VALUE);
+        a.mem(0xF2, false, 0x0F58, 0, K, ins[2] * VALUE + PAYLOAD);
+        storeNumber(SLOTS, ins[1] * VALUE, 0, true);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper((const void *)stencil_LOCAL_INC_CONST, ins[1], ins[2], next);
+        a.bind(done);
+        countAs = 5;
+        break;
+    }
+
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_BACK:
+        jumpTo(1, target);
+        falls = false;
+        break;
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::POP_JUMP_IF_FALSE:
+    {
+        u32 taken = a.label();
+        countAs = op == OpCode::POP_JUMP_IF_FALSE ? 2 : 1;
+        if (op == OpCode::POP_JUMP_IF_FALSE)
+        {
+            a.subImm(SP, VALUE);
+            branchFalsey(SP, 0, taken);
+        }
+        else
+        {
+            branchFalsey(SP, -VALUE, taken);
+        }
+        budget(countAs, next);
+        a.jump(JMP, next);
+        a.bind(taken);
+        jumpTo(countAs, target);
+        falls = false;
+        break;
+    }
+
+    case OpCode::MOD:
+    case OpCode::POWER:
+    case OpCode::EQUAL:
+    case OpCode::XOR:
+        helper((const void *)stencil_binary, op, 0, next);
+        break;
+    case OpCode::NOW:
+    case OpCode::NOT:
+    case OpCode::NEGATE:
+    case OpCode::EVAL_EQUAL:
+        helper((const void *)stencil_unary, op, 0, next);
+        break;
+
+    case OpCode::HALT:
+    case OpCode::PROGRAM:
+    case OpCode::PRINT:
+    case OpCode::CLONE:
+        helper((const void *)Aot::simple, op, op == OpCode::PROGRAM ? ins[1] : 0, next);
+        break;
+
+    case OpCode::GLOBAL_STORE:
+        countAs = 2;
+        // fall through
+    case OpCode::GLOBAL_DEFINE:
+    case OpCode::GLOBAL_ASSIGN:
+        helper((const void *)Aot::global, op, readShort(ins), next);
+        break;
+    case OpCode::GLOBAL_GET:
+    {
+        // an undefined global is an error and a read on a worker thread
+        // waits for the serial phase, the stencil does both
+        u32 slow = a.label();
+        u32 done = a.label();
+        s32 disp = (s32)readShort(ins) * VALUE;
+        a.mem(0, false, 0x80, 7, C, offsetof(AotContext, parallel)); // cmp byte [parallel], 0
+        a.byte(0);
+        a.jump(CC_NE, slow);
+        a.load(RDX, C, offsetof(AotContext, globals));
+#ifdef NAN_BOXING
+        a.load(RAX, RDX, disp);
+        a.moveImm(RCX, UNDEFINED_VAL);
+        a.regs(0, true, 0x39, RCX, RAX);
+#else
+        a.mem(0, false, 0x83, 7, RDX, disp);
+        a.byte((u8)ValueType::VUNDEFINED);
+#endif
+        a.jump(CC_E, slow);
+        push(RDX, disp);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper((const void *)stencil_GLOBAL_GET, readShort(ins), 0, next);
+        a.bind(done);
+        break;
+    }
+    case OpCode::ADD_GLOBAL:
+        helper((const void *)stencil_ADD_GLOBAL, readShort(ins), 0, next);
+        countAs = 2;
+        break;
+
+    case OpCode::ENGINE_GET:
+        a.move(RDI, C);
+        a.moveImm32(RSI, ins[1]);
+        a.call((const void *)engineGet);
+        storeNumber(SP, 0, 0);
+        a.addImm(SP, VALUE);
+        break;
+    case OpCode::ENGINE_STORE:
+        countAs = 2;
+        // fall through
+    case OpCode::ENGINE_SET:
+    {
+        // ID and anything but a number are errors, the stencil reports them
+        u32 slow = a.label();
+        u32 done = a.label();
+        if (ins[1] == IID)
+            a.jump(JMP, slow);
+        guardNumber(SP, -VALUE, slow);
+        loadNumber(0, SP, -VALUE);
+        a.move(RDI, C);
+        a.moveImm32(RSI, ins[1]);
+        a.call((const void *)engineSet);
+        if (op == OpCode::ENGINE_STORE)
+            a.subImm(SP, VALUE);
+        a.jump(JMP, done);
+        a.bind(slow);
+        helper((const void *)stencil_ENGINE_SET, ins[1], countAs == 2 ? 1 : 0, next);
+        a.bind(done);
+        break;
+    }
+
+    case OpCode::FRAME:
+        helper((const void *)Aot::frame, 0, 0, next);
+        break;
+    case OpCode::CALL:
+        helper((const void *)Aot::callNative, readShort(ins), ins[3], next);
+        break;
+    case OpCode::CALL_SCRIPT:
+        // the call and the return count themselves
+        helper((const void *)Aot::callScript, readShort(ins), ins[3], next);
+        falls = false;
+        break;
+    case OpCode::CALL_PROCESS:
+        leave((const void *)Aot::callProcess, readShort(ins), ins[3], next);
+        falls = false;
+        break;
+    case OpCode::RETURN:
+        leave((const void *)Aot::ret, 0, 0, next);
+        falls = false;
+        break;
+    case OpCode::RETURN_PROCESS:
+        leave((const void *)Aot::returnProcess, 0, 0, next);
+        falls = false;
+        break;
+
+    default:
+        return false;
+    }
+    if (falls)
+        budget(countAs, next);
+    return true;
+}
+
+// the shared tail: epilogue, stubs and the table Aot::run resumes through
+void Builder::finish()
+{
+    a.bind(epilogue);
+    a.byte(0x41); // pop r15, r14, r13, r12, rbx
+    a.byte(0x5F);
+    a.byte(0x41);
+    a.byte(0x5E);
+    a.byte(0x41);
+    a.byte(0x5D);
+    a.byte(0x41);
+    a.byte(0x5C);
+    a.byte(0x5B);
+    a.byte(0xC3); // ret
+
+    a.bind(aborted);
+    a.moveImm32(RAX, ABORTED);
+    a.jump(JMP, epilogue);
+
+    for (u32 i = 0; i < stubs.size(); i++)
+    {
+        const Stub &stub = stubs[i];
+        a.bind(stub.label);
+        sync(stub.ip);
+        if (stub.deopt)
+        {
+            a.move(RDI, C);
+            a.call((const void *)&Jit::deopt);
+        }
+        else
+        {
+            a.moveImm32(RAX, AOT_YIELD);
+        }
+        a.jump(JMP, epilogue);
+    }
+}
+
+AotBody Jit::compile(Task *task)
+{
+    const Chunk *chunk = task->chunk;
+    Builder b(chunk);
+    b.nil = &VirtualMachine::DEFAULT;
+    Assembler &a = b.a;
+    u32 table = a.label();
+
+    // push rbx, r12, r13, r14, r15: the stack is 16 byte aligned for calls
+    a.byte(0x53);
+    a.byte(0x41);
+    a.byte(0x54);
+    a.byte(0x41);
+    a.byte(0x55);
+    a.byte(0x41);
+    a.byte(0x56);
+    a.byte(0x41);
+    a.byte(0x57);
+    a.move(C, RDI);
+    a.load(K, C, offsetof(AotContext, constants));
+    b.reload();
+
+    // jump to the instruction at ip
+    a.load(RAX, C, offsetof(AotContext, frame));
+    a.load(RAX, RAX, offsetof(Frame, ip));
+    a.mem(0, true, 0x2B, RAX, C, offsetof(AotContext, code)); // sub rax, [code]
+    a.byte(0x48); // cmp rax, count
+    a.byte(0x3D);
+    a.imm32(chunk->count);
+    a.jump(CC_AE, b.aborted);
+    a.byte(0x48); // lea rcx, [table]
+    a.byte(0x8D);
+    a.byte(0x0D);
+    a.rel32(table);
+    a.byte(0x48); // movsxd rax, [rcx + rax * 4]
+    a.byte(0x63);
+    a.byte(0x04);
+    a.byte(0x81);
+    a.byte(0x48); // add rax, rcx
+    a.byte(0x01);
+    a.byte(0xC8);
+    a.byte(0xFF); // jmp rax
+    a.byte(0xE0);
+
+    for (u32 offset = 0; offset < chunk->count;)
+    {
+        u32 size = InstructionSize(chunk->code[offset]);
+        a.bind(offset);
+        if (size == 0 || !b.instruction(offset))
+            return nullptr;
+        offset += size;
+    }
+    a.jump(JMP, b.aborted);
+    b.finish();
+
+    while (a.here() % 4)
+        a.byte(0xCC);
+    a.bind(table);
+    for (u32 offset = 0; offset < chunk->count; offset++)
+    {
+        s32 at = a.labels[offset] >= 0 ? a.labels[offset] : a.labels[b.aborted];
+        a.imm32((u32)(at - a.labels[table]));
+    }
+    if (!a.link())
+        return nullptr;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = (a.code.size() + page - 1) / page * page;
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+    memcpy(memory, a.code.pointer(), a.code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+    blocks.push_back({memory, size});
+    compiled++;
+    return (AotBody)memory;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#include "pch.h"
+#include "Jobs.hpp"
+
+// indices a worker takes from its own slice at a time
+#define JOB_BATCH 16
+
+JobPool::JobPool()
+{
+    threads = nullptr;
+    ranges = nullptr;
+    count = 0;
+    generation = 0;
+    pending = 0;
+    quit = false;
+    function = nullptr;
+    user = nullptr;
+}
+
+JobPool::~JobPool()
+{
+    stop();
+}
+
+void JobPool::start(u32 count)
+{
+    stop();
+    if (count <= 1)
+        return;
+
+    this->count = count;
+    quit = false;
+    ranges = new Range[count];
+    for (u32 i = 0; i < count; i++)
+    {
+        ranges[i].begin = 0;
+        ranges[i].end = 0;
+    }
+    threads = new std::thread[count - 1];
+    for (u32 i = 1; i < count; i++)
+    {
+        threads[i - 1] = std::thread(&JobPool::loop, this, i);
+    }
+}
+
+void JobPool::stop()
+{
+    if (!threads)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (u32 i = 1; i < count; i++)
+    {
+        threads[i - 1].join();
+    }
+    delete[] threads;
+    delete[] ranges;
+    threads = nullptr;
+    ranges = nullptr;
+    count = 0;
+}
+
+bool JobPool::take(u32 worker, u32 &begin, u32 &end)
+{
+    Range &range = ranges[worker];
+    std::lock_guard<std::mutex> guard(range.lock);
+    if (range.begin >= range.end)
+        return false;
+    begin = range.begin;
+    end = range.begin + JOB_BATCH < range.end ? range.begin + JOB_BATCH : range.end;
+    range.begin = end;
+    return true;
+}
+
+bool JobPool::steal(u32 worker)
+{
+    while (true)
+    {
+        // the slice with the most indices left; another thief may empty it
+        // before the lock below, then look again
+        u32 busiest = worker;
+        u32 most = 0;
+        for (u32 i = 1; i < count; i++)
+        {
+            u32 other = (worker + i) % count;
+            std::lock_guard<std::mutex> guard(ranges[other].lock);
+            if (ranges[other].end > ranges[other].begin && ranges[other].end - ranges[other].begin > most)
+            {
+                most = ranges[other].end - ranges[other].begin;
+                busiest = other;
+            }
+        }
+        if (most == 0)
+            return false;
+
+        Range &victim = ranges[busiest];
+        u32 begin, end;
+        {
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (victim.begin >= victim.end)
+                continue;
+            begin = victim.begin + (victim.end - victim.begin) / 2;
+            end = victim.end;
+            victim.end = begin;
+        }
+        Range &range = ranges[worker];
+        std::lock_guard<std::mutex> guard(range.lock);
+        range.begin = begin;
+        range.end = end;
+        return true;
+    }
+}
+
+void JobPool::work(u32 worker)
+{
+    u32 begin, end;
+    while (true)
+    {
+        if (!take(worker, begin, end))
+        {
+            if (!steal(worker))
+                return;
+            continue;
+        }
+        for (u32 i = begin; i < end; i++)
+        {
+            function(user, i);
+        }
+    }
+}
+
+void JobPool::loop(u32 worker)
+{
+    u64 seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&]
+                      { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+        }
+
+        work(worker);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--pending == 0)
+            done.notify_one();
+    }
+}
+
+void JobPool::run(u32 jobs, JobFunction function, void *user)
+{
+    if (count <= 1)
+    {
+        for (u32 i = 0; i < jobs; i++)
+        {
+            function(user, i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (u32 i = 0; i < count; i++)
+        {
+            std::lock_guard<std::mutex> rangeGuard(ranges[i].lock);
+            ranges[i].begin = (u32)((u64)jobs * i / count);
+            ranges[i].end = (u32)((u64)jobs * (i + 1) / count);
+        }
+        this->function = function;
+        this->user = user;
+        pending = count - 1;
+        generation++;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&]
+              { return pending == 0; });
+}
@@ -434,16 +434,14 @@ void Lexer::identifier()
 
   // std::cout<<" ,"<<peek()<<" ";
 
-  String text = input.substr(start, current - start);
-
-
   TokenType type;
-  if (keywords.find(text.c_str(), type))
+  if (keywords.find(input.c_str() + start, current - start, type))
   {
      addToken(type);
   }
   else
   {
+    String text = input.substr(start, current - start);
     addToken(TokenType::IDENTIFIER, text);
   }
 }
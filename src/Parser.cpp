@@ -8,9 +8,36 @@ void Parser::setTask(Task *currentTask)
 {
     
     this->currentTask = currentTask;
+    if (!currentTask->compiler)
+        currentTask->compiler = new Compiler();
+    compiler = currentTask->compiler;
     vm->setCurrentTask(currentTask);
 }
 
+void Parser::releaseCompilers()
+{
+    for (size_t i = 0; i < vm->functions.size(); i++)
+    {
+        if (vm->functions[i])
+        {
+            delete vm->functions[i]->compiler;
+            vm->functions[i]->compiler = nullptr;
+        }
+    }
+    for (size_t i = 0; i < vm->processes.size(); i++)
+    {
+        if (vm->processes[i])
+        {
+            delete vm->processes[i]->compiler;
+            vm->processes[i]->compiler = nullptr;
+        }
+    }
+    Task *main = vm->getMainTask();
+    delete main->compiler;
+    main->compiler = nullptr;
+    compiler = nullptr;
+}
+
 Parser::Parser()
 {
     current = 0;
@@ -19,6 +46,7 @@ Parser::Parser()
     countEnds = 0;
     hasReturned = false;
     vm=nullptr;
+    compiler=nullptr;
     lexer.initialize();
     
 }
@@ -49,6 +77,7 @@ void Parser::Clear()
     lexer.clear();
     functions.clear();
     process.clear();
+    calls.clear();
     current = 0;
     panicMode = false;
     countBegins = 0;
@@ -274,6 +303,73 @@ void Parser::emitBytes(u8 byte1, u8 byte2)
     emitByte(byte2);
 }
 
+void Parser::emitShort(u8 instruction, u16 value)
+{
+    emitByte(instruction);
+    emitByte((value >> 8) & 0xff);
+    emitByte(value & 0xff);
+}
+
+u32 Parser::globalSlot(const String &name)
+{
+    u32 slot = vm->globalSlot(name.c_str());
+    if (slot > UINT16_MAX)
+    {
+        Error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
+u16 Parser::functionIndex(const String &name)
+{
+    u16 index;
+    if (functions.find(name.c_str(), index))
+    {
+        return index;
+    }
+    index = (u16)vm->functions.size();
+    vm->functions.push_back(nullptr);
+    functions.insert(name.c_str(), index);
+    return index;
+}
+
+u16 Parser::processIndex(const String &name)
+{
+    u16 index;
+    if (process.find(name.c_str(), index))
+    {
+        return index;
+    }
+    index = (u16)vm->processes.size();
+    vm->processes.push_back(nullptr);
+    process.insert(name.c_str(), index);
+    return index;
+}
+
+void Parser::checkCalls()
+{
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        const CallSite &call = calls[i];
+        Task *task = call.isProcess ? vm->processes[call.index] : (Task *)vm->functions[call.index];
+        const char *kind = call.isProcess ? "Process" : "Function";
+        if (!task)
+        {
+            vm->Error("%s '%s' not defined [line %d]", kind, call.name.c_str(), call.line);
+            panicMode = true;
+            return;
+        }
+        if (task->argsCount != call.argCount)
+        {
+            vm->Error("%s %s, Expected %d arguments but got %d [line %d]", kind, call.name.c_str(), task->argsCount, call.argCount, call.line);
+            panicMode = true;
+            return;
+        }
+    }
+    calls.clear();
+}
+
 void Parser::emitReturn()
 {
     emitByte(OpCode::RETURN);
@@ -359,7 +455,7 @@ void Parser::number()
 void Parser::string()
 {
     String text = previous().literal;
-    emitConstant(STRING(text));
+    emitConstant(INTERNED(text));
 }
 
 
@@ -371,8 +467,12 @@ bool Parser::Process()
         vm->Error("No current task");
         return false;
     }
+    setTask(currentTask);
   //  Print();
     program();
+    if (!panicMode)
+        checkCalls();
+    releaseCompilers();
     return !panicMode;
 }
 
@@ -384,7 +484,7 @@ void Parser::program()
     String nameStr = name.literal;
     consume(TokenType::SEMICOLON,"Expect ';' after program name.");
 
-    u8 index = makeConstant(std::move(STRING(nameStr.c_str())));
+    u8 index = makeConstant(std::move(INTERNED(nameStr)));
     emitBytes(OpCode::PROGRAM, index);
     
     while (!isAtEnd())
@@ -682,8 +782,15 @@ void Parser::functionDeclaration()
         return;
     }
 
+    u16 index = functionIndex(name.lexeme);
+    if (vm->functions[index])
+    {
+        Error("Function '" + name.lexeme + "' already declared.");
+        return;
+    }
+
     Task *defaultTask = currentTask;
-    FunctionObject *task = vm->newFunction(rawName);
+    FunctionObject *task = vm->newFunction(rawName, index);
     setTask(task); 
   //  scopeEnter();
 
@@ -695,7 +802,6 @@ void Parser::functionDeclaration()
 
     hasReturned = false;
     task->argsCount = 0;
-    task->declareVariable(rawName, true);
 
     if (!match(TokenType::RIGHT_PAREN))
     {
@@ -755,11 +861,18 @@ void Parser::processDeclaration()
 
    // INFO("Declare process %s", rawName);
 
+    u16 index = processIndex(name.lexeme);
+    if (vm->processes[index])
+    {
+        Error("Process '" + name.lexeme + "' already declared.");
+        return;
+    }
+
     Task *defaultTask = currentTask;
-    Task *task = vm->newTask(rawName);
+    Task *task = vm->newTask(rawName, index);
     task->chunk = new Chunk(128);
-    task->set_process();
     setTask(task);
+    task->set_process();
 
     //task->declareVariable(name.lexeme, true);
     
@@ -921,16 +1034,15 @@ void Parser::variableDeclaration()
 
     if (global)
     {
-        Value value = STRING(name.lexeme);
         if (globals.contains(name.lexeme.c_str()))
         {
             Error("Global variable '" + name.lexeme+ "' already declared.");
             return;
         }
-        
-        u8 index = makeConstant(std::move(value));
-        emitBytes(OpCode::GLOBAL_DEFINE, index);
-        globals.insert(name.lexeme.c_str(), index);
+
+        u32 slot = globalSlot(name.lexeme);
+        emitShort(OpCode::GLOBAL_DEFINE, slot);
+        globals.insert(name.lexeme.c_str(), slot);
     }
     else
     {       
@@ -946,48 +1058,54 @@ void Parser::variableDeclaration()
     
 }
 
+// the first locals of a process body are id, graph, x, y (see set_process)
+bool Parser::isEngineLocal(int index)
+{
+    return index >= 0 && index < DEFAULT_COUNT && currentTask->type == TaskType::TPROCESS;
+}
+
 void Parser::variable(bool canAssign)
 {
-        Token name = previous();
-        Value value = STRING(name.lexeme);
-    
-        bool global = IsGlobalScope();//is not 0 'global'
-        int index = currentTask->resolveLocal(name.lexeme); //is not in locals
-        if (index == -1 && !global)
+    Token name = previous();
+
+    int index = currentTask->resolveLocal(name.lexeme);
+    bool global = false;
+    u32 slot = 0;
+    if (index == -1)
+    {
+        // declared by the script or registered by the host: the slot is known now.
+        // At main scope anything else is still a global, it just gets its value
+        // (or the undefined error) at runtime.
+        if (globals.find(name.lexeme.c_str(), slot) || vm->globalSlots.find(name.lexeme.c_str(), slot))
+        {
+            global = true;
+        }
+        else if (IsGlobalScope())
         {
-            if (globals.contains(name.lexeme.c_str()))//global but local have scope depth +1 
-                global = true;
+            slot = globalSlot(name.lexeme);
+            global = true;
         }
+    }
 
-        u8 arg = 0;
+    if (canAssign && match(TokenType::EQUAL))
+    {
+        expression();
         if (global)
-        {             
-             arg = makeConstant(std::move(value));
+        {
+            emitShort(OpCode::GLOBAL_ASSIGN, slot);
         }
-
-        if (canAssign && match(TokenType::EQUAL))
+        else if (index == -1)
         {
-            expression();
-            if (global)
-            {
-                emitBytes(OpCode::GLOBAL_ASSIGN, arg);
-            }
-            else
-            {                   
-                if (index == -1)
-                {
-                    if (globals.contains(name.lexeme.c_str()))
-                    {
-                        u8 arg = makeConstant(std::move(value));
-                        emitBytes(OpCode::GLOBAL_ASSIGN, arg);
-                        return;
-                    }
-                    Error("Local  variable '" + name.lexeme + "' not declared .");
-                    return;
-                }
-                emitBytes(OpCode::LOCAL_SET, index);
-            }
-            
+            Error("Local  variable '" + name.lexeme + "' not declared .");
+        }
+        else if (isEngineLocal(index))
+        {
+            emitBytes(OpCode::ENGINE_SET, index);
+        }
+        else
+        {
+            emitBytes(OpCode::LOCAL_SET, index);
+        }
     }
     else if (!canAssign && match(TokenType::EQUAL))
     {
@@ -995,32 +1113,23 @@ void Parser::variable(bool canAssign)
         Error("Invalid assignment target");
     }
     else
-    {      
-      
+    {
         if (global)
         {
-            emitBytes(OpCode::GLOBAL_GET, arg);
+            emitShort(OpCode::GLOBAL_GET, slot);
+        }
+        else if (index == -1)
+        {
+            Error("Variable  '"+ name.lexeme+"' is not declared .");
+        }
+        else if (isEngineLocal(index))
+        {
+            emitBytes(OpCode::ENGINE_GET, index);
         }
         else
         {
-            
-            int index = currentTask->resolveLocal(name.lexeme);
-            if (index == -1)
-            {
-
-                if (globals.contains(name.lexeme.c_str()))
-                {
-                    u8 arg = makeConstant(std::move(value));   
-                    emitBytes(OpCode::GLOBAL_GET, arg);
-                    return;
-                }
-                Error("Variable  '"+ name.lexeme+"' is not declared .");
-                return;
-            }
-                    
             emitBytes(OpCode::LOCAL_GET, index);
         }
-        
     }
 }
 
@@ -1168,10 +1277,18 @@ void Parser::returnStatement()
 
 void Parser::frameStatement()
 {
+    // frame; is frame(100), one Update
+    if (match(TokenType::LEFT_PAREN))
+    {
+        expression();
+        consume(TokenType::RIGHT_PAREN, "Expect ')' after frame percent");
+    }
+    else
+    {
+        emitConstant(NUMBER(100));
+    }
     consume(TokenType::SEMICOLON, "Expect ';' after 'frame'");
-    
     emitByte(OpCode::FRAME);
-    emitConstant(NUMBER(0));
 }
 
 void Parser::typeStatement()
@@ -1191,28 +1308,42 @@ void Parser::callStatement(bool native)
     Token name = previous();
     consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
 
-    // push function name
-
-   // INFO("Calling function %s with argument %s", name.lexeme.c_str(),peek().lexeme.c_str());
-
-    emitConstant(STRING(name.lexeme));
-    u8 argCount = argumentList(false);
-
     if (native)
     {
-        emitBytes(OpCode::CALL, argCount); // push args count and call
+        u32 index = 0;
+        if (!vm->nativeSlots.find(name.lexeme.c_str(), index))
+        {
+            Error("Native function '" + name.lexeme + "' not registered.");
+            return;
+        }
+        u8 argCount = argumentList(false);
+        int arity = vm->natives[index]->arity;
+        if (arity != -1 && arity != argCount)
+        {
+            Error("Native function " + name.lexeme + " has wrong number of arguments. Expected " + String(arity) + " but got " + String((int)argCount));
+            return;
+        }
+        emitShort(OpCode::CALL, (u16)index);
+        emitByte(argCount);
+        return;
     }
-    else
-        emitBytes(OpCode::CALL_SCRIPT, argCount);
+
+    u16 index = functionIndex(name.lexeme);
+    u8 argCount = argumentList(false);
+    calls.push_back({name.lexeme, index, argCount, false, name.line});
+    emitShort(OpCode::CALL_SCRIPT, index);
+    emitByte(argCount);
 }
 
 void Parser::callProcess()
 {
     Token name = previous();
     consume(TokenType::LEFT_PAREN, "Expect '(' after process name.");
-    emitConstant(STRING(name.lexeme));
+    u16 index = processIndex(name.lexeme);
     u8 argCount = argumentList(true);
-    emitBytes(OpCode::CALL_PROCESS, argCount);
+    calls.push_back({name.lexeme, index, argCount, true, name.line});
+    emitShort(OpCode::CALL_PROCESS, index);
+    emitByte(argCount);
 }
 u8 Parser::argumentList(bool canAssign)
 {
@@ -1239,11 +1370,11 @@ u8 Parser::argumentList(bool canAssign)
 void Parser::whileStatement()
 {
 
-    int previousLoopStart = currentTask->loopStart;
-    int previousBreakJumpCount = currentTask->breakJumpCount;
+    int previousLoopStart = compiler->loopStart;
+    int previousBreakJumpCount = compiler->breakJumpCount;
 
-    currentTask->loopStart = currentTask->chunk->count;
-    currentTask->breakJumpCount = 0;
+    compiler->loopStart = currentTask->chunk->count;
+    compiler->breakJumpCount = 0;
     
     scopeEnter();
 
@@ -1251,21 +1382,21 @@ void Parser::whileStatement()
     expression();
     consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-    currentTask->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
+    compiler->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
     emitByte(OpCode::POP); 
     statement();
 
-    emitLoop(currentTask->loopStart);
+    emitLoop(compiler->loopStart);
     
     
-    patchJump(currentTask->exitJump);
+    patchJump(compiler->exitJump);
     emitByte(OpCode::POP); 
 
     patchBreakJumps();
     
 
-    currentTask->loopStart = previousLoopStart;
-    currentTask->breakJumpCount = previousBreakJumpCount;
+    compiler->loopStart = previousLoopStart;
+    compiler->breakJumpCount = previousBreakJumpCount;
 
     scopeExit();
 }
@@ -1273,14 +1404,14 @@ void Parser::doWhileStatement()
 {
  
 
-    int previousLoopStart      = currentTask->loopStart;
-    int previousBreakJumpCount = currentTask->breakJumpCount;
-    currentTask->breakJumpCount = 0;
+    int previousLoopStart      = compiler->loopStart;
+    int previousBreakJumpCount = compiler->breakJumpCount;
+    compiler->breakJumpCount = 0;
     
 
-    currentTask->exitJump = -1;
+    compiler->exitJump = -1;
 
-    currentTask->loopStart     = currentTask->chunk->count;    
+    compiler->loopStart     = currentTask->chunk->count;    
     statement();
    
     consume(TokenType::WHILE, "Expect 'while' after loop body in do-while statement.");
@@ -1292,64 +1423,64 @@ void Parser::doWhileStatement()
 
     
 
-    currentTask->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
+    compiler->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
     emitByte(OpCode::POP); 
     
-    emitLoop(currentTask->loopStart);
+    emitLoop(compiler->loopStart);
 
 
-    patchJump(currentTask->exitJump);
+    patchJump(compiler->exitJump);
     emitByte(OpCode::POP);
 
-    for (int i = 0; i < currentTask->breakJumpCount; i++)
+    for (int i = 0; i < compiler->breakJumpCount; i++)
     {
-        patchJump(currentTask->breakJumps[i]);
+        patchJump(compiler->breakJumps[i]);
     }
 
     
     
 
 
-    currentTask->breakJumpCount = 0;
-    currentTask->loopStart = previousLoopStart;
-    currentTask->breakJumpCount = previousBreakJumpCount;
+    compiler->breakJumpCount = 0;
+    compiler->loopStart = previousLoopStart;
+    compiler->breakJumpCount = previousBreakJumpCount;
     
 } 
 
 
 void Parser::loopStatement()
 {  
-    int previousLoopStart = currentTask->loopStart;
-    int previousBreakJumpCount = currentTask->breakJumpCount;
+    int previousLoopStart = compiler->loopStart;
+    int previousBreakJumpCount = compiler->breakJumpCount;
 
 
 
-    currentTask->loopStart = currentTask->chunk->count;
-    currentTask->breakJumpCount = 0;
-    currentTask->exitJump = 1;
+    compiler->loopStart = currentTask->chunk->count;
+    compiler->breakJumpCount = 0;
+    compiler->exitJump = 1;
     scopeEnter();
 
     statement();
-    emitLoop(currentTask->loopStart);
+    emitLoop(compiler->loopStart);
     
      
 
     patchBreakJumps();
     scopeExit();
     
-    currentTask->loopStart = previousLoopStart;
-    currentTask->breakJumpCount = previousBreakJumpCount; 
+    compiler->loopStart = previousLoopStart;
+    compiler->breakJumpCount = previousBreakJumpCount; 
    
 }
 
 void Parser::forStatement()
 {
 
-    int previousLoopStart = currentTask->loopStart;
-    int previousBreakJumpCount = currentTask->breakJumpCount;
+    int previousLoopStart = compiler->loopStart;
+    int previousBreakJumpCount = compiler->breakJumpCount;
 
     
-    currentTask->breakJumpCount = 0;
+    compiler->breakJumpCount = 0;
 
     consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
 
@@ -1372,8 +1503,8 @@ void Parser::forStatement()
         expressionStatement();
     }
 
-    currentTask->loopStart = currentTask->chunk->count;
-    currentTask->exitJump = -1;
+    compiler->loopStart = currentTask->chunk->count;
+    compiler->exitJump = -1;
 
     if (!match(TokenType::SEMICOLON)) // exit condition
     {
@@ -1381,7 +1512,7 @@ void Parser::forStatement()
         
         consume(TokenType::SEMICOLON, "Expect ';' after loop condition.");
 
-        currentTask->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
+        compiler->exitJump = emitJump(OpCode::JUMP_IF_FALSE);
         emitByte(OpCode::POP);
     }
 
@@ -1393,9 +1524,9 @@ void Parser::forStatement()
         emitByte(OpCode::POP);
         consume(TokenType::RIGHT_PAREN, "Expect ')' after loop body.");
 
-        emitLoop(currentTask->loopStart);
+        emitLoop(compiler->loopStart);
 
-        currentTask->loopStart = incrementStart;
+        compiler->loopStart = incrementStart;
 
         patchJump(bodyJump);
     }
@@ -1403,12 +1534,12 @@ void Parser::forStatement()
 
     
     statement();
-    emitLoop(currentTask->loopStart);
+    emitLoop(compiler->loopStart);
 
     
-    if (currentTask->exitJump != -1)
+    if (compiler->exitJump != -1)
     {
-        patchJump(currentTask->exitJump);
+        patchJump(compiler->exitJump);
         emitByte(OpCode::POP);
     }
     
@@ -1416,8 +1547,8 @@ void Parser::forStatement()
 
 
     
-    currentTask->loopStart = previousLoopStart;
-    currentTask->breakJumpCount = previousBreakJumpCount;
+    compiler->loopStart = previousLoopStart;
+    compiler->breakJumpCount = previousBreakJumpCount;
 
    
 
@@ -1431,17 +1562,17 @@ void Parser::forStatement()
 void Parser::breakStatement()
 {
 
-    if (currentTask->loopStart == -1) 
+    if (compiler->loopStart == -1) 
     {
         vm->Error("Cannot use 'break' outside of loop");
         return;
     }
-    if (currentTask->breakJumpCount == UINT8_MAX) 
+    if (compiler->breakJumpCount == UINT8_MAX) 
     {
         vm->Error("Too many breaks");
         return;
     }
-    currentTask->breakJumps[currentTask->breakJumpCount++] = emitJump(OpCode::JUMP);
+    compiler->breakJumps[compiler->breakJumpCount++] = emitJump(OpCode::JUMP);
     
 
     consume(TokenType::SEMICOLON, "Expect ';' after 'break'");
@@ -1452,22 +1583,22 @@ void Parser::breakStatement()
 void Parser::continueStatement()
 {
     consume(TokenType::SEMICOLON, "Expect ';' after 'continue'");
-    if (currentTask->loopStart == -1) 
+    if (compiler->loopStart == -1) 
     {
         vm->Error("Cannot use 'continue' outside of loop");
         return;
     }
 
   
-    emitLoop(currentTask->loopStart);
+    emitLoop(compiler->loopStart);
     
    
 }
 void Parser::patchBreakJumps()
 {
-    for (int i = 0; i < currentTask->breakJumpCount; i++)
+    for (int i = 0; i < compiler->breakJumpCount; i++)
     {
-        patchJump(currentTask->breakJumps[i]);
+        patchJump(compiler->breakJumps[i]);
     }
-    currentTask->breakJumpCount = 0;
+    compiler->breakJumpCount = 0;
 }
@@ -0,0 +1,320 @@
+#include "pch.h"
+#include "Vm.hpp"
+
+// Peephole pass over a compiled chunk: common instruction sequences become one
+// superinstruction. The sequences come from the opcode pair histogram of our
+// scripts (build with OPCODE_PAIR_STATS, see bench_opcode_pairs): assignments
+// followed by POP, condition + JUMP_IF_FALSE + POP, and GET + ADD.
+// A sequence is only fused when no jump lands inside it; jumps are re-targeted
+// to the new offsets and every byte keeps the line of the instruction it came from.
+
+u32 InstructionSize(u8 instruction)
+{
+    switch ((OpCode)instruction)
+    {
+    case OpCode::CONST:
+    case OpCode::PUSH:
+    case OpCode::PROGRAM:
+    case OpCode::LOCAL_GET:
+    case OpCode::LOCAL_SET:
+    case OpCode::ENGINE_GET:
+    case OpCode::ENGINE_SET:
+    case OpCode::RETURN_DEF:
+    case OpCode::LOCAL_STORE:
+    case OpCode::ENGINE_STORE:
+    case OpCode::ADD_LOCAL:
+    case OpCode::ADD_CONST:
+        return 2;
+
+    case OpCode::GLOBAL_DEFINE:
+    case OpCode::GLOBAL_GET:
+    case OpCode::GLOBAL_ASSIGN:
+    case OpCode::CASE:
+    case OpCode::SWITCH_DEFAULT:
+    case OpCode::JUMP_BACK:
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::POP_JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+    case OpCode::GLOBAL_STORE:
+    case OpCode::ADD_GLOBAL:
+    case OpCode::ADD_LOCAL_LOCAL:
+    case OpCode::LOCAL_INC_CONST:
+        return 3;
+
+    case OpCode::CALL:
+    case OpCode::CALL_SCRIPT:
+    case OpCode::CALL_PROCESS:
+        return 4;
+
+    default:
+        return instruction < OpCode::COUNT ? 1 : 0;
+    }
+}
+
+static bool isJump(u8 instruction)
+{
+    switch ((OpCode)instruction)
+    {
+    case OpCode::CASE:
+    case OpCode::SWITCH_DEFAULT:
+    case OpCode::JUMP_BACK:
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::POP_JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// compare opcode to its fused compare-and-branch, ZERO if there is none
+static u8 compareJump(u8 instruction)
+{
+    switch ((OpCode)instruction)
+    {
+    case OpCode::LESS:
+        return OpCode::JUMP_IF_NOT_LESS;
+    case OpCode::LESS_EQUAL:
+        return OpCode::JUMP_IF_NOT_LESS_EQUAL;
+    case OpCode::GREATER:
+        return OpCode::JUMP_IF_NOT_GREATER;
+    case OpCode::GREATER_EQUAL:
+        return OpCode::JUMP_IF_NOT_GREATER_EQUAL;
+    default:
+        return OpCode::ZERO;
+    }
+}
+
+// absolute target of the jump at offset, or -1 when it points before the chunk
+static int jumpTarget(const u8 *code, u32 offset)
+{
+    int jump = (code[offset + 1] << 8) | code[offset + 2];
+    if (code[offset] == OpCode::JUMP_BACK)
+        return (int)offset + 3 - jump;
+    return (int)offset + 3 + jump;
+}
+
+void Task::optimize()
+{
+    if (!chunk || chunk->count == 0)
+        return;
+
+    const u32 count = chunk->count;
+    const u8 *code = chunk->code;
+
+    // instruction starts and jump targets; a chunk we can't decode stays as it is
+    static const u8 START = 1;
+    static const u8 TARGET = 2;
+    u8 *marks = new u8[count + 1]();
+    for (u32 offset = 0; offset < count;)
+    {
+        u32 size = InstructionSize(code[offset]);
+        if (size == 0 || offset + size > count)
+        {
+            delete[] marks;
+            return;
+        }
+        marks[offset] |= START;
+        offset += size;
+    }
+    marks[count] |= START;
+    for (u32 offset = 0; offset < count; offset += InstructionSize(code[offset]))
+    {
+        if (!isJump(code[offset]))
+            continue;
+        int target = jumpTarget(code, offset);
+        if (target < 0 || target > (int)count || !(marks[target] & START))
+        {
+            delete[] marks;
+            return;
+        }
+        marks[target] |= TARGET;
+    }
+
+    // op at offset, and no jump lands on it (interior instructions of a sequence)
+    auto inner = [&](u32 offset, u8 op)
+    {
+        return offset < count && code[offset] == op && (marks[offset] & (START | TARGET)) == START;
+    };
+    // JUMP_IF_FALSE leaves the condition for a POP on both paths; fused, the
+    // jump pops it and skips the POP at the target
+    auto popsAtTarget = [&](u32 offset)
+    {
+        u32 target = (u32)jumpTarget(code, offset);
+        return target < count && code[target] == OpCode::POP;
+    };
+
+    u8 *out = new u8[count];
+    int *outLines = new int[count];
+    u32 *map = new u32[count + 1];
+    Vector<u32> fixups;  // offsets of rewritten jumps in out
+    Vector<u32> targets; // their targets in the old code
+
+    u32 offset = 0;
+    u32 n = 0;
+    while (offset < count)
+    {
+        map[offset] = n;
+        u8 op = code[offset];
+        int line = chunk->getLine(offset);
+        u32 size = InstructionSize(op);
+
+        u8 fused = OpCode::ZERO;
+        u32 length = 0; // old bytes consumed
+        int target = -1;
+        u8 a = size > 1 ? code[offset + 1] : 0;
+        u8 b = 0;
+
+        if (op == OpCode::LOCAL_GET &&
+            inner(offset + 2, OpCode::CONST) && inner(offset + 4, OpCode::ADD) &&
+            inner(offset + 5, OpCode::LOCAL_SET) && code[offset + 6] == a && inner(offset + 7, OpCode::POP))
+        {
+            // i = i + k;
+            fused = OpCode::LOCAL_INC_CONST;
+            b = code[offset + 3];
+            length = 8;
+        }
+        else if (op == OpCode::LOCAL_GET && inner(offset + 2, OpCode::LOCAL_GET) && inner(offset + 4, OpCode::ADD))
+        {
+            fused = OpCode::ADD_LOCAL_LOCAL;
+            b = code[offset + 3];
+            length = 5;
+        }
+        else if (compareJump(op) && inner(offset + 1, OpCode::JUMP_IF_FALSE) &&
+                 inner(offset + 4, OpCode::POP) && popsAtTarget(offset + 1))
+        {
+            fused = compareJump(op);
+            target = jumpTarget(code, offset + 1) + 1;
+            length = 5;
+        }
+        else if (op == OpCode::JUMP_IF_FALSE && inner(offset + 3, OpCode::POP) && popsAtTarget(offset))
+        {
+            fused = OpCode::POP_JUMP_IF_FALSE;
+            target = jumpTarget(code, offset) + 1;
+            length = 4;
+        }
+        else if (inner(offset + size, OpCode::POP) &&
+                 (op == OpCode::LOCAL_SET || op == OpCode::ENGINE_SET || op == OpCode::GLOBAL_ASSIGN))
+        {
+            fused = op == OpCode::LOCAL_SET    ? OpCode::LOCAL_STORE
+                    : op == OpCode::ENGINE_SET ? OpCode::ENGINE_STORE
+                                               : OpCode::GLOBAL_STORE;
+            length = size + 1;
+        }
+        else if (inner(offset + size, OpCode::ADD) &&
+                 (op == OpCode::LOCAL_GET || op == OpCode::GLOBAL_GET || op == OpCode::CONST))
+        {
+            fused = op == OpCode::LOCAL_GET    ? OpCode::ADD_LOCAL
+                    : op == OpCode::GLOBAL_GET ? OpCode::ADD_GLOBAL
+                                               : OpCode::ADD_CONST;
+            length = size + 1;
+        }
+
+        if (fused == OpCode::ZERO)
+        {
+            // copied as is, jumps are fixed below
+            if (isJump(op))
+            {
+                fixups.push_back(n);
+                targets.push_back((u32)jumpTarget(code, offset));
+            }
+            for (u32 i = 0; i < size; i++)
+            {
+                out[n] = code[offset + i];
+                outLines[n++] = line;
+            }
+            offset += size;
+            continue;
+        }
+
+        if (target >= 0)
+        {
+            // the skipped POP must stay an instruction start
+            marks[target] |= TARGET;
+            fixups.push_back(n);
+            targets.push_back((u32)target);
+        }
+        u32 fusedSize = InstructionSize(fused);
+        out[n] = fused;
+        if (target < 0)
+        {
+            if (fusedSize > 1)
+                out[n + 1] = a;
+            if (fusedSize > 2)
+                out[n + 2] = (fused == OpCode::GLOBAL_STORE || fused == OpCode::ADD_GLOBAL) ? code[offset + 2] : b;
+        }
+        for (u32 i = 0; i < fusedSize; i++)
+        {
+            outLines[n + i] = line;
+        }
+        n += fusedSize;
+        offset += length;
+    }
+    map[count] = n;
+
+    for (u32 i = 0; i < fixups.size(); i++)
+    {
+        u32 at = fixups[i];
+        u32 target = map[targets[i]];
+        u32 jump = out[at] == OpCode::JUMP_BACK ? at + 3 - target : target - (at + 3);
+        out[at + 1] = (jump >> 8) & 0xff;
+        out[at + 2] = jump & 0xff;
+    }
+
+    std::memcpy(chunk->code, out, n);
+    chunk->setLines(outLines, n);
+    chunk->count = n;
+
+    delete[] out;
+    delete[] outLines;
+    delete[] map;
+    delete[] marks;
+}
+
+#ifdef OPCODE_PAIR_STATS
+
+extern const char *opcodeNames[];
+
+u64 opcodePairs[OpCode::COUNT][OpCode::COUNT];
+
+void PrintOpcodePairs(FILE *out, u32 top)
+{
+    u64 total = 0;
+    for (int i = 0; i < OpCode::COUNT; i++)
+        for (int j = 0; j < OpCode::COUNT; j++)
+            total += opcodePairs[i][j];
+    if (total == 0)
+        return;
+
+    fprintf(out, "opcode pairs, %llu executed\n", (unsigned long long)total);
+    bool *shown = new bool[OpCode::COUNT * OpCode::COUNT]();
+    for (u32 k = 0; k < top; k++)
+    {
+        int best = -1;
+        for (int i = 0; i < OpCode::COUNT * OpCode::COUNT; i++)
+        {
+            if (!shown[i] && opcodePairs[i / OpCode::COUNT][i % OpCode::COUNT] &&
+                (best < 0 || opcodePairs[i / OpCode::COUNT][i % OpCode::COUNT] > opcodePairs[best / OpCode::COUNT][best % OpCode::COUNT]))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        shown[best] = true;
+        u64 hits = opcodePairs[best / OpCode::COUNT][best % OpCode::COUNT];
+        fprintf(out, "%12llu %5.1f%%  %s -> %s\n", (unsigned long long)hits, 100.0 * hits / total,
+                opcodeNames[best / OpCode::COUNT], opcodeNames[best % OpCode::COUNT]);
+    }
+    delete[] shown;
+}
+
+#endif
@@ -31,6 +31,10 @@ Process::Process(VirtualMachine *vm, const char *name) : Task(vm, name)
     type = TaskType::TPROCESS;
     prev = nullptr;
     next = nullptr;
+    timerNext = nullptr;
+    timerPrev = nullptr;
+    isSleeping = false;
+    gcSlot = UINT32_MAX;
     priority  = 0;
     isCreated = false;
   
@@ -82,23 +86,12 @@ void Process::remove()
 
 void Process::start()
 {
-    instance.locals[IX]     =   stack[IX].number;
-    instance.locals[IY]     =   stack[IY].number;
-    instance.locals[IGRAPH] =   stack[IGRAPH].number;
-
     vm->hooks.instance_pre_execute_hook(&instance);
-
-
 }
 
 void Process::end()
 {
-    stack[IX].number = instance.locals[IX];
-    stack[IY].number = instance.locals[IY];
-    stack[IGRAPH].number = instance.locals[IGRAPH];
     vm->hooks.instance_pos_execute_hook(&instance);   
-
-
 }
 
 void Process::render()
@@ -106,6 +99,16 @@ void Process::render()
 
     if (!isCreated)        return;
 
+    if (vm->hooks.render_batch_hook)
+    {
+        vm->batchInstances.push_back(&instance);
+        vm->batchId.push_back(instance.ID);
+        vm->batchX.push_back(instance.get(IX));
+        vm->batchY.push_back(instance.get(IY));
+        vm->batchGraph.push_back(instance.get(IGRAPH));
+        return;
+    }
+
     start();
     vm->hooks.process_exec_hook(&instance);
     end();
@@ -132,10 +135,10 @@ void Process::set_defaults()
     // setLocalVariable("y", IY);
 
 
-    instance.locals[IX]     =   stack[IX].number;
-    instance.locals[IY]     =   stack[IY].number;
-    instance.locals[IGRAPH] =   stack[IGRAPH].number;
-    instance.locals[IID]    =   stack[IID].number;
+    instance.set(IID, (double)ID);
+    instance.set(IGRAPH, 100);
+    instance.set(IX, 2);
+    instance.set(IY, 3);
 
 }
 
@@ -159,7 +162,7 @@ ProcessList::~ProcessList()
     while (p)
     {
         Process *next = p->next;
-        delete p;
+        p->vm->FreeProcess(p);
         p = next;
     }
 
@@ -201,7 +204,7 @@ void ProcessList::clear(bool freeData)
         Process *next = p->next;
         if (freeData)
         {
-            delete p;
+            p->vm->FreeProcess(p);
         }
         p = next;
     }
@@ -260,7 +263,6 @@ bool ProcessList::remove(Process *n)
 {
     if (!n) return false;
     if (!head) return false;
-    if (n == head && n == tail) return false;
     if (n == head)
     {
         head = n->next;
@@ -300,6 +302,166 @@ bool ProcessList::remove(Process *n)
 
 
 
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+
+ProcessPool::ProcessPool()
+{
+    freeList = nullptr;
+    freeCount = 0;
+    highWater = PROCESS_POOL_HIGH_WATER;
+}
+
+ProcessPool::~ProcessPool()
+{
+    trim(0);
+}
+
+void *ProcessPool::acquire()
+{
+    if (freeList)
+    {
+        Slot *slot = freeList;
+        freeList = slot->next;
+        freeCount--;
+        Arena::as().pool_acquire(sizeof(Process), true);
+        return slot;
+    }
+    Arena::as().pool_acquire(sizeof(Process), false);
+    return ::operator new(sizeof(Process));
+}
+
+void ProcessPool::release(void *ptr)
+{
+    Arena::as().pool_release(sizeof(Process));
+    Slot *slot = static_cast<Slot *>(ptr);
+    slot->next = freeList;
+    freeList = slot;
+    freeCount++;
+    if (freeCount > highWater)
+    {
+        trim(highWater);
+    }
+}
+
+void ProcessPool::trim(u32 keep)
+{
+    while (freeCount > keep)
+    {
+        Slot *slot = freeList;
+        freeList = slot->next;
+        freeCount--;
+        Arena::as().pool_return(sizeof(Process));
+        ::operator delete(slot);
+    }
+}
+
+void ProcessPool::setHighWater(u32 count)
+{
+    highWater = count;
+    trim(highWater);
+}
+
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+
+EngineLocals::EngineLocals()
+{
+    slots = 0;
+}
+
+u32 EngineLocals::acquire()
+{
+    if (!freeSlots.empty())
+    {
+        return freeSlots.pop_back();
+    }
+    for (int i = 0; i < DEFAULT_COUNT; i++)
+    {
+        columns[i].push_back(0);
+    }
+    return slots++;
+}
+
+void EngineLocals::release(u32 slot)
+{
+    columns[IID][slot] = -1;
+    freeSlots.push_back(slot);
+}
+
+void EngineLocals::clear()
+{
+    for (int i = 0; i < DEFAULT_COUNT; i++)
+    {
+        columns[i].clear();
+    }
+    freeSlots.clear();
+    slots = 0;
+}
+
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+//***************************************************************************************************************** */
+
+TimerWheel::TimerWheel()
+{
+    clear();
+}
+
+void TimerWheel::clear()
+{
+    for (u32 i = 0; i < TIMER_WHEEL_SIZE; i++)
+    {
+        buckets[i] = nullptr;
+    }
+    sleeping = 0;
+}
+
+void TimerWheel::add(Process *p)
+{
+    Process *&bucket = buckets[p->wakeTick % TIMER_WHEEL_SIZE];
+    p->timerPrev = nullptr;
+    p->timerNext = bucket;
+    if (bucket)
+        bucket->timerPrev = p;
+    bucket = p;
+    p->isSleeping = true;
+    sleeping++;
+}
+
+void TimerWheel::remove(Process *p)
+{
+    if (!p->isSleeping)
+        return;
+    if (p->timerPrev)
+        p->timerPrev->timerNext = p->timerNext;
+    else
+        buckets[p->wakeTick % TIMER_WHEEL_SIZE] = p->timerNext;
+    if (p->timerNext)
+        p->timerNext->timerPrev = p->timerPrev;
+    p->timerNext = nullptr;
+    p->timerPrev = nullptr;
+    p->isSleeping = false;
+    sleeping--;
+}
+
+void TimerWheel::wake(u64 tick)
+{
+    Process *p = buckets[tick % TIMER_WHEEL_SIZE];
+    while (p)
+    {
+        Process *next = p->timerNext;
+        if (p->wakeTick <= tick)
+        {
+            remove(p);
+            p->state = RUNNING;
+        }
+        p = next;
+    }
+}
+
 //***************************************************************************************************************** */
 //***************************************************************************************************************** */
 //***************************************************************************************************************** */
@@ -2,22 +2,24 @@
 
 #include "pch.h"
 #include "Vm.hpp"
+#include "Aot.hpp"
+#include "Jit.hpp"
 #include "Parser.hpp"
 
 static u64 nextID = 0;
 
 void debugValue(const Value &v)
 {
-    switch (v.type)
+    switch (VALUE_TYPE(v))
     {
     case ValueType::VSTRING:
-        printf("%s", v.string->string.c_str());
+        printf("%s", AS_RAW_STRING(v));
         break;
     case ValueType::VNUMBER:
-        printf("%g", v.number);
+        printf("%g", AS_NUMBER(v));
         break;
     case ValueType::VBOOLEAN:
-        printf("%s", v.boolean ? "true" : "false");
+        printf("%s", AS_BOOLEAN(v) ? "true" : "false");
         break;
     case ValueType::VNONE:
         printf("nil");
@@ -30,16 +32,16 @@ void debugValue(const Value &v)
 }
 void printValueln(const Value &v)
 {
-    switch (v.type)
+    switch (VALUE_TYPE(v))
     {
     case ValueType::VSTRING:
-        printf("%s\n", v.string->string.c_str());
+        printf("%s\n", AS_RAW_STRING(v));
         break;
     case ValueType::VNUMBER:
-        printf("%g\n", v.number);
+        printf("%g\n", AS_NUMBER(v));
         break;
     case ValueType::VBOOLEAN:
-        printf("%s\n", v.boolean ? "true" : "false");
+        printf("%s\n", AS_BOOLEAN(v) ? "true" : "false");
         break;
     case ValueType::VNONE:
         printf("nil\n");
@@ -53,16 +55,16 @@ void printValueln(const Value &v)
 
 void printValue(const Value &v)
 {
-    switch (v.type)
+    switch (VALUE_TYPE(v))
     {
     case ValueType::VSTRING:
-        PRINT("%s", v.string->string.c_str());
+        PRINT("%s", AS_RAW_STRING(v));
         break;
     case ValueType::VNUMBER:
-        PRINT("%g", v.number);
+        PRINT("%g", AS_NUMBER(v));
         break;
     case ValueType::VBOOLEAN:
-        PRINT("%s", v.boolean ? "true" : "false");
+        PRINT("%s", AS_BOOLEAN(v) ? "true" : "false");
         break;
     case ValueType::VNONE:
         PRINT("nil");
@@ -77,21 +79,21 @@ void printValue(const Value &v)
 
 void Task::beginScope()
 {
-   // INFO("Begin scope %d", scopeDepth);
-    scopeDepth++;
+   // INFO("Begin scope %d", compiler->scopeDepth);
+    compiler->scopeDepth++;
     
 }
 
 void Task::exitScope(int line)
 {
     
-    scopeDepth--;
+    compiler->scopeDepth--;
   //  if (is_persistent) return;
-    while (localCount > 0 && (locals[localCount - 1].depth > scopeDepth  && !locals[localCount - 1].isArg) )
+    while (compiler->localCount > 0 && (compiler->locals[compiler->localCount - 1].depth > compiler->scopeDepth  && !compiler->locals[compiler->localCount - 1].isArg) )
     {
-     //   INFO("End scope %d %d", scopeDepth,localCount);
+     //   INFO("End scope %d %d", compiler->scopeDepth,compiler->localCount);
         write_byte(OpCode::POP,line);
-        localCount--;
+        compiler->localCount--;
     }
     
     
@@ -109,16 +111,16 @@ void Task::operator delete(void *ptr, size_t size)
 
 int Task::addLocal(const char *name, u32 len,bool isArg)
 {
-    if (localCount == UINT8_MAX)
+    if (compiler->localCount == UINT8_MAX)
     {
         vm->Error("Too many local variables in task");
         return -1;
     }
-    Local *local = &locals[localCount++];
+    Local *local = &compiler->locals[compiler->localCount++];
     strcpy(local->name, name);
     local->len = len;
     local->name[len] = '\0';
-    local->depth = scopeDepth;
+    local->depth = compiler->scopeDepth;
     local->isArg = isArg;
     if (isArg)
     {
@@ -128,14 +130,14 @@ int Task::addLocal(const char *name, u32 len,bool isArg)
   //  INFO("Add local %s in scope %d task %s", local->name, local->depth, this->name.c_str());
     
 
-    return localCount - 1;
+    return compiler->localCount - 1;
 }
 int Task::declareVariable(const String &string,bool isArg) 
 {
-    for (int i = localCount - 1; i >= 0; i--) 
+    for (int i = compiler->localCount - 1; i >= 0; i--) 
     {
-        Local* local = &locals[i];
-        if (local->depth != -1 && local->depth < scopeDepth) 
+        Local* local = &compiler->locals[i];
+        if (local->depth != -1 && local->depth < compiler->scopeDepth) 
         {
             break;
         }
@@ -150,9 +152,9 @@ int Task::declareVariable(const String &string,bool isArg)
 
 int Task::resolveLocal(const String &string) 
 {
-    for (int i = localCount - 1; i >= 0; i--) 
+    for (int i = compiler->localCount - 1; i >= 0; i--) 
     {
-        Local *local = &locals[i];
+        Local *local = &compiler->locals[i];
        // INFO("Resolve local %s in scope %d task %s", local->name, local->depth, this->name.c_str());
         if (matchString(local->name, string.c_str(), string.length()))
         {
@@ -171,15 +173,18 @@ bool Task::setLocalVariable(const String &string, int index)
     {
         return false;
     }
-    Local *local = &locals[index];
+    Local *local = &compiler->locals[index];
     strcpy(local->name, string.c_str());
     local->len = string.length();
     local->name[local->len] = '\0';
     local->depth = 0;
-    localCount++;
+    compiler->localCount++;
     return true;
 
 }
+// script names of the engine locals, by IID, IGRAPH, IX, IY
+const char *engineLocalNames[DEFAULT_COUNT] = {"id", "graph", "x", "y"};
+
 void Task::set_process()
 {
 
@@ -195,23 +200,100 @@ void Task::set_process()
     
 
 
-    setLocalVariable("id", IID);
-    setLocalVariable("graph", IGRAPH);
-    setLocalVariable("x", IX);
-    setLocalVariable("y", IY);
+    for (int i = 0; i < DEFAULT_COUNT; i++)
+    {
+        setLocalVariable(engineLocalNames[i], i);
+    }
  //   addConstString(name.c_str());
   //  setLocalVariable("type", ITYPE);
 
      
 }
+u32 Task::markRoots()
+{
+    for (u32 i = 0; i < constants.size(); i++)
+    {
+        Arena::as().shade(constants[i]);
+    }
+    for (Value *value = stack; value < stackTop; value++)
+    {
+        Arena::as().shade(*value);
+    }
+    return (u32)constants.size() + (u32)(stackTop - stack);
+}
+
 Value Task::top()
 {
     return *stackTop;
 }
 
+bool Task::growStack(u32 count)
+{
+    u32 used = (u32)(stackTop - stack);
+    if (used + count <= stackCapacity)
+    {
+        return true;
+    }
+    if (used + count > STACK_MAX)
+    {
+        return false;
+    }
+
+    u32 capacity = stackCapacity ? stackCapacity : STACK_MIN;
+    while (capacity < used + count)
+    {
+        capacity *= 2;
+    }
+    if (capacity > STACK_MAX)
+    {
+        capacity = STACK_MAX;
+    }
+
+    Value *data = (Value *)std::realloc(stack, capacity * sizeof(Value));
+    if (!data)
+    {
+        return false;
+    }
+
+    // frames point into the old block, move them with it
+    for (int i = 0; i < frameCount; i++)
+    {
+        frames[i].slots = data + (frames[i].slots - stack);
+    }
+    stackTop = data + used;
+    stack = data;
+    stackCapacity = capacity;
+    return true;
+}
+
+bool Task::growFrames()
+{
+    if (frameCount < frameCapacity)
+    {
+        return true;
+    }
+    if (frameCapacity >= MAX_FRAMES)
+    {
+        return false;
+    }
+    int capacity = frameCapacity ? frameCapacity * 2 : FRAMES_MIN;
+    if (capacity > MAX_FRAMES)
+    {
+        capacity = MAX_FRAMES;
+    }
+    Frame *data = (Frame *)std::realloc(frames, capacity * sizeof(Frame));
+    if (!data)
+    {
+        return false;
+    }
+    frames = data;
+    frameCapacity = capacity;
+    return true;
+}
+
 bool Task::push(Value v)
 {
-    if (stackTop - stack >= STACK_MAX)
+    if (stackTop - stack >= (int)stackCapacity && !growStack(1))
     {
         PrintStack();
         vm->Error("[PUSH] Stack overflow %s", name.c_str());
@@ -261,18 +343,20 @@ Task::Task(VirtualMachine *vm, const char *name)
     argsCount = 0;
     isReturned = false;
 
-    frame_counter = 0;
-    last_frame_time = clock();
+    frameCredit = 0;
+    wakeTick = 0;
 
     state = RUNNING;
-    frameStep = RUNNING;
 
     this->name = name;
-    constants.reserve(256);
-    frameDepth = 1024;
 
-    scopeDepth = 0;
-    localCount = 0;
+    compiler = nullptr;
+    resumeBudget = 0;
+    frames = nullptr;
+    frameCount = 0;
+    frameCapacity = 0;
+    stack = nullptr;
+    stackCapacity = 0;
 
     // lineBuffer = lines.pointer();
     
@@ -302,21 +386,32 @@ Task::~Task()
 
     constants.clear();
 
+    delete compiler;
+    std::free(stack);
+    std::free(frames);
+
 
     //INFO("Destroy task %s with id %d", name, ID);
 }
 
 void Task::init_frames()
+{
+    init_frames(this);
+}
+
+void Task::init_frames(Task *code)
 {
     frameCount = 0;
+    growFrames();
     Frame *frame = &frames[frameCount++];
-    frame->task = this;
+    frame->task = code;
     frame->slots = stack;
-    frame->ip = chunk->code;
+    frame->ip = code->chunk->code;
 }
 
+// by OpCode, keep in the enum order
 const char *opcodeNames[] = {
-    "NONE",
+    "ZERO",
     "PUSH",
     "POP",
     "CONST",
@@ -325,6 +420,9 @@ const char *opcodeNames[] = {
     "PRINT",
     "NOW",
     "FRAME",
+    "TYPE",
+    "CLONE",
+    "PROGRAM",
 
     "ADD",
     "SUBTRACT",
@@ -353,16 +451,15 @@ const char *opcodeNames[] = {
     "SHL",
     "SHR",
 
-    "ENTER_SCOPE",
-    "EXIT_SCOPE",
-
     "GLOBAL_DEFINE",
     "GLOBAL_GET",
     "GLOBAL_ASSIGN",
 
-    "LOCAL_DEFINE",
     "LOCAL_GET",
-    "LOCAL_ASSIGN",
+    "LOCAL_SET",
+
+    "ENGINE_GET",
+    "ENGINE_SET",
 
     "SWITCH",
     "CASE",
@@ -385,13 +482,36 @@ const char *opcodeNames[] = {
     "CALL_PROCESS",
     "RETURN_DEF",
     "RETURN_PROCESS",
-    "RETURN_NATIVE",
 
     "NIL",
 
     "JUMP",
     "JUMP_IF_FALSE",
     "JUMP_IF_TRUE",
+
+    "POP_JUMP_IF_FALSE",
+    "JUMP_IF_NOT_LESS",
+    "JUMP_IF_NOT_LESS_EQUAL",
+    "JUMP_IF_NOT_GREATER",
+    "JUMP_IF_NOT_GREATER_EQUAL",
+    "LOCAL_STORE",
+    "ENGINE_STORE",
+    "GLOBAL_STORE",
+    "ADD_LOCAL",
+    "ADD_GLOBAL",
+    "ADD_CONST",
+    "ADD_LOCAL_LOCAL",
+    "LOCAL_INC_CONST",
+    "ADD_NUM",
+    "SUBTRACT_NUM",
+    "MULTIPLY_NUM",
+    "DIVIDE_NUM",
+    "EQUAL_NUM",
+    "NOT_EQUAL_NUM",
+    "LESS_NUM",
+    "LESS_EQUAL_NUM",
+    "GREATER_NUM",
+    "GREATER_EQUAL_NUM",
     "COUNT"};
 
 void Task::write_byte(u8 byte, int line)
@@ -430,7 +550,7 @@ u8 Task::addConst(Value v)
 
 u8 Task::addConstString(const char *str)
 {
-    return addConst(STRING(str));
+    return addConst(INTERNED(str));
 }
 
 u8 Task::addConstNumber(double number)
@@ -478,17 +598,29 @@ void Task::disassembleCode(const char *name)
     printf("\n");
 }
 
+int Task::currentLine() const
+{
+    if (frameCount == 0)
+        return 0;
+    const Frame *frame = &frames[frameCount - 1];
+    const Chunk *code = frame->task->chunk;
+    // ip is past the opcode (and operands) of the instruction that failed
+    u32 offset = (u32)(frame->ip - code->code);
+    return code->getLine(offset > 0 ? offset - 1 : 0);
+}
+
 u32 Task::disassembleInstruction(u32 offset)
 {
 
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = chunk->getLine(offset);
+    if (offset > 0 && line == chunk->getLine(offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     u8 instruction = chunk->code[offset];
     switch ((OpCode)instruction)
@@ -587,6 +719,10 @@ u32 Task::disassembleInstruction(u32 offset)
         return byteInstruction("LOCAL_SET", offset);
     case OpCode::LOCAL_GET:
         return byteInstruction("LOCAL_GET", offset);
+    case OpCode::ENGINE_SET:
+        return byteInstruction("ENGINE_SET", offset);
+    case OpCode::ENGINE_GET:
+        return byteInstruction("ENGINE_GET", offset);
 
     case OpCode::SWITCH:
         return simpleInstruction("SWITCH", offset);
@@ -605,12 +741,61 @@ u32 Task::disassembleInstruction(u32 offset)
     case OpCode::JUMP_IF_TRUE:
         return jumpInstruction("JUMP_IF_TRUE", 1, offset);
 
+    case OpCode::POP_JUMP_IF_FALSE:
+        return jumpInstruction("POP_JUMP_IF_FALSE", 1, offset);
+    case OpCode::JUMP_IF_NOT_LESS:
+        return jumpInstruction("JUMP_IF_NOT_LESS", 1, offset);
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+        return jumpInstruction("JUMP_IF_NOT_LESS_EQUAL", 1, offset);
+    case OpCode::JUMP_IF_NOT_GREATER:
+        return jumpInstruction("JUMP_IF_NOT_GREATER", 1, offset);
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+        return jumpInstruction("JUMP_IF_NOT_GREATER_EQUAL", 1, offset);
+
+    case OpCode::LOCAL_STORE:
+        return byteInstruction("LOCAL_STORE", offset);
+    case OpCode::ENGINE_STORE:
+        return byteInstruction("ENGINE_STORE", offset);
+    case OpCode::GLOBAL_STORE:
+        return varInstruction("GLOBAL_STORE", offset);
+    case OpCode::ADD_LOCAL:
+        return byteInstruction("ADD_LOCAL", offset);
+    case OpCode::ADD_GLOBAL:
+        return varInstruction("ADD_GLOBAL", offset);
+    case OpCode::ADD_CONST:
+        return constantInstruction("ADD_CONST", offset);
+    case OpCode::ADD_LOCAL_LOCAL:
+        return twoByteInstruction("ADD_LOCAL_LOCAL", offset);
+    case OpCode::LOCAL_INC_CONST:
+        return twoByteInstruction("LOCAL_INC_CONST", offset);
+
+    case OpCode::ADD_NUM:
+        return simpleInstruction("ADD_NUM", offset);
+    case OpCode::SUBTRACT_NUM:
+        return simpleInstruction("SUBTRACT_NUM", offset);
+    case OpCode::MULTIPLY_NUM:
+        return simpleInstruction("MULTIPLY_NUM", offset);
+    case OpCode::DIVIDE_NUM:
+        return simpleInstruction("DIVIDE_NUM", offset);
+    case OpCode::EQUAL_NUM:
+        return simpleInstruction("EQUAL_NUM", offset);
+    case OpCode::NOT_EQUAL_NUM:
+        return simpleInstruction("NOT_EQUAL_NUM", offset);
+    case OpCode::LESS_NUM:
+        return simpleInstruction("LESS_NUM", offset);
+    case OpCode::LESS_EQUAL_NUM:
+        return simpleInstruction("LESS_EQUAL_NUM", offset);
+    case OpCode::GREATER_NUM:
+        return simpleInstruction("GREATER_NUM", offset);
+    case OpCode::GREATER_EQUAL_NUM:
+        return simpleInstruction("GREATER_EQUAL_NUM", offset);
+
     case OpCode::CALL:
-        return byteInstruction("CALL_NATIVE", offset);
+        return callInstruction("CALL_NATIVE", offset);
     case OpCode::CALL_SCRIPT:
-        return byteInstruction("CALL_SCRIPT", offset);
+        return callInstruction("CALL_SCRIPT", offset);
     case OpCode::CALL_PROCESS:
-        return byteInstruction("CALL_PROCESS", offset);
+        return callInstruction("CALL_PROCESS", offset);
 
     case OpCode::RETURN_DEF:
         return byteInstruction("DEF_RETURN", offset);
@@ -634,6 +819,12 @@ u32 Task::byteInstruction(const char *name, u32 offset)
     return offset + 2;
 }
 
+u32 Task::twoByteInstruction(const char *name, u32 offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
 u32 Task::jumpInstruction(const char *name, u32 sign, u32 offset)
 {
     u16 jump = (u16)chunk->code[offset + 1] << 8;
@@ -644,18 +835,35 @@ u32 Task::jumpInstruction(const char *name, u32 sign, u32 offset)
 
 u32 Task::varInstruction(const char *name, u32 offset)
 {
-    u8 constant = chunk->code[offset + 1];
+    u16 slot = (u16)chunk->code[offset + 1] << 8;
+    slot |= chunk->code[offset + 2];
 
-    printf("%-16s %4d '", name, constant);
-    Value value = constants[constant];
-    debugValue(value);
-    printf("'\n");
+    printf("%-16s %4d '%s'\n", name, slot, vm->globalNames[slot].c_str());
 
-    return offset + 2;
+    return offset + 3;
 }
 
 
 
+u32 Task::callInstruction(const char *name, u32 offset)
+{
+    u16 index = (u16)chunk->code[offset + 1] << 8;
+    index |= chunk->code[offset + 2];
+    u8 argCount = chunk->code[offset + 3];
+
+    const char *target = "?";
+    u8 instruction = chunk->code[offset];
+    if (instruction == OpCode::CALL)
+        target = vm->natives[index]->name.c_str();
+    else if (instruction == OpCode::CALL_SCRIPT && vm->functions[index])
+        target = vm->functions[index]->name.c_str();
+    else if (instruction == OpCode::CALL_PROCESS && vm->processes[index])
+        target = vm->processes[index]->name.c_str();
+
+    printf("%-16s %4d '%s' (%d args)\n", name, index, target, argCount);
+    return offset + 4;
+}
+
 u32 Task::constantInstruction(const char *name, u32 offset)
 {
 
@@ -702,36 +910,18 @@ void Task::Done()
 //***************************************************************************************************************** */
 //***************************************************************************************************************** */
 //***************************************************************************************************************** */
-static const size_t instructionsPerFrame = 30;
-static const u16 fps = 60;
-
-
-u8 Task::Pause()
-{
-     if (state == PAUSED) 
-     {
-        clock_t now = clock();
-        double elapsed = (double)(now - last_frame_time) / CLOCKS_PER_SEC * 1000;
-        double frame_duration = 1000 / fps;
-
-
-      //  printf("Elapsed: %f Frame duration: %f\n", elapsed, frame_duration);
-        
-        if (elapsed >= frame_counter * frame_duration) 
-        {
-            state = RUNNING;
-            frame_counter = 0;
-            last_frame_time = now;
-           // return RUNNING;
-        } else 
-        {
-            return PAUSED;
-        }
-    
+#ifdef OPCODE_PAIR_STATS
+extern u64 opcodePairs[OpCode::COUNT][OpCode::COUNT];
+static u8 lastOpcode = OpCode::ZERO;
+#define COUNT_PAIR(op)                       \
+    if ((op) < OpCode::COUNT)                \
+    {                                        \
+        opcodePairs[lastOpcode][(op)]++;     \
+        lastOpcode = (op);                   \
     }
-
-    return RUNNING;
-}
+#else
+#define COUNT_PAIR(op)
+#endif
 
 u8 Task::Run()
 {
@@ -739,10 +929,23 @@ u8 Task::Run()
     if (PanicMode)         return ABORTED;
     if (isReturned)        return FINISHED;
 
+    // verified chunks run in the loop without stack checks, AOT or JIT compiled
+    // ones in their native body; a call or return between them switches loops
+    for (;;)
+    {
+        Chunk *top = frames[frameCount - 1].task->chunk;
+        AotBody body = __atomic_load_n(&top->native, __ATOMIC_RELAXED);
+        u8 result = body ? Aot::run(this, body) : top->verified ? execute<false>() : execute<true>();
+        if (result != SWITCH_LOOP)
+        {
+            return result;
+        }
+    }
+}
 
-
-
-
+template <bool CHECKED>
+u8 Task::execute()
+{
  Frame* frame = &frames[frameCount - 1];        
 
 #define READ_BYTE() (*frame->ip++)
@@ -750,369 +953,601 @@ u8 Task::Run()
     (frame->ip += 2,        \
      (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->task->constants[READ_BYTE()])
+// opcodes of shared bytecode may be quickened by another thread meanwhile,
+// either form is valid; operand bytes never change
+#define READ_OPCODE() __atomic_load_n(frame->ip++, __ATOMIC_RELAXED)
+
+    // the stack pointer lives in sp while Run executes. Anything else that
+    // works on the task's stack (push/pop, the op_* helpers, natives, GC roots)
+    // sees stackTop, so it is written back before those and on every return
+    Value *sp = stackTop;
+    Value *stackEnd = stack + stackCapacity;
+#define SAVE_STACK() (stackTop = sp)
+#define LOAD_STACK() (sp = stackTop, stackEnd = stack + stackCapacity)
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+// a full stack goes through push(), which grows it or reports the overflow;
+// verified code reserved its depth when it entered the frame
+#define PUSH(value)                      \
+    {                                    \
+        Value pushed = (value);          \
+        if (!CHECKED || sp < stackEnd)   \
+        {                                \
+            *sp++ = pushed;              \
+        }                                \
+        else                             \
+        {                                \
+            SAVE_STACK();                \
+            if (!push(pushed))           \
+                return ABORTED;          \
+            LOAD_STACK();                \
+        }                                \
+    }
+
+// calls and loop back edges heat a chunk up, Jit::tierUp compiles it between
+// Runs; a count lost to another worker only delays that
+#ifdef USE_JIT
+#define COUNT_HOT(chunk)                                                     \
+    {                                                                        \
+        u32 heat = __atomic_load_n(&(chunk)->hotness, __ATOMIC_RELAXED) + 1; \
+        __atomic_store_n(&(chunk)->hotness, heat, __ATOMIC_RELAXED);         \
+        if (heat == JIT_THRESHOLD && vm->jit)                                \
+            __atomic_store_n(&vm->jit->pending, true, __ATOMIC_RELAXED);     \
+    }
+#else
+#define COUNT_HOT(chunk)
+#endif
+
+#define RESERVE_FRAME()                                                           \
+    if (!CHECKED && frame->slots + frame->task->chunk->maxStack > stackEnd)       \
+    {                                                                             \
+        SAVE_STACK();                                                             \
+        if (!growStack((u32)(frame->slots + frame->task->chunk->maxStack - sp)))  \
+        {                                                                         \
+            vm->Error("Stack overflow in '%s'", frame->task->name.c_str());      \
+            return ABORTED;                                                       \
+        }                                                                         \
+        LOAD_STACK();                                                             \
+    }
+// the new top frame runs in the other loop: count the instruction as NEXT
+// does and let Run enter that one
+#define HAND_OVER()                                                      \
+    {                                                                    \
+        SAVE_STACK();                                                    \
+        if (++instructionsExecuted >= instructionsPerFrame)              \
+        {                                                                \
+            resumeBudget = instructionsExecuted - instructionsPerFrame;  \
+            state = RUNNING;                                             \
+            return RUNNING;                                              \
+        }                                                                \
+        resumeBudget = instructionsExecuted;                             \
+        return SWITCH_LOOP;                                              \
+    }
 
-    u32 instructionsExecuted=0;
+// while processes run on worker threads, anything touching shared state stops
+// here and resumes at the same instruction in the serial phase of Update
+#define DEFER_IN_PARALLEL(size)                       \
+    if (vm->parallelPhase)                            \
+    {                                                 \
+        frame->ip -= (size);                          \
+        resumeBudget = instructionsExecuted;          \
+        SAVE_STACK();                                 \
+        return DEFERRED;                              \
+    }
+
+    u32 instructionsExecuted = resumeBudget;
+    resumeBudget = 0;
 
     
-     if (state == PAUSED) 
-     {
-        clock_t now = clock();
-        double elapsed = (double)(now - last_frame_time) / CLOCKS_PER_SEC * 1000;
-        double frame_duration = 1000 / fps;
+    // a process only runs again once Update woke it from the timer wheel,
+    // the main task resumes straight away
+    if (state == PAUSED)
+    {
+        state = RUNNING;
+    }
+    RESERVE_FRAME();
+
+    u8 instruction;
+
+#ifdef USE_COMPUTED_GOTO
+
+    // one label per opcode, every other byte lands on L_UNKNOWN. Filled in
+    // the initializer of a local static, so the first Run of each instance
+    // builds it once even when worker threads get there together
+    static void *const *const dispatchTable = ({
+        static void *table[256];
+        for (int i = 0; i < 256; i++)
+            table[i] = &&L_UNKNOWN;
+
+#define TARGET(op) table[OpCode::op] = &&L_##op;
+        TARGET(CONST) TARGET(PUSH) TARGET(POP) TARGET(TRUE) TARGET(FALSE)
+        TARGET(HALT) TARGET(PROGRAM) TARGET(PRINT) TARGET(NOW)
+        TARGET(ADD) TARGET(SUBTRACT) TARGET(MULTIPLY) TARGET(DIVIDE)
+        TARGET(MOD) TARGET(POWER) TARGET(NEGATE) TARGET(NOT)
+        TARGET(EQUAL) TARGET(EVAL_EQUAL) TARGET(NOT_EQUAL)
+        TARGET(LESS) TARGET(LESS_EQUAL) TARGET(GREATER) TARGET(GREATER_EQUAL)
+        TARGET(XOR)
+        TARGET(GLOBAL_DEFINE) TARGET(GLOBAL_ASSIGN) TARGET(GLOBAL_GET)
+        TARGET(LOCAL_SET) TARGET(LOCAL_GET) TARGET(ENGINE_GET) TARGET(ENGINE_SET)
+        TARGET(JUMP_IF_FALSE) TARGET(JUMP_IF_TRUE) TARGET(JUMP) TARGET(DUP) TARGET(JUMP_BACK)
+        TARGET(CALL) TARGET(CALL_SCRIPT) TARGET(RETURN) TARGET(CALL_PROCESS) TARGET(RETURN_PROCESS)
+        TARGET(FRAME) TARGET(CLONE) TARGET(NIL)
+        TARGET(POP_JUMP_IF_FALSE) TARGET(JUMP_IF_NOT_LESS) TARGET(JUMP_IF_NOT_LESS_EQUAL)
+        TARGET(JUMP_IF_NOT_GREATER) TARGET(JUMP_IF_NOT_GREATER_EQUAL)
+        TARGET(LOCAL_STORE) TARGET(ENGINE_STORE) TARGET(GLOBAL_STORE)
+        TARGET(ADD_LOCAL) TARGET(ADD_GLOBAL) TARGET(ADD_CONST) TARGET(ADD_LOCAL_LOCAL) TARGET(LOCAL_INC_CONST)
+        TARGET(ADD_NUM) TARGET(SUBTRACT_NUM) TARGET(MULTIPLY_NUM) TARGET(DIVIDE_NUM)
+        TARGET(EQUAL_NUM) TARGET(NOT_EQUAL_NUM) TARGET(LESS_NUM) TARGET(LESS_EQUAL_NUM)
+        TARGET(GREATER_NUM) TARGET(GREATER_EQUAL_NUM)
+#undef TARGET
+        table;
+    });
+
+#define CASE(op) L_##op:
+#define CASE_DEFAULT L_UNKNOWN:
+#define DISPATCH()                                       \
+    {                                                    \
+        instruction = READ_OPCODE();                     \
+        COUNT_PAIR(instruction);                         \
+        goto *dispatchTable[instruction];                \
+    }
+#define NEXT()                                                               \
+    {                                                                        \
+        if (++instructionsExecuted >= instructionsPerFrame)                  \
+        {                                                                    \
+            resumeBudget = instructionsExecuted - instructionsPerFrame;      \
+            state = RUNNING;                                                 \
+            SAVE_STACK();                                                    \
+            return RUNNING;                                                  \
+        }                                                                    \
+        DISPATCH();                                                          \
+    }
 
+#define REDISPATCH() DISPATCH()
 
-      //  printf("%s Elapsed: %f Frame duration: %f total: %f  %d\n",name.c_str(), elapsed, frame_duration,(frame_counter * frame_duration),*frame->ip);
-        
-        if (elapsed >= frame_counter * frame_duration) 
-        {
-            state = RUNNING;
-            frame_counter = 0;
-            last_frame_time = now;
-        } else 
+    DISPATCH();
+    {
         {
-           state = PAUSED;
-           return PAUSED;
-        }
-     } 
-
+#else
+
+#define CASE(op) case OpCode::op:
+#define CASE_DEFAULT default:
+#define NEXT() break
+#define REDISPATCH() continue
+#endif
+
+// quickening: the opcode just read is rewritten to op and run again, without
+// counting it twice. Generic arithmetic and compares turn into their _NUM form
+// when both operands are numbers, a _NUM op whose guard fails turns back.
+#define REWRITE(op)                                                      \
+    {                                                                    \
+        frame->ip--;                                                     \
+        __atomic_store_n(frame->ip, (u8)OpCode::op, __ATOMIC_RELAXED);   \
+        REDISPATCH();                                                    \
+    }
+#ifndef NO_QUICKENING
+#define QUICKEN_NUMBERS(op)                             \
+    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))       \
+    {                                                   \
+        REWRITE(op);                                    \
+    }
+#else
+#define QUICKEN_NUMBERS(op)
+#endif
+
+// a superinstruction counts as the n instructions it replaced, and what it
+// runs past the end of the budget is charged to the next Run, so processes
+// get exactly as far per frame as with the unfused code
+#define NEXT_FUSED(n)                           \
+    {                                           \
+        instructionsExecuted += (n) - 1;        \
+        NEXT();                                 \
+    }
 
+#ifndef USE_COMPUTED_GOTO
 
      while (instructionsExecuted < instructionsPerFrame)
-   // for (;;)
     {
 
-        u8 instruction = READ_BYTE();
-        int line = frame->task->chunk->lines[instruction];
+        instruction = READ_OPCODE();
+        COUNT_PAIR(instruction);
 
         switch ((OpCode)instruction)
         {
-        case OpCode::CONST:
+#endif
+        CASE(CONST)
         {
 
             Value value = READ_CONSTANT();
-            push(value);
+            PUSH(value);
 
-            break;
+            NEXT();
         }
-        case OpCode::PUSH:
+        CASE(PUSH)
         {
 
             Value value = READ_CONSTANT();
-            push(std::move(value));
-            break;
+            PUSH(value);
+            NEXT();
         }
-        case OpCode::POP:
+        CASE(POP)
         {
-            pop();
+            sp--;
 
              
-            break;
+            NEXT();
          }
-         case OpCode::TRUE:
+         CASE(TRUE)
          {
-             push(std::move(BOOLEAN(true)));
-             break;
+             PUSH(BOOLEAN(true));
+             NEXT();
          }
-         case OpCode::FALSE:
+         CASE(FALSE)
          {
-             push(std::move(BOOLEAN(false)));
-             break;
+             PUSH(BOOLEAN(false));
+             NEXT();
          }
 
-         case OpCode::HALT:
+         CASE(HALT)
          {
              vm->Warning("Halt!");
              isReturned = true;
              state = ABORTED;
+             SAVE_STACK();
              return state;
          }
-         case OpCode::PROGRAM:
+         CASE(PROGRAM)
          {
              Value constant = READ_CONSTANT();
              if (!IS_STRING(constant))
              {
-                 vm->Error("Program  name must be string [line %d]", line);
+                 vm->Error("Program  name must be string [line %d]", currentLine());
                 state = ABORTED;
+                    SAVE_STACK();
                     return state;
              }
-             break;
+             NEXT();
          }
-         case OpCode::PRINT:
+         CASE(PRINT)
          {
-             Value value = pop();
+             DEFER_IN_PARALLEL(1);
+             Value value = POP();
              // printValue(std::move(value));
              debugValue(std::move(value));
              printf("\n");
-             break;
+             NEXT();
          }
-         case OpCode::NOW:
+         CASE(NOW)
          {
-             push(std::move(NUMBER(time_now())));
-             break;
+             PUSH(NUMBER(time_now()));
+             NEXT();
          }
-         case OpCode::ADD:
+         CASE(ADD)
          {
+             QUICKEN_NUMBERS(ADD_NUM);
+             SAVE_STACK();
              u8 result = op_add();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
-         case OpCode::SUBTRACT:
+         CASE(SUBTRACT)
          {
-             Value b = pop();
-             Value a = pop();
+             QUICKEN_NUMBERS(SUBTRACT_NUM);
+             Value b = POP();
+             Value a = POP();
              if (IS_NUMBER(a) && IS_NUMBER(b))
              {
                  Value result = NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
-                 push(std::move(result));
+                 PUSH(result);
              }
              else
              {
-                 vm->Error("invalid  'subtract' operands [line %d]", line);
+                 vm->Error("invalid  'subtract' operands [line %d]", currentLine());
 
              state = ABORTED;
+             SAVE_STACK();
              return state;
              }
 
-             break;
+             NEXT();
          }
-         case OpCode::MULTIPLY:
+         CASE(MULTIPLY)
          {
-             Value b = pop();
-             Value a = pop();
+             QUICKEN_NUMBERS(MULTIPLY_NUM);
+             Value b = POP();
+             Value a = POP();
              if (IS_NUMBER(a) && IS_NUMBER(b))
              {
                  Value result = NUMBER(AS_NUMBER(a) * AS_NUMBER(b));
-                 push(std::move(result));
+                 PUSH(result);
              }
              else
              {
-                 vm->Error("invalid 'multiply' operands [line %d]", line);
+                 vm->Error("invalid 'multiply' operands [line %d]", currentLine());
+                 SAVE_STACK();
                  return ABORTED;
              }
-             break;
+             NEXT();
          }
-         case OpCode::DIVIDE:
+         CASE(DIVIDE)
          {
-             Value b = pop();
-             Value a = pop();
+             QUICKEN_NUMBERS(DIVIDE_NUM);
+             Value b = POP();
+             Value a = POP();
              if (IS_NUMBER(a) && IS_NUMBER(b))
              {
                  if (AS_NUMBER(b) == 0)
                  {
-                     vm->Error("division by zero [line %d]", line);
+                     vm->Error("division by zero [line %d]", currentLine());
 
+                     SAVE_STACK();
                      return ABORTED;
                  }
                  Value result = NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
-                 push(std::move(result));
+                 PUSH(result);
              }
              else
              {
-                 vm->Error("invalid 'divide' operands [line %d]", line);
+                 vm->Error("invalid 'divide' operands [line %d]", currentLine());
 
+                 SAVE_STACK();
                  return ABORTED;
              }
-             break;
+             NEXT();
          }
-         case OpCode::MOD:
+         CASE(MOD)
          {
-             u8 result = op_mod(line);
+             SAVE_STACK();
+             u8 result = op_mod();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
-         case OpCode::POWER:
+         CASE(POWER)
          {
-             Value b = pop();
-             Value a = pop();
+             Value b = POP();
+             Value a = POP();
              if (IS_NUMBER(a) && IS_NUMBER(b))
              {
                  Value result = NUMBER(pow(AS_NUMBER(a), AS_NUMBER(b)));
-                 push(std::move(result));
+                 PUSH(result);
              }
              else
              {
-                 vm->Error("invalid 'power' operands [line %d]", line);
+                 vm->Error("invalid 'power' operands [line %d]", currentLine());
 
+                 SAVE_STACK();
                  return ABORTED;
              }
-             break;
+             NEXT();
          }
-         case OpCode::NEGATE:
+         CASE(NEGATE)
          {
-             Value value = pop();
+             Value value = POP();
              if (IS_NUMBER(value))
              {
                  Value result = NUMBER(-AS_NUMBER(value));
-                 push(std::move(result));
+                 PUSH(result);
              }
              else
              {
                  vm->Error("invalid 'negate' operands, Operand must be a number.");
 
+                 SAVE_STACK();
                  return ABORTED;
              }
-             break;
+             NEXT();
          }
-         case OpCode::NOT:
+         CASE(NOT)
          {
-             push(std::move(BOOLEAN(isFalsey(pop()))));
-             break;
+             PUSH(BOOLEAN(isFalsey(POP())));
+             NEXT();
          }
-         case OpCode::EQUAL:
+         CASE(EQUAL)
          {
-             Value b = pop();
-             Value a = pop();
+             QUICKEN_NUMBERS(EQUAL_NUM);
+             Value b = POP();
+             Value a = POP();
              bool result = MatchValue(a, b);
-             push(std::move(BOOLEAN(result)));
+             PUSH(BOOLEAN(result));
 
-             break;
+             NEXT();
          }
-         case OpCode::EVAL_EQUAL:
+         CASE(EVAL_EQUAL)
          {
-             Value b = peek(0);
-             Value a = peek(1);
+             Value b = PEEK(0);
+             Value a = PEEK(1);
              bool result = MatchValue(a, b);
-             push(std::move(BOOLEAN(result)));
-             break;
+             PUSH(BOOLEAN(result));
+             NEXT();
          }
-         case OpCode::NOT_EQUAL:
+         CASE(NOT_EQUAL)
          {
+             QUICKEN_NUMBERS(NOT_EQUAL_NUM);
+             SAVE_STACK();
              u8 result = op_not_equal();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
-         case OpCode::LESS:
+         CASE(LESS)
          {
+             QUICKEN_NUMBERS(LESS_NUM);
+             SAVE_STACK();
              u8 result = op_less();
+             LOAD_STACK();
              if (result != OK)
                  return result;
 
-             break;
+             NEXT();
          }
-         case OpCode::LESS_EQUAL:
+         CASE(LESS_EQUAL)
          {
+             QUICKEN_NUMBERS(LESS_EQUAL_NUM);
+             SAVE_STACK();
              u8 result = op_less_equal();
+             LOAD_STACK();
              if (result != OK)
                  return result;
 
-             break;
+             NEXT();
          }
-         case OpCode::GREATER:
+         CASE(GREATER)
          {
+             QUICKEN_NUMBERS(GREATER_NUM);
+             SAVE_STACK();
              u8 result = op_greater();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
-         case OpCode::GREATER_EQUAL:
+         CASE(GREATER_EQUAL)
          {
+             QUICKEN_NUMBERS(GREATER_EQUAL_NUM);
+             SAVE_STACK();
              u8 result = op_greater_equal();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
 
-         case OpCode::XOR:
+#define NUMBER_OP(generic, expression)                             \
+    {                                                              \
+        Value b = PEEK(0);                                         \
+        Value a = PEEK(1);                                         \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                        \
+        {                                                          \
+            REWRITE(generic);                                      \
+        }                                                          \
+        double x = AS_NUMBER(a);                                   \
+        double y = AS_NUMBER(b);                                   \
+        sp--;                                                      \
+        sp[-1] = expression;                                       \
+        NEXT();                                                    \
+    }
+
+         CASE(ADD_NUM)
+         NUMBER_OP(ADD, NUMBER(x + y))
+         CASE(SUBTRACT_NUM)
+         NUMBER_OP(SUBTRACT, NUMBER(x - y))
+         CASE(MULTIPLY_NUM)
+         NUMBER_OP(MULTIPLY, NUMBER(x * y))
+         CASE(EQUAL_NUM)
+         NUMBER_OP(EQUAL, BOOLEAN(MatchNumber(x, y)))
+         CASE(NOT_EQUAL_NUM)
+         NUMBER_OP(NOT_EQUAL, BOOLEAN(x != y))
+         CASE(LESS_NUM)
+         NUMBER_OP(LESS, BOOLEAN(x < y))
+         CASE(LESS_EQUAL_NUM)
+         NUMBER_OP(LESS_EQUAL, BOOLEAN(x <= y))
+         CASE(GREATER_NUM)
+         NUMBER_OP(GREATER, BOOLEAN(x > y))
+         CASE(GREATER_EQUAL_NUM)
+         NUMBER_OP(GREATER_EQUAL, BOOLEAN(x >= y))
+#undef NUMBER_OP
+         CASE(DIVIDE_NUM)
+         {
+             Value b = PEEK(0);
+             Value a = PEEK(1);
+             if (!IS_NUMBER(a) || !IS_NUMBER(b))
+             {
+                 REWRITE(DIVIDE);
+             }
+             if (AS_NUMBER(b) == 0)
+             {
+                 vm->Error("division by zero [line %d]", currentLine());
+                 SAVE_STACK();
+                 return ABORTED;
+             }
+             sp--;
+             sp[-1] = NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
+             NEXT();
+         }
+
+         CASE(XOR)
          {
+             SAVE_STACK();
              u8 result = op_xor();
+             LOAD_STACK();
              if (result != OK)
                  return result;
-             break;
+             NEXT();
          }
 
-         case OpCode::GLOBAL_DEFINE:
+         CASE(GLOBAL_DEFINE)
          {
+             DEFER_IN_PARALLEL(1);
+             u16 slot = READ_SHORT();
+             Value value = PEEK(0);
 
-             Value constant = READ_CONSTANT();
-             if (!IS_STRING(constant))
-             {
-                 vm->Error("Variable  name must be string [line %d]", line);
-
-                 return ABORTED;
-             }
-             const char *name = AS_RAW_STRING(constant);
-             Value value = peek();
-
-             if (!vm->global->define(name, value))
+             if (!IS_UNDEFINED(vm->globals[slot]))
              {
-                 vm->Error("Already a global variable with '%s' name.", name);
+                 vm->Error("Already a global variable with '%s' name.", vm->globalNames[slot].c_str());
+                 SAVE_STACK();
                  return ABORTED;
              }
-             pop();
-             //  printValue(value);
+             WRITE_BARRIER(value);
+             vm->globals[slot] = value;
+             sp--;
 
-             break;
+             NEXT();
          }
 
-         case OpCode::GLOBAL_ASSIGN:
+         CASE(GLOBAL_ASSIGN)
          {
-             Value constant = READ_CONSTANT();
-             if (!IS_STRING(constant))
-             {
-                 vm->Error("Variable  name must be string [line %d]", line);
+             DEFER_IN_PARALLEL(1);
+             u16 slot = READ_SHORT();
 
-                 return ABORTED;
+             if (IS_UNDEFINED(vm->globals[slot]))
+             {
+                 vm->Warning("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), currentLine());
              }
-             const char *name = AS_RAW_STRING(constant);
-             Value value = peek();
-
-             if (!vm->global->assign(name, value))
+             else
              {
-                 vm->Warning("Undefined global variable '%s' [line %d]", name, line);
+                 // the old value too, a scanned stack may still hold it
+                 WRITE_BARRIER(vm->globals[slot]);
+                 WRITE_BARRIER(PEEK(0));
+                 vm->globals[slot] = PEEK(0);
              }
 
-             break;
+             NEXT();
          }
-         case OpCode::GLOBAL_GET:
+         CASE(GLOBAL_GET)
          {
-             Value constant = READ_CONSTANT();
-             if (!IS_STRING(constant))
-             {
-                 vm->Error("Variable  names must be string [line %d]", line);
-
-                 return ABORTED;
-             }
-             const char *name = AS_RAW_STRING(constant);
-             Value value;
+             DEFER_IN_PARALLEL(1);
+             u16 slot = READ_SHORT();
+             Value value = vm->globals[slot];
 
-             if (vm->global->get(name, value))
+             if (IS_UNDEFINED(value))
              {
-                 push(value);
-             }
-             else
-             {
-                 vm->Error("Undefined global variable '%s' [line %d]", name, line);
+                 vm->Error("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), currentLine());
 
+                 SAVE_STACK();
                  return ABORTED;
              }
+             PUSH(value);
 
-             break;
+             NEXT();
          }
-         case OpCode::LOCAL_SET:
+         CASE(LOCAL_SET)
          {
              u8 slot = READ_BYTE();
 
-             if (type == TaskType::TPROCESS)
-             {
-                 if (slot == IID)
-                 {
-                     vm->Error("Variable  ID is read-only");
-                     return ABORTED;
-                 }
-                 
-             }
-
-             frame->slots[slot] = peek(0);
+             WRITE_BARRIER(PEEK(0));
+             frame->slots[slot] = PEEK(0);
 
             //   printf("local set variable %d", slot);
           //     printValue(frame->slots[slot]);
 
-             break;
+             NEXT();
          }
-         case OpCode::LOCAL_GET:
+         CASE(LOCAL_GET)
          {
              u8 slot = READ_BYTE();
            
@@ -1120,312 +1555,497 @@ u8 Task::Run()
            //  INFO("local get variable %d ", slot);
            //  printValue(frame->slots[slot]);
             
-             push(frame->slots[slot]);
+             PUSH(frame->slots[slot]);
 
-             break;
+             NEXT();
          }
 
-         case OpCode::JUMP_IF_FALSE:
+         CASE(ENGINE_GET)
+         {
+             u8 local = READ_BYTE();
+             Process *process = static_cast<Process *>(this);
+             PUSH(NUMBER(vm->engine.column(local)[process->instance.slot]));
+             NEXT();
+         }
+         CASE(ENGINE_SET)
+         {
+             u8 local = READ_BYTE();
+             if (local == IID)
+             {
+                 vm->Error("Variable  ID is read-only");
+                 SAVE_STACK();
+                 return ABORTED;
+             }
+             Value value = PEEK(0);
+             if (!IS_NUMBER(value))
+             {
+                 vm->Error("Variable '%s' must be a number", engineLocalNames[local]);
+                 SAVE_STACK();
+                 return ABORTED;
+             }
+             Process *process = static_cast<Process *>(this);
+             vm->engine.column(local)[process->instance.slot] = AS_NUMBER(value);
+             NEXT();
+         }
+
+         CASE(JUMP_IF_FALSE)
          {
              u16 offset = READ_SHORT();
-             Value value = peek(0);
+             Value value = PEEK(0);
              if (isFalsey(value))
              {
                  frame->ip += offset;
                  //   printf("offset: %d\n", offset);
              }
-             break;
+             NEXT();
          }
-         case OpCode::JUMP_IF_TRUE:
+         CASE(JUMP_IF_TRUE)
          {
              u16 offset = READ_SHORT();
              frame->ip += offset;
-             break;
+             NEXT();
          }
-         case OpCode::JUMP:
+         CASE(JUMP)
          {
              u16 offset = READ_SHORT();
              frame->ip += offset;
              //  printf("jump offset: %d\n", offset);
-             break;
+             NEXT();
          }
-         case OpCode::DUP:
+         CASE(DUP)
          {
-             Value value = peek(0);
-             push(value);
-             break;
+             Value value = PEEK(0);
+             PUSH(value);
+             NEXT();
          }
-         case OpCode::JUMP_BACK:
+         CASE(JUMP_BACK)
          {
              uint16_t offset = READ_SHORT();
              frame->ip -= offset;
-             break;
+             COUNT_HOT(frame->task->chunk);
+             NEXT();
          }
 
-         case OpCode::CALL:
+         // superinstructions (see Peephole.cpp): numbers take the fast path,
+         // anything else goes through the generic op they replaced
+         CASE(POP_JUMP_IF_FALSE)
          {
-             uint8_t argCount = READ_BYTE();
-             Value func = peek(argCount);
-             if (!IS_STRING(func))
+             u16 offset = READ_SHORT();
+             if (isFalsey(POP()))
              {
-                 vm->Error("Native Function name must be string [line %d]", line);
-                 printValue(func);
+                 frame->ip += offset;
+             }
+             NEXT_FUSED(2);
+         }
+
+#define COMPARE_JUMP(op, generic)                                  \
+    {                                                              \
+        u16 offset = READ_SHORT();                                 \
+        Value b = PEEK(0);                                         \
+        Value a = PEEK(1);                                         \
+        bool result;                                               \
+        if (IS_NUMBER(a) && IS_NUMBER(b))                          \
+        {                                                          \
+            sp -= 2;                                               \
+            result = AS_NUMBER(a) op AS_NUMBER(b);                 \
+        }                                                          \
+        else                                                       \
+        {                                                          \
+            SAVE_STACK();                                          \
+            u8 status = generic();                                 \
+            LOAD_STACK();                                          \
+            if (status != OK)                                      \
+                return status;                                     \
+            result = !isFalsey(POP());                             \
+        }                                                          \
+        if (!result)                                               \
+        {                                                          \
+            frame->ip += offset;                                   \
+        }                                                          \
+        NEXT_FUSED(3);                                             \
+    }
+
+         CASE(JUMP_IF_NOT_LESS)
+         COMPARE_JUMP(<, op_less)
+         CASE(JUMP_IF_NOT_LESS_EQUAL)
+         COMPARE_JUMP(<=, op_less_equal)
+         CASE(JUMP_IF_NOT_GREATER)
+         COMPARE_JUMP(>, op_greater)
+         CASE(JUMP_IF_NOT_GREATER_EQUAL)
+         COMPARE_JUMP(>=, op_greater_equal)
+#undef COMPARE_JUMP
+
+         CASE(LOCAL_STORE)
+         {
+             u8 slot = READ_BYTE();
+             Value value = POP();
+             WRITE_BARRIER(value);
+             frame->slots[slot] = value;
+             NEXT_FUSED(2);
+         }
+         CASE(ENGINE_STORE)
+         {
+             u8 local = READ_BYTE();
+             if (local == IID)
+             {
+                 vm->Error("Variable  ID is read-only");
+                 SAVE_STACK();
                  return ABORTED;
              }
-             Value result;
-             int popResult = -1;
-             vm->currentTask = this;
-             int count = vm->callNativeFunction(AS_RAW_STRING(func), (stackTop - argCount), argCount);
-             if (count == -1)
+             Value value = POP();
+             if (!IS_NUMBER(value))
              {
+                 vm->Error("Variable '%s' must be a number", engineLocalNames[local]);
+                 SAVE_STACK();
                  return ABORTED;
              }
-             if (count > 0)
+             Process *process = static_cast<Process *>(this);
+             vm->engine.column(local)[process->instance.slot] = AS_NUMBER(value);
+             NEXT_FUSED(2);
+         }
+         CASE(GLOBAL_STORE)
+         {
+             DEFER_IN_PARALLEL(1);
+             u16 slot = READ_SHORT();
+             Value value = POP();
+
+             if (IS_UNDEFINED(vm->globals[slot]))
              {
-                 popResult = count;
-                 result = peek();
+                 vm->Warning("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), currentLine());
              }
-             stackTop -= (argCount + 1) + popResult;
-             if (count > 0)
-                 push(std::move(result));
-            
-             break;
+             else
+             {
+                 WRITE_BARRIER(vm->globals[slot]);
+                 WRITE_BARRIER(value);
+                 vm->globals[slot] = value;
+             }
+             NEXT_FUSED(2);
+         }
+
+#define ADD_VALUE(value)                                           \
+    {                                                              \
+        Value &a = sp[-1];                                   \
+        if (IS_NUMBER(a) && IS_NUMBER(value))                      \
+        {                                                          \
+            a = NUMBER(AS_NUMBER(a) + AS_NUMBER(value));           \
+        }                                                          \
+        else                                                       \
+        {                                                          \
+            PUSH(value);                                           \
+            SAVE_STACK();                                          \
+            u8 status = op_add();                                  \
+            LOAD_STACK();                                          \
+            if (status != OK)                                      \
+                return status;                                     \
+        }                                                          \
+    }
+
+         CASE(ADD_LOCAL)
+         {
+             Value b = frame->slots[READ_BYTE()];
+             ADD_VALUE(b);
+             NEXT_FUSED(2);
+         }
+         CASE(ADD_GLOBAL)
+         {
+             DEFER_IN_PARALLEL(1);
+             u16 slot = READ_SHORT();
+             Value b = vm->globals[slot];
+             if (IS_UNDEFINED(b))
+             {
+                 vm->Error("Undefined global variable '%s' [line %d]", vm->globalNames[slot].c_str(), currentLine());
+                 SAVE_STACK();
+                 return ABORTED;
+             }
+             ADD_VALUE(b);
+             NEXT_FUSED(2);
+         }
+         CASE(ADD_CONST)
+         {
+             Value b = READ_CONSTANT();
+             ADD_VALUE(b);
+             NEXT_FUSED(2);
+         }
+         CASE(ADD_LOCAL_LOCAL)
+         {
+             PUSH(frame->slots[READ_BYTE()]);
+             Value b = frame->slots[READ_BYTE()];
+             ADD_VALUE(b);
+             NEXT_FUSED(3);
          }
-         case OpCode::CALL_SCRIPT:
+         CASE(LOCAL_INC_CONST)
          {
+             u8 slot = READ_BYTE();
+             Value b = READ_CONSTANT();
+             Value &a = frame->slots[slot];
+             if (IS_NUMBER(a) && IS_NUMBER(b))
+             {
+                 a = NUMBER(AS_NUMBER(a) + AS_NUMBER(b));
+             }
+             else
+             {
+                 PUSH(a);
+                 PUSH(b);
+                 SAVE_STACK();
+                 u8 status = op_add();
+                 LOAD_STACK();
+                 if (status != OK)
+                     return status;
+                 Value value = POP();
+                 WRITE_BARRIER(value);
+                 frame->slots[slot] = value;
+             }
+             NEXT_FUSED(5);
+         }
+#undef ADD_VALUE
 
-             int argCount = (int)READ_BYTE();
-             Value func = peek(argCount);
-             if (!IS_STRING(func))
+         CASE(CALL)
+         {
+             u16 index = READ_SHORT();
+             u8 argCount = READ_BYTE();
+             NativeFunctionObject *native = vm->natives[index];
+             if (!native->threadSafe)
+             {
+                 DEFER_IN_PARALLEL(4);
+             }
+
+             // natives push results through the vm, keep room for them; the
+             // stack doesn't grow under the args pointer while the native runs
+             SAVE_STACK();
+             if (!growStack(NATIVE_STACK_ROOM))
+             {
+                 vm->Error("Stack overflow calling '%s' [line %d]", native->name.c_str(), currentLine());
+                 return ABORTED;
+             }
+             Value *args = stackTop - argCount;
+             VirtualMachine::nativeTask = this;
+             int count = native->call(vm, argCount, args);
+             VirtualMachine::nativeTask = nullptr;
+             if (count == -1)
              {
-                 vm->Error("Function name must be string [line %d]", line);
-                 printValue(func);
                  return ABORTED;
              }
-             FunctionObject *callTask = nullptr;
-             if (!vm->getFunction(AS_RAW_STRING(func), &callTask))
+             if (count > stackTop - args - argCount)
              {
-                 vm->Error("Function '%s' not defined [line %d]", AS_RAW_STRING(func), line);
+                 vm->Error("Native '%s' returned more values than it pushed [line %d]", native->name.c_str(), currentLine());
                  return ABORTED;
              }
-             if (callTask->argsCount != argCount)
+             LOAD_STACK();
+             Value result = count > 0 ? PEEK(0) : NONE();
+             sp -= argCount + count;
+             PUSH(result);
+            
+             NEXT();
+         }
+         CASE(CALL_SCRIPT)
+         {
+             u16 index = READ_SHORT();
+             int argCount = (int)READ_BYTE();
+             FunctionObject *callTask = vm->functions[index];
+             COUNT_HOT(callTask->chunk);
+
+             if (!growFrames())
              {
-                 vm->Error("Function %s, Expected %d arguments but got %d [line %d]", AS_RAW_STRING(func), callTask->argsCount, argCount, line);
+                 vm->Error("Frames  overflow .");
+                 SAVE_STACK();
                  return ABORTED;
              }
 
              frame = &frames[frameCount++];
              frame->task = callTask;
              frame->ip = callTask->chunk->code;
-             frame->slots = stackTop - argCount - 1;
-
-             callTask->disassembleCode(callTask->name.c_str());
-
-             if (frameCount == MAX_FRAMES)
+             frame->slots = sp - argCount;
+             if (callTask->chunk->verified == CHECKED || __atomic_load_n(&callTask->chunk->native, __ATOMIC_RELAXED))
              {
-                 vm->Error("Frames  overflow .");
-                 return ABORTED;
+                 HAND_OVER();
              }
-             break;
+             RESERVE_FRAME();
+             NEXT();
          }
-         case OpCode::RETURN:
+         CASE(RETURN)
          {
 
              // PrintStack();
-             Value result = pop();
+             Value result = POP();
              frameCount--;
              if (frameCount == 0)
              {
                  isReturned = true;
                  INFO("main %s", frame->task->name.c_str());
+                 SAVE_STACK();
                  PrintStack();
-                 pop();
+                 stackTop = stack;
                  state = TERMINATED;
                  return TERMINATED;
              }
              //  INFO("return %s", frame->task->name.c_str());
-             frame->task->exitScope(line);
-             stackTop = frame->slots;
-             push(result);
+             sp = frame->slots;
+             PUSH(result);
              frame = &frames[frameCount - 1];
+             if (frame->task->chunk->verified == CHECKED || __atomic_load_n(&frame->task->chunk->native, __ATOMIC_RELAXED))
+             {
+                 HAND_OVER();
+             }
 
-             break;
+             NEXT();
          }
-         case OpCode::CALL_PROCESS:
+         CASE(CALL_PROCESS)
          {
-
+             DEFER_IN_PARALLEL(1);
+             u16 index = READ_SHORT();
              u8 argCount = READ_BYTE();
-             Value func = peek(argCount);
-             if (!IS_STRING(func))
-             {
-                 vm->Warning("Process name must be a string");
-                 printValue(func);
+             Task *callTask = vm->processes[index];
 
-                 return ABORTED;
-             }
-             const char *name = AS_RAW_STRING(func);
-             Task *callTask = vm->getTask(AS_RAW_STRING(func));
-             if (!callTask)
-             {
-                 pop(argCount);
-                 vm->Error("Process '%s' not defined [line %d]", AS_RAW_STRING(func), line);
+             // the instance runs the declaring task's code and constants in place,
+             // it only owns its stack, frames and instance data
+             Process *process = vm->AddProcess(callTask->name.c_str());
 
-                 return ABORTED;
-             }
-             if (callTask->argsCount != argCount)
+             // slots for id, graph, x, y (their values live in the engine
+             // columns), then the arguments as the first script locals
+             for (int i = 0; i < DEFAULT_COUNT; i++)
              {
-                 vm->Error("Process %s, Expected %ld arguments but got %ld [line %d]", AS_RAW_STRING(func), callTask->argsCount, argCount, line);
-
-                 return ABORTED;
+                 process->push(NONE());
              }
-
-             // INFO("Process CALL %s args %d chunk %d", name ,callTask->argsCount,callTask->chunk->count);
-             Process *process = vm->AddProcess(name);
-             process->chunk = new Chunk(callTask->chunk);
-            
-            
-             process->push(INTEGER(process->ID));
-             process->push(INTEGER(100));
-             process->push(NUMBER(2));
-             process->push(NUMBER(3));
-             process->push(NUMBER(3));
-
-      
-            
-             process->init_frames();  // prepare frames 4 functions
-             process->frames[0].slots = process->stackTop - 4  -1 ;
-
-
-
-
-            
-            // process->set_defaults(); // local variables x,y, ... etc
-             process->constants = callTask->constants;
-          //   process->constants.push_back(INTEGER(process->ID));
-            //  process->addConstNumber(0);
-            //  process->addConstNumber(1);
-            //  process->addConstNumber(2);
-            //  process->addConstNumber(3);
-           
-            // for (u32 i = 0; i < callTask->constants.size(); i++)
-            // {
-            //     process->constants.push_back(callTask->constants[i]);
-            // }
-            //  process->constants.push_back(STRING("pocess"));
-
-            // for (u32 i = 0; i < callTask->constants.size(); i++)
-            // {
-            //    // process->constants[i+1]=callTask->constants[i];
-            // }
-          //  process->constants.push_back(STRING("pocess"));
-       
-
-
-          //  process->push(NUMBER(3));
-
+             process->init_frames(callTask);
 
              for (int i = argCount - 1; i >= 0; i--)
              {
-                 Value arg = peek(i);
-                 process->push(arg);
+                 WRITE_BARRIER(PEEK(i));
+                 process->push(PEEK(i));
              }
-             pop(argCount+1);
-           
+             sp -= argCount;
 
-            
-
-
-             frame->slots = stackTop - argCount - 1;
-               callTask->disassembleCode(name);
-             //   process->disassembleCode(name);
              if (this->type == TaskType::TPROCESS)
              {
                  process->set_parent(static_cast<Process *>(this));
              }
 
-            // vm->run_process.push_back(process);
              vm->processList.add(process);
-             push(INTEGER((int)process->ID));
-             process->set_defaults(); // local variables x,y, ... etc
-
-            // process->render();
+             PUSH(INTEGER((int)process->ID));
+             process->set_defaults(); // engine locals id, graph, x, y
 
-             // PrintStack();
+             SAVE_STACK();
              return RUNNING;
          }
-         case OpCode::RETURN_PROCESS:
+         CASE(RETURN_PROCESS)
          {
              isReturned = true;
              // disassembleCode(name.c_str());
              // INFO("Process RETURN %s ", name.c_str());
              // pop((constants.size() - 1) + DEFAULT_COUNT);
-             int count = (stackTop - frame->slots);
-             for (int i = 0; i < count; i++)
-             {
-                 pop();
-             }
+             sp = frame->slots;
 
              // PrintStack();
              state = TERMINATED;
+             SAVE_STACK();
              return TERMINATED;
          }
 
-         case OpCode::FRAME:
+         CASE(FRAME)
          {
-                Value constant = pop();
-                double frame_value = AS_NUMBER(constant);
-
-                if (frame_value > 1) frame_value = 1;
-                if (frame_value < 0) frame_value = 0;
-
-                frame_counter = 0.01;
-                last_frame_time = clock();
-                Process *process = static_cast<Process *>(frame->task);
-                process->create();
-
-
+                // the first frame fires the create hook
+                if (type == TaskType::TPROCESS && !static_cast<Process *>(this)->isCreated)
+                {
+                    DEFER_IN_PARALLEL(1);
+                }
+                // frame(n) takes n percent of a frame: the percent adds up
+                // and every full 100 is one Update to sleep, so frame(200)
+                // skips a frame and frame(50) pauses every second call
+                Value constant = POP();
+                if (!IS_NUMBER(constant))
+                {
+                    vm->Error("frame percent must be a number [line %d]", currentLine());
+                    SAVE_STACK();
+                    return ABORTED;
+                }
+                double percent = AS_NUMBER(constant);
+                if (percent > FRAME_MAX_PERCENT)
+                {
+                    percent = FRAME_MAX_PERCENT;
+                }
+                if (percent > 0)
+                {
+                    frameCredit += (u32)percent;
+                }
+                create();
+
+                u32 ticks = frameCredit / 100;
+                frameCredit %= 100;
+                if (ticks == 0)
+                {
+                    NEXT();
+                }
+                wakeTick = vm->tick + ticks;
                 state = PAUSED;
+                SAVE_STACK();
                 return state;
-
          }
-         case OpCode::CLONE:
+         CASE(CLONE)
          {
+             DEFER_IN_PARALLEL(1);
              INFO("CLONE %s", name.c_str());
-             break;
+             NEXT();
          }
 
-         case OpCode::NIL:
+         CASE(NIL)
          {
-             push(VirtualMachine::DEFAULT);
-             break;
+             PUSH(VirtualMachine::DEFAULT);
+             NEXT();
          }
 
-         default:
+         CASE_DEFAULT
          {
              vm->Error(" %s running %d with unknown '%d' opcode frame %d", name.c_str(), frame->ip, (int)instruction, frameCount);
              state = ABORTED;
+             SAVE_STACK();
              return ABORTED;
          }
          }
 
+#ifndef USE_COMPUTED_GOTO
            //  INFO("RUN %s executed %d", name.c_str(),instructionsExecuted);
 
          instructionsExecuted++;
          if (instructionsExecuted >= instructionsPerFrame)
          {
+             resumeBudget = instructionsExecuted - instructionsPerFrame;
              state = RUNNING;
+             SAVE_STACK();
              return RUNNING;
          }
        // state = RUNNING;
       //  return state;
+#endif
 
      }
 
 
+SAVE_STACK();
 return FINISHED;
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef SAVE_STACK
+#undef LOAD_STACK
+#undef RESERVE_FRAME
+#undef HAND_OVER
+#undef COUNT_HOT
+#undef POP
+#undef PEEK
+#undef PUSH
+#undef DEFER_IN_PARALLEL
 #undef READ_CONSTANT
+#undef CASE
+#undef CASE_DEFAULT
+#undef NEXT
+#undef NEXT_FUSED
+#undef COUNT_PAIR
+#undef REDISPATCH
+#undef REWRITE
+#undef QUICKEN_NUMBERS
+#undef READ_OPCODE
+#ifdef USE_COMPUTED_GOTO
+#undef DISPATCH
+#endif
 
 }
\ No newline at end of file
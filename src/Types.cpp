@@ -3,12 +3,15 @@
 #include "Types.hpp"
 #include "Vm.hpp"
 
-static inline size_t string_hash(const char *str)
+#include <algorithm>
+#include <chrono>
+
+u32 HashString(const char *chars, size_t length)
 {
-    size_t hash = 2166136261u;
-    while (*str)
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
     {
-        hash ^= (uint8_t)(*str++);
+        hash ^= (u8)chars[i];
         hash *= 16777619;
     }
     return hash;
@@ -62,6 +65,8 @@ void Traceable::operator delete(void *ptr, size_t size)
     Arena::as().deallocate(ptr, size);
 }
 
+bool Arena::marking = false;
+
 Arena::Arena()
 {
     bytesAllocated = 0;
@@ -69,9 +74,25 @@ Arena::Arena()
     head = nullptr;
     tail = nullptr;
     next_id = 0;
-    treshold = 128;
-   // 1024 * 8;
-    roots.reserve(1024 * 4);
+    threaded = false;
+    poolNew = 0;
+    poolRecycled = 0;
+    poolFree = 0;
+    poolFreeBytes = 0;
+    poolReturned = 0;
+    collections = 0;
+    freedObjects = 0;
+    lastPause = 0;
+    maxPause = 0;
+    totalPause = 0;
+    pauseNext = 0;
+    phase = GCPhase::IDLE;
+    rootCursor = 0;
+    sweepRead = 0;
+    sweepWrite = 0;
+    sweepEnd = 0;
+    treshold = GC_MIN_THRESHOLD;
+    objects.reserve(1024 * 4);
     start_time = clock();
 
 }
@@ -88,55 +109,251 @@ double Arena::get_elapsed_time()
 
 void Arena::remove(Traceable *n)
 {
-     roots.remove(n);
+    for (u32 i = 0; i < roots.size(); i++)
+    {
+        if (roots[i] == n)
+        {
+            roots.erase(i);
+            return;
+        }
+    }
+}
+
+void Arena::attach(VirtualMachine *vm)
+{
+    machines.push_back(vm);
+    if (phase == GCPhase::MARK)
+        vm->beginMark();
 }
 
+void Arena::detach(VirtualMachine *vm)
+{
+    for (u32 i = 0; i < machines.size(); i++)
+    {
+        if (machines[i] == vm)
+        {
+            machines.erase(i);
+            if (i < rootCursor)
+                rootCursor--;
+            return;
+        }
+    }
+}
 
-void Arena::mark_from(Traceable *obj)
+StringObject *Arena::intern(const char *chars, size_t length)
 {
+    u32 hash = HashString(chars, length);
+    StringObject *string = strings.find(chars, length, hash);
+    if (string)
+    {
+        // it may be white and about to be swept, keep it for this cycle
+        if (phase == GCPhase::MARK)
+            shade(string);
+        else if (phase == GCPhase::SWEEP)
+            string->mark();
+        return string;
+    }
+
+    string = new StringObject(String(chars, length));
+    string->interned = true;
+    strings.insert(string);
+    return string;
+}
+
+StringObject *Arena::intern(const char *chars)
+{
+    return intern(chars, strlen(chars));
+}
+
+StringObject *Arena::intern(const String &string)
+{
+    return intern(string.c_str(), string.length());
+}
+
+void Arena::shade(Traceable *obj)
+{
+    std::unique_lock<std::mutex> guard(mutex, std::defer_lock);
+    if (threaded)
+        guard.lock();
 
     if (obj == nullptr || obj->marked)
         return;
 
     obj->mark();
+    gray.push_back(obj);
+}
+
+void Arena::shade(const Value &value)
+{
+    if (IS_OBJECT(value))
+        shade(AS_STRING(value));
 }
 
-void Arena::mark()
+void Arena::begin()
 {
-    for (auto it = roots.begin(); it != roots.end(); ++it)
+    phase = GCPhase::MARK;
+    marking = true;
+    rootCursor = 0;
+    gray.clear();
+    for (u32 i = 0; i < roots.size(); i++)
+    {
+        shade(roots[i]);
+    }
+    for (u32 i = 0; i < machines.size(); i++)
     {
-        Traceable *obj = *it;
-        mark_from(obj);
+        machines[i]->beginMark();
     }
 }
 
-void Arena::sweep()
+size_t Arena::mark(size_t work)
 {
-    
+    // trace the gray objects first, then scan the next roots
+    while (work > 0)
+    {
+        if (!gray.empty())
+        {
+            Traceable *obj = gray.pop_back();
+            obj->trace();
+            work--;
+        }
+        else if (rootCursor < machines.size())
+        {
+            if (machines[rootCursor]->markRoots(work))
+                rootCursor++;
+        }
+        else
+        {
+            marking = false;
+            phase = GCPhase::SWEEP;
+            sweepRead = 0;
+            sweepWrite = 0;
+            sweepEnd = objects.size();
+            break;
+        }
+    }
+    return work;
+}
+
+size_t Arena::sweep(size_t work)
+{
+    // compact in place so the list stays sorted by id
+    while (work > 0 && sweepRead < sweepEnd)
+    {
+        Traceable *obj = objects[sweepRead++];
+        if (obj->marked)
+        {
+            obj->unmark();
+            objects.set(sweepWrite++, obj);
+        }
+        else
+        {
+            delete obj;
+            freedObjects++;
+        }
+        work--;
+    }
+    if (sweepRead == sweepEnd)
+    {
+        for (size_t i = sweepEnd; i < objects.size(); i++)
+        {
+            objects.set(sweepWrite++, objects[i]);
+        }
+        objects.truncate(sweepWrite);
+        finish();
+    }
+    return work;
+}
+
+void Arena::finish()
+{
+    phase = GCPhase::IDLE;
+    treshold = bytesAllocated * GC_HEAP_GROW;
+    if (treshold < GC_MIN_THRESHOLD)
+        treshold = GC_MIN_THRESHOLD;
+    collections++;
+}
+
+void Arena::step(size_t work)
+{
+    if (phase == GCPhase::MARK)
+        mark(work);
+    else if (phase == GCPhase::SWEEP)
+        sweep(work);
 }
 
-void Arena::gc()
+void Arena::record(double pause)
 {
+    lastPause = pause;
+    if (pause > maxPause)
+        maxPause = pause;
+    totalPause += pause;
+    if (pauses.size() < GC_PAUSE_SAMPLES)
+        pauses.push_back(pause);
+    else
+        pauses[pauseNext] = pause;
+    pauseNext = (pauseNext + 1) % GC_PAUSE_SAMPLES;
+}
 
-  //  if (bytesAllocated < treshold)
-   //     return;
+double Arena::get_pause_percentile(double percentile)
+{
+    if (pauses.empty())
+        return 0;
+    Vector<double> sorted(pauses);
+    std::sort(sorted.pointer(), sorted.pointer() + sorted.size());
+    size_t index = (size_t)(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+    if (index >= sorted.size())
+        index = sorted.size() - 1;
+    return sorted[index];
+}
 
-    //mark();
-   // sweep();
+void Arena::gc(double budget)
+{
+    if (phase == GCPhase::IDLE)
+    {
+        if (bytesAllocated < treshold)
+            return;
+        begin();
+    }
 
-    //  stats();
+    auto start = std::chrono::steady_clock::now();
+    bool urgent = bytesAllocated >= treshold * GC_HEAP_GROW;
+    double elapsed = 0;
+    do
+    {
+        step(GC_STEP_WORK);
+        elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    } while (phase != GCPhase::IDLE && (urgent || elapsed < budget));
+    record(elapsed);
+}
 
-    //  stats();
+void Arena::collect()
+{
+    auto start = std::chrono::steady_clock::now();
+    if (phase == GCPhase::IDLE)
+        begin();
+    while (phase != GCPhase::IDLE)
+    {
+        step(GC_STEP_WORK);
+    }
+    record(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
 }
 
 void Arena::clear()
 {
-    for (u32 i = 0; i < roots.size(); i++)
+    // a sweep in progress leaves freed slots in the middle of the list
+    if (phase == GCPhase::SWEEP)
+        sweep(objects.size());
+    for (u32 i = 0; i < objects.size(); i++)
     {
-        Traceable *obj = roots[i];
+        Traceable *obj = objects[i];
         delete obj;
     }
+    objects.clear();
     roots.clear();
+    gray.clear();
+    strings.clear();
+    phase = GCPhase::IDLE;
+    marking = false;
 
 
     stats();
@@ -150,10 +367,51 @@ void Arena::stats()
 
     printf("--Total objects:   %lu\n", (unsigned long)totalObjects);
     printf("--Bytes allocated: %lu\n", (unsigned long)bytesAllocated);
+    printf("--Process pool:    %lu new, %lu recycled, %lu free (%lu bytes), %lu returned\n",
+           (unsigned long)poolNew, (unsigned long)poolRecycled, (unsigned long)poolFree,
+           (unsigned long)poolFreeBytes, (unsigned long)poolReturned);
+    printf("--GC:              %lu collections, %lu freed, pause last %.3f ms max %.3f ms total %.3f ms\n",
+           (unsigned long)collections, (unsigned long)freedObjects, lastPause, maxPause, totalPause);
+    printf("--GC pauses:       p50 %.3f ms p95 %.3f ms p99 %.3f ms over %lu steps\n",
+           get_pause_percentile(50), get_pause_percentile(95), get_pause_percentile(99), (unsigned long)pauses.size());
+}
+
+void Arena::pool_acquire(size_t size, bool recycled)
+{
+    bytesAllocated += size;
+    totalObjects++;
+    if (recycled)
+    {
+        poolRecycled++;
+        poolFree--;
+        poolFreeBytes -= size;
+    }
+    else
+    {
+        poolNew++;
+    }
+}
+
+void Arena::pool_release(size_t size)
+{
+    bytesAllocated -= size;
+    totalObjects--;
+    poolFree++;
+    poolFreeBytes += size;
+}
+
+void Arena::pool_return(size_t size)
+{
+    poolFree--;
+    poolFreeBytes -= size;
+    poolReturned++;
 }
 
 void *Arena::allocate(size_t size)
 {
+    std::unique_lock<std::mutex> guard(mutex, std::defer_lock);
+    if (threaded)
+        guard.lock();
 
     bytesAllocated += size;
     totalObjects++;
@@ -162,6 +420,9 @@ void *Arena::allocate(size_t size)
 
 void Arena::deallocate(void *ptr, size_t size)
 {
+    std::unique_lock<std::mutex> guard(mutex, std::defer_lock);
+    if (threaded)
+        guard.lock();
 
     bytesAllocated -= size;
     totalObjects--;
@@ -177,9 +438,15 @@ void Arena::queue(Traceable *obj)
     if (obj == nullptr)
         return;
 
-    obj->mark();
+    std::unique_lock<std::mutex> guard(mutex, std::defer_lock);
+    if (threaded)
+        guard.lock();
+
+    // born black while marking, the cycle that is running keeps it
+    if (phase == GCPhase::MARK)
+        obj->mark();
     obj->id = next_id++;
-    roots.push_back(obj);
+    objects.push_back(obj);
 
 }
 
@@ -357,6 +624,8 @@ StringObject::StringObject(const String &str):Traceable()
 {
     string = str;
     type = ObjectType::OSTRING;
+    hash = HashString(string.c_str(), string.length());
+    interned = false;
 
    // INFO("Create string: %s", string.c_str());
 }
@@ -365,6 +634,8 @@ StringObject::StringObject(const char *str):Traceable()
 {
     string = String(str);
     type = ObjectType::OSTRING;
+    hash = HashString(string.c_str(), string.length());
+    interned = false;
 
   //  INFO("Create string: %s", string.c_str());
 }
@@ -373,6 +644,8 @@ StringObject::StringObject(double value):Traceable()
 {
     string = String(value);
     type = ObjectType::OSTRING;
+    hash = HashString(string.c_str(), string.length());
+    interned = false;
  
 }
 
@@ -380,21 +653,115 @@ StringObject::StringObject(int value):Traceable()
 {
     string = String(value);
     type = ObjectType::OSTRING;
+    hash = HashString(string.c_str(), string.length());
+    interned = false;
 
 }
 
 StringObject::~StringObject()
 {
   //  INFO("Delete string: %s", string.c_str());
+    if (interned)
+        Arena::as().unintern(this);
+}
+
+//***************************************************************************************************************** */
+
+#define STRING_TABLE_MIN 64
+
+// marks a removed entry so probing goes on past it
+static StringObject *const TOMBSTONE = reinterpret_cast<StringObject *>(1);
+
+StringTable::StringTable()
+{
+    entries = nullptr;
+    capacity = 0;
+    used = 0;
+}
+
+StringTable::~StringTable()
+{
+    std::free(entries);
+}
+
+void StringTable::clear()
+{
+    std::free(entries);
+    entries = nullptr;
+    capacity = 0;
+    used = 0;
+}
+
+StringObject *StringTable::find(const char *chars, size_t length, u32 hash)
+{
+    if (capacity == 0)
+        return nullptr;
+
+    u32 index = hash & (capacity - 1);
+    while (true)
+    {
+        StringObject *entry = entries[index];
+        if (entry == nullptr)
+            return nullptr;
+        if (entry != TOMBSTONE && entry->hash == hash && entry->string.length() == length &&
+            memcmp(entry->string.c_str(), chars, length) == 0)
+            return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+void StringTable::grow()
+{
+    StringObject **old = entries;
+    u32 oldCapacity = capacity;
+
+    capacity = capacity == 0 ? STRING_TABLE_MIN : capacity * 2;
+    entries = static_cast<StringObject **>(std::calloc(capacity, sizeof(StringObject *)));
+    used = 0;
+    for (u32 i = 0; i < oldCapacity; i++)
+    {
+        if (old[i] != nullptr && old[i] != TOMBSTONE)
+            insert(old[i]);
+    }
+    std::free(old);
+}
+
+void StringTable::insert(StringObject *string)
+{
+    if ((used + 1) * 4 > capacity * 3)
+        grow();
+
+    u32 index = string->hash & (capacity - 1);
+    while (entries[index] != nullptr && entries[index] != TOMBSTONE)
+    {
+        index = (index + 1) & (capacity - 1);
+    }
+    if (entries[index] == nullptr)
+        used++;
+    entries[index] = string;
 }
 
+void StringTable::remove(StringObject *string)
+{
+    if (capacity == 0)
+        return;
 
+    u32 index = string->hash & (capacity - 1);
+    while (entries[index] != nullptr)
+    {
+        if (entries[index] == string)
+        {
+            entries[index] = TOMBSTONE;
+            return;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
 
 Chunk::Chunk(u32 capacity)
-    :  m_capacity(capacity), count(0)
+    :  m_capacity(capacity), m_lineCapacity(0), lines(nullptr), lineCount(0), count(0), verified(false), maxStack(0), native(nullptr), hotness(0), deopts(0)
 {
     code  = (u8*)  std::malloc(capacity * sizeof(u8));
-    lines = (int*) std::malloc(capacity * sizeof(int));
 
     //printf("create chunk   \n");
 }
@@ -403,13 +770,20 @@ Chunk::Chunk(Chunk *other)
 {
 
     code  = (u8*)  std::malloc(other->m_capacity * sizeof(u8));
-    lines = (int*) std::malloc(other->m_capacity * sizeof(int));
+    lines = (LineStart*) std::malloc((other->lineCount ? other->lineCount : 1) * sizeof(LineStart));
     
     m_capacity = other->m_capacity;
+    m_lineCapacity = other->lineCount ? other->lineCount : 1;
     count = other->count;
+    lineCount = other->lineCount;
+    verified = other->verified;
+    maxStack = other->maxStack;
+    native = other->native;
+    hotness = 0;
+    deopts = other->deopts;
 
     std::memcpy(code, other->code, other->m_capacity * sizeof(u8));
-    std::memcpy(lines, other->lines, other->m_capacity * sizeof(int));
+    std::memcpy(lines, other->lines, lineCount * sizeof(LineStart));
 }
 
 
@@ -424,10 +798,17 @@ bool Chunk::clone(Chunk *other)
 
     
     other->m_capacity = m_capacity;
+    other->m_lineCapacity = lineCount ? lineCount : 1;
     other->count = count;
+    other->lineCount = lineCount;
+    other->verified = verified;
+    other->maxStack = maxStack;
+    other->native = native;
+    other->hotness = 0;
+    other->deopts = deopts;
 
     other->code = (u8*) std::malloc(m_capacity * sizeof(u8));
-    other->lines = (int*) std::malloc(m_capacity * sizeof(int));
+    other->lines = (LineStart*) std::malloc(other->m_lineCapacity * sizeof(LineStart));
 
     if (!other->code || !other->lines)
     {
@@ -438,12 +819,44 @@ bool Chunk::clone(Chunk *other)
     }
 
     std::memcpy(other->code, code, count * sizeof(u8));
-    std::memcpy(other->lines, lines, count * sizeof(int));
+    std::memcpy(other->lines, lines, lineCount * sizeof(LineStart));
 
     return true;
     
 }
 
+bool Chunk::assign(const u8 *code, u32 count, const LineStart *lines, u32 lineCount)
+{
+    u32 capacity = count ? count : 1;
+    u32 lineCapacity = lineCount ? lineCount : 1;
+    u8 *newCode = (u8*) std::malloc(capacity * sizeof(u8));
+    LineStart *newLines = (LineStart*) std::malloc(lineCapacity * sizeof(LineStart));
+    if (!newCode || !newLines)
+    {
+        std::free(newCode);
+        std::free(newLines);
+        DEBUG_BREAK_IF(newCode == nullptr || newLines == nullptr);
+        return false;
+    }
+    std::memcpy(newCode, code, count * sizeof(u8));
+    std::memcpy(newLines, lines, lineCount * sizeof(LineStart));
+
+    std::free(this->code);
+    std::free(this->lines);
+    this->code = newCode;
+    this->lines = newLines;
+    m_capacity = capacity;
+    m_lineCapacity = lineCapacity;
+    this->count = count;
+    this->lineCount = lineCount;
+    verified = false;
+    maxStack = 0;
+    native = nullptr;
+    hotness = 0;
+    deopts = 0;
+    return true;
+}
+
 
 Chunk::~Chunk()
 {
@@ -460,20 +873,16 @@ void Chunk::reserve(u32 capacity)
        
 
         u8 *newCode  = (u8*) (std::realloc(code,  capacity * sizeof(u8)));
-        int *newLine = (int*)(std::realloc(lines, capacity * sizeof(int)));
 
-        if (!newCode || !newLine)
+        if (!newCode)
         {
-            std::free(newCode);
-            std::free(newLine);
-            DEBUG_BREAK_IF(newCode == nullptr || newLine == nullptr);
+            DEBUG_BREAK_IF(newCode == nullptr);
             return;
         }
 
 
 
         code = newCode;
-        lines = newLine;      
         m_capacity = capacity;
     }
 }
@@ -487,24 +896,70 @@ void Chunk::write(u8 instruction, int line)
         int oldCapacity = m_capacity;
         m_capacity = GROW_CAPACITY(oldCapacity);
         u8 *newCode  = (u8*) (std::realloc(code,  m_capacity * sizeof(u8)));
-        int *newLine = (int*)(std::realloc(lines, m_capacity * sizeof(int)));
-        if (!newCode || !newLine)
+        if (!newCode)
         {
-            std::free(newCode);
-            std::free(newLine);
-            DEBUG_BREAK_IF(newCode == nullptr || newLine == nullptr);
+            DEBUG_BREAK_IF(newCode == nullptr);
             return;
         }
         code = newCode;
-        lines = newLine;      
 
     }
     
+    if (lineCount == 0 || lines[lineCount - 1].line != line)
+    {
+        addLine(count, line);
+    }
     code[count]  = instruction;
-    lines[count] = line;
     count++;
 }
 
+void Chunk::addLine(u32 offset, int line)
+{
+    if (m_lineCapacity < lineCount + 1)
+    {
+        u32 capacity = (u32)GROW_CAPACITY(m_lineCapacity);
+        LineStart *newLines = (LineStart*)(std::realloc(lines, capacity * sizeof(LineStart)));
+        if (!newLines)
+        {
+            DEBUG_BREAK_IF(newLines == nullptr);
+            return;
+        }
+        lines = newLines;
+        m_lineCapacity = capacity;
+    }
+    lines[lineCount].offset = offset;
+    lines[lineCount].line = line;
+    lineCount++;
+}
+
+int Chunk::getLine(u32 offset) const
+{
+    // last entry starting at or before offset
+    u32 low = 0;
+    u32 high = lineCount;
+    while (low < high)
+    {
+        u32 mid = (low + high) / 2;
+        if (lines[mid].offset <= offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low > 0 ? lines[low - 1].line : 0;
+}
+
+void Chunk::setLines(const int *perByte, u32 count)
+{
+    lineCount = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        if (lineCount == 0 || lines[lineCount - 1].line != perByte[i])
+        {
+            addLine(i, perByte[i]);
+        }
+    }
+}
+
 u8 Chunk::operator[](u32 index)
 {
     DEBUG_BREAK_IF(index > m_capacity);
@@ -2,6 +2,13 @@
 #include "pch.h"
 #include "Utils.hpp"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 void Log(int severity, const char *fmt, ...)
 {
 	va_list args;
@@ -108,3 +115,62 @@ void FreeTextFile(char *text)
 	if (text != NULL)
 		std::free(text);
 }
+
+#ifndef _WIN32
+
+const void *MapFile(const char *fileName, size_t *size)
+{
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat info;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+		data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return nullptr;
+
+	*size = (size_t)info.st_size;
+	return data;
+}
+
+void UnmapFile(const void *data, size_t size)
+{
+	if (data != nullptr)
+		munmap((void *)data, size);
+}
+
+#else
+
+const void *MapFile(const char *fileName, size_t *size)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (file == NULL)
+		return nullptr;
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	void *data = length > 0 ? std::malloc((size_t)length) : NULL;
+	if (data != NULL && fread(data, 1, (size_t)length, file) != (size_t)length)
+	{
+		std::free(data);
+		data = NULL;
+	}
+	fclose(file);
+	if (data == NULL)
+		return nullptr;
+
+	*size = (size_t)length;
+	return data;
+}
+
+void UnmapFile(const void *data, size_t size)
+{
+	std::free((void *)data);
+}
+
+#endif
@@ -0,0 +1,338 @@
+#include "pch.h"
+#include "Vm.hpp"
+
+// Load-time check of a compiled chunk. Follows every path through the code
+// with the stack depth of the frame (slots from frame->slots up), and accepts
+// the chunk only when:
+//   - every instruction decodes and Run implements it,
+//   - jumps land on an instruction start inside the chunk, no path runs off the end,
+//   - a join point is reached with the same depth from every side,
+//   - nothing pops below the frame and local slots are below the depth,
+//   - constant, global, native, function and process indexes exist,
+//     and calls pass the arity of what they call.
+// A verified chunk records the deepest its frame gets (maxStack), Run reserves
+// that once when it enters the frame and then pushes without checks.
+
+// depth popped / pushed by an instruction, peak is the most it holds above
+// the start depth at once (the slow paths of the fused adds push extra)
+struct StackEffect
+{
+    int pops;
+    int pushes;
+    int peak;
+};
+
+static bool stackEffect(u8 instruction, const u8 *code, StackEffect &effect)
+{
+    effect.pops = 0;
+    effect.pushes = 0;
+    effect.peak = 0;
+    switch ((OpCode)instruction)
+    {
+    case OpCode::CONST:
+    case OpCode::PUSH:
+    case OpCode::TRUE:
+    case OpCode::FALSE:
+    case OpCode::NIL:
+    case OpCode::NOW:
+    case OpCode::GLOBAL_GET:
+    case OpCode::LOCAL_GET:
+    case OpCode::ENGINE_GET:
+        effect.pushes = 1;
+        break;
+
+    case OpCode::PROGRAM:
+    case OpCode::CLONE:
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_BACK:
+        break;
+
+    case OpCode::POP:
+    case OpCode::PRINT:
+    case OpCode::FRAME:
+    case OpCode::GLOBAL_DEFINE:
+    case OpCode::POP_JUMP_IF_FALSE:
+    case OpCode::LOCAL_STORE:
+    case OpCode::ENGINE_STORE:
+    case OpCode::GLOBAL_STORE:
+        effect.pops = 1;
+        break;
+
+    case OpCode::NEGATE:
+    case OpCode::NOT:
+    case OpCode::GLOBAL_ASSIGN:
+    case OpCode::LOCAL_SET:
+    case OpCode::ENGINE_SET:
+    case OpCode::JUMP_IF_FALSE:
+        effect.pops = 1;
+        effect.pushes = 1;
+        break;
+
+    case OpCode::DUP:
+        effect.pops = 1;
+        effect.pushes = 2;
+        break;
+
+    case OpCode::ADD:
+    case OpCode::SUBTRACT:
+    case OpCode::MULTIPLY:
+    case OpCode::DIVIDE:
+    case OpCode::MOD:
+    case OpCode::POWER:
+    case OpCode::EQUAL:
+    case OpCode::NOT_EQUAL:
+    case OpCode::LESS:
+    case OpCode::LESS_EQUAL:
+    case OpCode::GREATER:
+    case OpCode::GREATER_EQUAL:
+    case OpCode::XOR:
+    case OpCode::ADD_NUM:
+    case OpCode::SUBTRACT_NUM:
+    case OpCode::MULTIPLY_NUM:
+    case OpCode::DIVIDE_NUM:
+    case OpCode::EQUAL_NUM:
+    case OpCode::NOT_EQUAL_NUM:
+    case OpCode::LESS_NUM:
+    case OpCode::LESS_EQUAL_NUM:
+    case OpCode::GREATER_NUM:
+    case OpCode::GREATER_EQUAL_NUM:
+        effect.pops = 2;
+        effect.pushes = 1;
+        break;
+
+    case OpCode::EVAL_EQUAL:
+        effect.pops = 2;
+        effect.pushes = 3;
+        break;
+
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+        effect.pops = 2;
+        break;
+
+    case OpCode::ADD_LOCAL:
+    case OpCode::ADD_GLOBAL:
+    case OpCode::ADD_CONST:
+        effect.pops = 1;
+        effect.pushes = 1;
+        effect.peak = 2;
+        break;
+
+    case OpCode::ADD_LOCAL_LOCAL:
+        effect.pushes = 1;
+        effect.peak = 2;
+        break;
+
+    case OpCode::LOCAL_INC_CONST:
+        effect.peak = 2;
+        break;
+
+    case OpCode::CALL:
+    case OpCode::CALL_SCRIPT:
+    case OpCode::CALL_PROCESS:
+        effect.pops = code[3];
+        effect.pushes = 1;
+        break;
+
+    case OpCode::RETURN:
+        effect.pops = 1;
+        break;
+
+    case OpCode::HALT:
+    case OpCode::RETURN_PROCESS:
+        break;
+
+    default:
+        return false;
+    }
+    if (effect.peak < effect.pushes)
+        effect.peak = effect.pushes;
+    return true;
+}
+
+// the instruction doesn't continue with the next one
+static bool endsPath(u8 instruction)
+{
+    switch ((OpCode)instruction)
+    {
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_TRUE: // Run takes it unconditionally
+    case OpCode::JUMP_BACK:
+    case OpCode::RETURN:
+    case OpCode::RETURN_PROCESS:
+    case OpCode::HALT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool isBranch(u8 instruction)
+{
+    switch ((OpCode)instruction)
+    {
+    case OpCode::JUMP:
+    case OpCode::JUMP_IF_TRUE:
+    case OpCode::JUMP_BACK:
+    case OpCode::JUMP_IF_FALSE:
+    case OpCode::POP_JUMP_IF_FALSE:
+    case OpCode::JUMP_IF_NOT_LESS:
+    case OpCode::JUMP_IF_NOT_LESS_EQUAL:
+    case OpCode::JUMP_IF_NOT_GREATER:
+    case OpCode::JUMP_IF_NOT_GREATER_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Task::verify(u32 depth)
+{
+    if (!chunk)
+        return false;
+    chunk->verified = false;
+    chunk->maxStack = 0;
+
+    const u32 count = chunk->count;
+    const u8 *code = chunk->code;
+    if (count == 0)
+        return false;
+
+    // depth at each instruction start, -1 = not reached yet
+    int *depths = new int[count];
+    bool *starts = new bool[count]();
+    for (u32 i = 0; i < count; i++)
+        depths[i] = -1;
+
+    bool ok = true;
+    for (u32 offset = 0; offset < count && ok;)
+    {
+        u32 size = InstructionSize(code[offset]);
+        if (size == 0 || offset + size > count)
+            ok = false;
+        starts[offset] = true;
+        offset += size;
+    }
+
+    int maxDepth = (int)depth;
+    Vector<u32> work;
+    if (ok)
+    {
+        depths[0] = (int)depth;
+        work.push_back(0);
+    }
+
+    // a successor must be an instruction start and agree on the depth
+    auto reach = [&](int target, int targetDepth)
+    {
+        if (target < 0 || target >= (int)count || !starts[target])
+            return false;
+        if (depths[target] < 0)
+        {
+            depths[target] = targetDepth;
+            work.push_back((u32)target);
+            return true;
+        }
+        return depths[target] == targetDepth;
+    };
+
+    while (ok && work.size() > 0)
+    {
+        u32 offset = work.pop_back();
+        u8 op = code[offset];
+        const u8 *at = code + offset;
+        int current = depths[offset];
+
+        StackEffect effect;
+        if (!stackEffect(op, at, effect) || current < effect.pops)
+        {
+            ok = false;
+            break;
+        }
+
+        switch ((OpCode)op)
+        {
+        case OpCode::CONST:
+        case OpCode::PUSH:
+        case OpCode::PROGRAM:
+        case OpCode::ADD_CONST:
+            ok = at[1] < constants.size();
+            break;
+        case OpCode::LOCAL_INC_CONST:
+            ok = at[1] < current && at[2] < constants.size();
+            break;
+        case OpCode::LOCAL_GET:
+        case OpCode::LOCAL_SET:
+        case OpCode::LOCAL_STORE:
+        case OpCode::ADD_LOCAL:
+            ok = at[1] < current;
+            break;
+        case OpCode::ADD_LOCAL_LOCAL:
+            ok = at[1] < current && at[2] < current;
+            break;
+        case OpCode::ENGINE_GET:
+        case OpCode::ENGINE_SET:
+        case OpCode::ENGINE_STORE:
+            ok = type == TaskType::TPROCESS && at[1] < DEFAULT_COUNT;
+            break;
+        case OpCode::GLOBAL_DEFINE:
+        case OpCode::GLOBAL_GET:
+        case OpCode::GLOBAL_ASSIGN:
+        case OpCode::GLOBAL_STORE:
+        case OpCode::ADD_GLOBAL:
+            ok = (u32)((at[1] << 8) | at[2]) < vm->globals.size();
+            break;
+        case OpCode::CALL:
+        {
+            u32 index = (u32)((at[1] << 8) | at[2]);
+            ok = index < vm->natives.size();
+            break;
+        }
+        case OpCode::CALL_SCRIPT:
+        {
+            u32 index = (u32)((at[1] << 8) | at[2]);
+            ok = index < vm->functions.size() && vm->functions[index] &&
+                 vm->functions[index]->arity == (int)at[3];
+            break;
+        }
+        case OpCode::CALL_PROCESS:
+        {
+            u32 index = (u32)((at[1] << 8) | at[2]);
+            ok = index < vm->processes.size() && vm->processes[index] &&
+                 vm->processes[index]->argsCount == at[3];
+            break;
+        }
+        default:
+            break;
+        }
+        if (!ok)
+            break;
+
+        if (current + effect.peak - effect.pops > maxDepth)
+            maxDepth = current + effect.peak - effect.pops;
+        int next = current - effect.pops + effect.pushes;
+
+        if (isBranch(op))
+        {
+            int jump = (at[1] << 8) | at[2];
+            int target = op == OpCode::JUMP_BACK ? (int)offset + 3 - jump : (int)offset + 3 + jump;
+            ok = reach(target, next);
+        }
+        if (ok && !endsPath(op))
+        {
+            ok = reach((int)(offset + InstructionSize(op)), next);
+        }
+    }
+
+    delete[] depths;
+    delete[] starts;
+
+    if (!ok || maxDepth > STACK_MAX)
+        return false;
+    chunk->maxStack = (u32)maxDepth;
+    chunk->verified = true;
+    return true;
+}
@@ -1,71 +1,15 @@
 
 #include "pch.h"
 #include "Vm.hpp"
+#include "Aot.hpp"
+#include "Jit.hpp"
 
 extern void printValue(const Value &v);
 extern void debugValue(const Value &v);
 extern void printValueln(const Value &v);
 
 Value VirtualMachine::DEFAULT = NONE();
-
-Scope::Scope()
-{
-    level = 0;
-}
-
-Scope::Scope( int level)
-{
-    this->level = level;
-    // INFO("New scope: %s %d", name, level);
-}
-
-Scope::~Scope()
-{
-    // INFO("Delete scope: %s", name.c_str());
-}
-
-bool Scope::define(const char *name, Value value)
-{
-    if (variables.contains(name))
-    {
-        return false;
-    }
-    variables.insert(name, std::move(value));
-    return true;
-}
-
-void Scope::insert(const char *name, Value value)
-{
-    variables.insert(name, std::move(value));
-}
-
-bool Scope::get(const char *name, Value &value)
-{
-    return variables.find(name, value);
-}
-
-bool Scope::contains(const char *name) const
-{
-    return variables.contains(name);
-}
-
-bool Scope::assign(const char *name, Value value)
-{
-    return variables.change(name, std::move(value));
-}
-
-
-
-void Scope::print()
-{
-    
-}
-
-void Scope::clear()
-{
-    // INFO("Clear scope: %s", name.c_str());
-    variables.clear();
-}
+thread_local Task *VirtualMachine::nativeTask = nullptr;
 
 Task *VirtualMachine::getCurrentTask()
 {
@@ -82,25 +26,22 @@ Task *VirtualMachine::getTask(const char *name)
     return nullptr;
 }
 
-FunctionObject *VirtualMachine::newFunction(const char *name)
+FunctionObject *VirtualMachine::newFunction(const char *name, u16 index)
 {
     FunctionObject *task = new FunctionObject(this, name);
-    functionsMap.insert(name, task);
+    functions[index] = task;
     currentTask = task;
     return task;
 }
 
-bool VirtualMachine::getFunction(const char *name, FunctionObject **func)
-{
-    return functionsMap.find(name, *func);
-}
-
-Task *VirtualMachine::newTask(const char *name)
+Task *VirtualMachine::newTask(const char *name, u16 index)
 {
     Task *task = new Task(this, name);
+    task->type = TaskType::TPROCESS; // process prototype, compiled with engine locals
     currentTask = task;
     taskes.push_back(task);
     taskesMap.insert(name, task);
+    processes[index] = task;
     return task;
 }
 
@@ -113,10 +54,24 @@ Task *VirtualMachine::addTask(const char *name)//functions task ,small chunk
 
 Process *VirtualMachine::AddProcess(const char *name)
 {
-    Process *task = new Process(this, name);
+    Process *task = ::new (pool.acquire()) Process(this, name);
+    task->instance.engine = &engine;
+    task->instance.slot = engine.acquire();
     return task;
 }
 
+void VirtualMachine::FreeProcess(Process *process)
+{
+    timers.remove(process);
+    engine.release(process->instance.slot);
+    if (process->gcSlot < gcProcesses.size() && gcProcesses[process->gcSlot] == process)
+    {
+        gcProcesses[process->gcSlot] = nullptr;
+    }
+    process->~Process();
+    pool.release(process);
+}
+
 void VirtualMachine::setMainTask()
 {
     if (currentTask != mainTask)
@@ -166,25 +121,6 @@ void VirtualMachine::Info(const char *format, ...)
     va_end(args);
 }
 
-int VirtualMachine::callNativeFunction(const char *name, Value *args, u8 argCount)
-{
-    NativeFunctionObject *func;
-    if (nativeFunctions.find(name, func))
-    {
-        if (func->arity != -1)
-        {
-            if (func->arity != argCount)
-            {
-                Error("Native function %s has wrong number of arguments. Expected %d but got %d", name, func->arity, argCount);
-                return -1;
-            }
-        }
-        return func->call(this, argCount, args);
-    }
-    Error("Native function %s not found", name);
-    return -1;
-}
-
 Task *VirtualMachine::getMainTask()
 {
     return mainTask;
@@ -195,45 +131,101 @@ void VirtualMachine::disassemble()
     PRINT("Disassembly tasks");
 }
 
-void VirtualMachine::registerFunction(const char *name, NativeFunction func, size_t arity)
+void VirtualMachine::registerFunction(const char *name, NativeFunction func, size_t arity, bool threadSafe)
 {
-    if (nativeFunctions.contains(name))
+    if (nativeSlots.contains(name))
     {
         Warning("Function %s already exists", name);
         return;
     }
     parser.addNative(name);
-    nativeFunctions.insert(name, new NativeFunctionObject(func, name, arity));
+    nativeSlots.insert(name, natives.size());
+    natives.push_back(new NativeFunctionObject(func, name, arity, threadSafe));
+}
+
+u32 VirtualMachine::globalSlot(const char *name)
+{
+    u32 slot;
+    if (globalSlots.find(name, slot))
+    {
+        return slot;
+    }
+    slot = (u32)globals.size();
+    globals.push_back(UNDEFINED());
+    globalNames.push_back(String(name));
+    globalSlots.insert(name, slot);
+    return slot;
 }
 
 bool VirtualMachine::registerVariable(const char *name, Value value)
 {
-    return global->define(name, std::move(value));
+    u32 slot = globalSlot(name);
+    if (!IS_UNDEFINED(globals[slot]))
+    {
+        return false;
+    }
+    WRITE_BARRIER(value);
+    globals[slot] = std::move(value);
+    return true;
 }
 
 bool VirtualMachine::registerNumber(const char *name, double value)
 {
-    return global->define(name, std::move(NUMBER(value)));
+    return registerVariable(name, std::move(NUMBER(value)));
 }
 
 bool VirtualMachine::registerInteger(const char *name, int value)
 {
-    return global->define(name, std::move(INTEGER(value)));
+    return registerVariable(name, std::move(INTEGER(value)));
 }
 
 bool VirtualMachine::registerString(const char *name, const char *value)
 {
-    return global->define(name, std::move(STRING(value)));
+    return registerVariable(name, std::move(STRING(value)));
 }
 
 bool VirtualMachine::registerBoolean(const char *name, bool value)
 {
-    return global->define(name, std::move(BOOLEAN(value)));
+    return registerVariable(name, std::move(BOOLEAN(value)));
+}
+
+bool VirtualMachine::registerNil(const char *name)
+{
+    return registerVariable(name, std::move(NONE()));
 }
 
 bool VirtualMachine::ContainsVariable(const char *name)
 {
-    return global->contains(name);
+    u32 slot;
+    if (!globalSlots.find(name, slot))
+    {
+        return false;
+    }
+    return !IS_UNDEFINED(globals[slot]);
+}
+
+bool VirtualMachine::getVariable(const char *name, Value &value)
+{
+    u32 slot;
+    if (!globalSlots.find(name, slot) || IS_UNDEFINED(globals[slot]))
+    {
+        return false;
+    }
+    value = globals[slot];
+    return true;
+}
+
+bool VirtualMachine::setVariable(const char *name, Value value)
+{
+    u32 slot;
+    if (!globalSlots.find(name, slot) || IS_UNDEFINED(globals[slot]))
+    {
+        return false;
+    }
+    WRITE_BARRIER(globals[slot]);
+    WRITE_BARRIER(value);
+    globals[slot] = std::move(value);
+    return true;
 }
 
 VirtualMachine::VirtualMachine()
@@ -243,8 +235,8 @@ VirtualMachine::VirtualMachine()
     hooks.instance_pos_execute_hook = default_instance_pos_execute_hook;
     hooks.instance_pre_execute_hook = default_instance_pre_execute_hook;
     hooks.process_exec_hook = default_process_exec_hook;
+    hooks.render_batch_hook = nullptr;
 
-    global = new Scope(0);
     mainTask = new Task(this, "__main__");
     mainTask->chunk = new Chunk(1025);
     mainTask->is_main = true;
@@ -256,17 +248,66 @@ VirtualMachine::VirtualMachine()
 
     panicMode = false;
     isHalt = false;
+    parallelPhase = false;
     isDone = false;
+    tick = 0;
+    gcStage = 0;
+    gcCursor = 0;
+    jit = nullptr;
     parser.Init(this);
+    Arena::as().attach(this);
 }
 
 bool VirtualMachine::Compile(String source)
 {
-    if (parser.Load(std::move(source)))
+    String cached;
+    if (compileCache.length() > 0 && mainTask->chunk->count == 0)
     {
-        return parser.Process();
+        cached = cachePath(source);
+        if (isCached(cached.c_str()))
+        {
+            return Load(cached.c_str());
+        }
     }
-    return false;
+
+    if (!parser.Load(std::move(source)) || !parser.Process())
+    {
+        return false;
+    }
+#ifndef NO_SUPERINSTRUCTIONS
+    // main and the process prototypes, then the functions
+    for (u32 i = 0; i < taskes.size(); i++)
+    {
+        taskes[i]->optimize();
+    }
+    for (u32 i = 0; i < functions.size(); i++)
+    {
+        if (functions[i])
+        {
+            functions[i]->optimize();
+        }
+    }
+#endif
+    // a chunk that doesn't verify still runs, with the stack checks
+    for (u32 i = 0; i < taskes.size(); i++)
+    {
+        Task *task = taskes[i];
+        task->verify(task->type == TaskType::TPROCESS ? DEFAULT_COUNT + task->argsCount : 0);
+    }
+    for (u32 i = 0; i < functions.size(); i++)
+    {
+        if (functions[i])
+        {
+            functions[i]->verify(functions[i]->arity);
+        }
+    }
+    Aot::attach(this);
+
+    if (cached.length() > 0)
+    {
+        Save(cached.c_str());
+    }
+    return true;
 }
 
 bool VirtualMachine::IsReady()
@@ -274,75 +315,245 @@ bool VirtualMachine::IsReady()
     return !panicMode && !isHalt;
 }
 
-bool VirtualMachine::Update()
+void VirtualMachine::endTurn(Process *task, u8 state)
 {
-    if (panicMode || isHalt )
-        return false;
+    if (state == PAUSED)
+    {
+        timers.add(task);
+    }
+    else if (state == ABORTED || state == TERMINATED || state == FINISHED)
+    {
+        if (processList.remove(task))
+        {
+            task->remove();
+            task->next = nullptr;
+            task->prev = nullptr;
+            cleaner.add(task);
+        }
+    }
+    task->render();
+}
 
-    Process *task = processList.head;
-    while (task)
+void VirtualMachine::flushBatch()
+{
+    if (batchInstances.size() > 0)
     {
-        Process *next = task->next;
+        RenderBatch batch;
+        batch.count = (u32)batchInstances.size();
+        batch.instances = batchInstances.pointer();
+        batch.id = batchId.pointer();
+        batch.x = batchX.pointer();
+        batch.y = batchY.pointer();
+        batch.graph = batchGraph.pointer();
+        hooks.render_batch_hook(&batch);
+    }
+    batchInstances.clear();
+    batchId.clear();
+    batchX.clear();
+    batchY.clear();
+    batchGraph.clear();
+}
+
+void VirtualMachine::beginMark()
+{
+    gcStage = 0;
+    gcCursor = 0;
+    gcProcesses.clear();
+    for (Process *process = processList.head; process; process = process->next)
+    {
+        process->gcSlot = (u32)gcProcesses.size();
+        gcProcesses.push_back(process);
+    }
+}
 
-        u8 state = task->Run();
-        if (state == ABORTED || state == TERMINATED || state == FINISHED)
+bool VirtualMachine::markRoots(size_t &work)
+{
+    while (work > 0)
+    {
+        u32 done = 0;
+        switch (gcStage)
         {
-            if (processList.remove(task))
+        case 0:
+            if (gcCursor < globals.size())
+            {
+                Arena::as().shade(globals[gcCursor++]);
+                done = 1;
+            }
+            break;
+        case 1:
+            if (gcCursor < taskes.size())
+            {
+                done = 1 + taskes[gcCursor++]->markRoots();
+            }
+            break;
+        case 2:
+            if (gcCursor < functions.size())
             {
-                task->remove();
-                task->next = nullptr;
-                task->prev = nullptr;
-                cleaner.add(task);
+                FunctionObject *function = functions[gcCursor++];
+                done = 1 + (function ? function->markRoots() : 0);
             }
-         
+            break;
+        case 3:
+            if (gcCursor < gcProcesses.size())
+            {
+                Process *process = gcProcesses[gcCursor++];
+                done = 1 + (process ? process->markRoots() : 0);
+            }
+            break;
+        default:
+            gcProcesses.clear();
+            return true;
         }
-        if (state ==PAUSED)
+
+        if (done == 0)
         {
-           // state = task->Pause();
-        // task->update();
-         //   printf("Paused\n");
+            gcStage++;
+            gcCursor = 0;
+            continue;
+        }
+        work = done < work ? work - done : 0;
+    }
+    return false;
+}
+
+void VirtualMachine::runProcessJob(void *user, u32 index)
+{
+    VirtualMachine *vm = static_cast<VirtualMachine *>(user);
+    vm->runStates[index] = vm->runQueue[index]->Run();
+}
+
+bool VirtualMachine::Update(double gcBudget)
+{
+    if (panicMode || isHalt )
+        return false;
+
+    tierUp();
 
-        }else   if (state == RUNNING)
+    // wake whatever sleeps until this tick, the rest only get drawn
+    tick++;
+    timers.wake(tick);
+
+    if (jobs.size() > 1)
+    {
+        // parallel phase: every awake process runs until its budget, a pause
+        // or the first instruction that needs shared state (see DEFERRED)
+        runQueue.clear();
+        runStates.clear();
+        for (Process *task = processList.head; task; task = task->next)
         {
-           
-           // task->render();
+            if (task->isSleeping)
+                continue;
+            runQueue.push_back(task);
+            runStates.push_back(RUNNING);
+        }
 
-          //  printf("Running\n");
+        Arena::as().set_threaded(true);
+        parallelPhase = true;
+        jobs.run((u32)runQueue.size(), runProcessJob, this);
+        parallelPhase = false;
+        Arena::as().set_threaded(false);
+        tierUp();
+
+        // serial phase, in list order: deferred work, spawn/kill and hooks.
+        // Processes spawned here come after the last queued one and run
+        // their first turn now, as in the serial update
+        Process *last = processList.tail;
+        Process *task = processList.head;
+        bool spawned = false;
+        u32 i = 0;
+        while (task)
+        {
+            Process *next = task->next;
+            bool isLast = task == last;
+            if (!spawned && i < runQueue.size() && runQueue[i] == task)
+            {
+                u8 state = runStates[i++];
+                if (state == DEFERRED)
+                {
+                    state = task->Run();
+                }
+                endTurn(task, state);
+            }
+            else if (spawned && !task->isSleeping)
+            {
+                endTurn(task, task->Run());
+            }
+            else
+            {
+                task->render();
+            }
+            if (isLast)
+                spawned = true;
+            task = next;
+        }
+    }
+    else
+    {
+        Process *task = processList.head;
+        while (task)
+        {
+            Process *next = task->next;
+            if (task->isSleeping)
+            {
+                task->render();
+            }
+            else
+            {
+                endTurn(task, task->Run());
+            }
+            task = next;
         }
-         task->render();
+    }
 
-       
 
-        task = next;
+    // before the cleaner, dead processes were drawn on their last turn
+    if (hooks.render_batch_hook)
+    {
+        flushBatch();
     }
 
-
   //  if (cleaner.count() > 256)
         cleaner.clear(true);
 
-    Arena::as().gc();
+    Arena::as().gc(gcBudget);
     return processList.count() == 0;
 }
 
 VirtualMachine::~VirtualMachine()
 {
+    Arena::as().detach(this);
     Arena::as().clear();
     Clear();
-    delete global;
+    delete jit;
+}
+
+bool VirtualMachine::enableJit()
+{
+#ifdef USE_JIT
+    if (!jit)
+        jit = new Jit();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void VirtualMachine::tierUp()
+{
+    if (jit && __atomic_load_n(&jit->pending, __ATOMIC_RELAXED))
+        jit->tierUp(this);
 }
 
 void VirtualMachine::Clear()
 {
 
    // scriptFunctions.clear();
-    FunctionObject* func = functionsMap.first();
-    while (func)
+    for (size_t i = 0; i < functions.size(); i++)
     {
-        delete func;
-        func = functionsMap.next();
+        delete functions[i];
     }
-
-    functionsMap.clear();
+    functions.clear();
+    processes.clear();
     for (size_t i = 0; i < taskes.size(); i++)
     {
         delete taskes[i];
@@ -351,40 +562,53 @@ void VirtualMachine::Clear()
     taskesMap.clear();
 
 
-    NativeFunctionObject* nativeOP = nativeFunctions.first();
-    while (nativeOP)
+    for (size_t i = 0; i < natives.size(); i++)
     {
-        delete nativeOP;
-        nativeOP = nativeFunctions.next();
+        delete natives[i];
     }
-    nativeFunctions.clear();
+    natives.clear();
+    nativeSlots.clear();
 
     cleaner.clear(true);
     processList.clear(true);
+    engine.clear();
 
-    global->clear();
+    globals.clear();
+    globalNames.clear();
+    globalSlots.clear();
     mainTask = nullptr;
     currentTask = nullptr;
 }
 
 bool VirtualMachine::push(Value v)
 {
-    return currentTask->push(std::move(v));
+    Task *task = nativeTask ? nativeTask : currentTask;
+    // a native's args point into the stack, growing it would move them
+    if (nativeTask && task->stackTop >= task->stack + task->stackCapacity)
+    {
+        Error("[PUSH] Stack overflow in native call of '%s'", task->name.c_str());
+        return false;
+    }
+    WRITE_BARRIER(v);
+    return task->push(std::move(v));
 }
 
 Value VirtualMachine::pop()
 {
-    return currentTask->pop();
+    Task *task = nativeTask ? nativeTask : currentTask;
+    return task->pop();
 }
 
 Value VirtualMachine::peek(int offset)
 {
-    return currentTask->peek(offset);
+    Task *task = nativeTask ? nativeTask : currentTask;
+    return task->peek(offset);
 }
 
 Value VirtualMachine::top()
 {
-    return currentTask->top();
+    Task *task = nativeTask ? nativeTask : currentTask;
+    return task->top();
 }
 
 long VirtualMachine::pop_int()
@@ -513,7 +737,7 @@ const String OpCodeNames[] =
         "ADD", "SUBTRACT", "MULTIPLY", "DIVIDE", "MOD", "POWER", "NEGATE",
         "EQUAL", "NOT_EQUAL", "GREATER", "LESS", "GREATER_EQUAL", "LESS_EQUAL",
         "NOT", "AND", "OR", "XOR", "INC", "DEC", "SHL", "SHR", "ENTER_SCOPE", "EXIT_SCOPE",
-        "GLOBAL_DEFINE", "GLOBAL_GET", "GLOBAL_ASSIGN", "LOCAL_DEFINE", "LOCAL_GET", "LOCAL_ASSIGN",
+        "GLOBAL_DEFINE", "GLOBAL_GET", "GLOBAL_ASSIGN", "LOCAL_DEFINE", "LOCAL_GET", "LOCAL_ASSIGN", "ENGINE_GET", "ENGINE_SET",
         "SWITCH", "CASE", "SWITCH_DEFAULT", "DUP", "EVAL_EQUAL", "JUMP_BACK", "LOOP_BEGIN", "LOOP_END",
         "BREAK", "CONTINUE", "DROP", "CALL", "CALL_SCRIPT", "CALL_PROCESS", "RETURN_DEF", "RETURN_PROCESS",
         "RETURN_NATIVE", "NIL", "JUMP", "JUMP_IF_FALSE", "JUMP_IF_TRUE", "COUNT"};
@@ -524,6 +748,8 @@ bool VirtualMachine::Run()
     while(true)
     {
         u8 state =mainTask->Run();
+        Arena::as().gc(0);
+        tierUp();
         if (state == FINISHED || state == TERMINATED)
         {
             return true;
@@ -550,7 +776,7 @@ FunctionObject::FunctionObject(VirtualMachine *vm, const char *name) : Task(vm,
 //***************************************************************************************************************** */
 
 
-NativeFunctionObject::NativeFunctionObject(NativeFunction func, const char *name, int arity) : func(func), name(name), arity(arity)
+NativeFunctionObject::NativeFunctionObject(NativeFunction func, const char *name, int arity, bool threadSafe) : func(func), name(name), arity(arity), threadSafe(threadSafe)
 {
 }
 
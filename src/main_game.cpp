@@ -26,22 +26,21 @@ Texture2D bunnyTex;
 void instance_create(Instance *instance)
 {
    
-  //  INFO("Create instance: %s at %d %d %d", instance->name.c_str(), instance->locals[IX], instance->locals[IY], instance->locals[IGRAPH]);
+  //  INFO("Create instance: %s at %d %d %d", instance->name.c_str(), instance->get(IX), instance->get(IY), instance->get(IGRAPH));
 }
 void instance_destroy(Instance *instance)
 {
    
-   // INFO("Destroy instance: %s at %d %d %d", instance->name.c_str(), instance->locals[IX], instance->locals[IY], instance->locals[IGRAPH]);
+   // INFO("Destroy instance: %s at %d %d %d", instance->name.c_str(), instance->get(IX), instance->get(IY), instance->get(IGRAPH));
 }
 
-void process_exec(Instance *instance)
+// one call per frame with every instance, a single texture so no sorting by graph
+void render_batch(const RenderBatch *batch)
 {
-   // DrawCircle(instance->locals[IX], instance->locals[IY], 10, RED);
-    DrawTexture(bunnyTex, instance->locals[IX], instance->locals[IY],WHITE);
-
-  //  printf("update %f %f \n",instance->locals[IX], instance->locals[IY]);
-
-    //INFO("Process exec instance: %s at %d %d %d", instance->name.c_str(), instance->locals[IX], instance->locals[IY], instance->locals[IGRAPH]);
+    for (u32 i = 0; i < batch->count; i++)
+    {
+        DrawTexture(bunnyTex, batch->x[i], batch->y[i], WHITE);
+    }
 }
 
 static int nave_key_down(VirtualMachine *vm, int argc, Value *args)
@@ -251,13 +250,10 @@ int main_game()
 
 bool done = false;
 
+    // a build that ships only the compiled main.pcb has no main.pc
     char *text = LoadTextFile("main.pc");
-    if (!text)
-    {
-        ERROR("Failed to load main.pc");
-        return 1;
-    }
-    String str(text);
+    bool source = text != nullptr;
+    String str(source ? text : "");
     FreeTextFile(text);
 
     VirtualMachine vm;
@@ -289,10 +285,14 @@ bool done = false;
 
       vm.hooks.instance_create_hook = instance_create;
     vm.hooks.instance_destroy_hook = instance_destroy;
-    vm.hooks.process_exec_hook = process_exec;
+    vm.hooks.render_batch_hook = render_batch;
+
 
+    // opt-in compile cache for development, see VirtualMachine::setCompileCache
+    if (getenv("BULANG_CACHE"))
+        vm.setCompileCache(getenv("BULANG_CACHE"));
 
-    bool sucess = vm.Compile(std::move(str));
+    bool sucess = source ? vm.Compile(std::move(str)) : vm.Load("main.pcb");
     INFO("Compiled: %s", sucess ? "success" : "fail");
 
  
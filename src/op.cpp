@@ -19,19 +19,19 @@ u8 Task::op_add()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                String result = a.string->string + b.string->string;
+                String result = AS_STRING(a)->string + AS_STRING(b)->string;
                 push(std::move(STRING(result.c_str())));
             }
             else if (IS_STRING(a) && IS_NUMBER(b))
             {
                 String number(AS_NUMBER(b));
-                String result = a.string->string + number;
+                String result = AS_STRING(a)->string + number;
                 push(std::move(STRING(result.c_str())));
             }
             else if (IS_NUMBER(a) && IS_STRING(b))
             {
                 String number(AS_NUMBER(a));
-                String result = number + b.string->string;
+                String result = number + AS_STRING(b)->string;
                 push(std::move(STRING(result.c_str())));
             }
             else
@@ -57,7 +57,7 @@ u8 Task::op_not_equal()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                Value result = BOOLEAN(a.string->string != b.string->string);
+                Value result = BOOLEAN(!StringEquals(AS_STRING(a), AS_STRING(b)));
                 push(std::move(result));
             }
             else if (IS_BOOLEAN(a) && IS_BOOLEAN(b))
@@ -87,7 +87,7 @@ u8 Task::op_less()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                Value result = BOOLEAN(a.string->string.length() < b.string->string.length());
+                Value result = BOOLEAN(AS_STRING(a)->string.length() < AS_STRING(b)->string.length());
                 push(std::move(result));
             }
             else
@@ -112,7 +112,7 @@ u8 Task::op_greater()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                Value result = BOOLEAN(a.string->string.length() > b.string->string.length());
+                Value result = BOOLEAN(AS_STRING(a)->string.length() > AS_STRING(b)->string.length());
                 push(std::move(result));
             }
             else
@@ -139,7 +139,7 @@ u8 Task::op_less_equal()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                Value result = BOOLEAN(a.string->string.length() <= b.string->string.length());
+                Value result = BOOLEAN(AS_STRING(a)->string.length() <= AS_STRING(b)->string.length());
                 push(std::move(result));
             }
             else
@@ -165,7 +165,7 @@ u8 Task::op_greater_equal()
             }
             else if (IS_STRING(a) && IS_STRING(b))
             {
-                Value result = BOOLEAN(a.string->string.length() >= b.string->string.length());
+                Value result = BOOLEAN(AS_STRING(a)->string.length() >= AS_STRING(b)->string.length());
                 push(std::move(result));
             }
             else
@@ -228,7 +228,7 @@ u8 Task::op_xor()
 
 
 
-u8 Task::op_mod(int line)
+u8 Task::op_mod()
 {
             Value b = pop();
             Value a = pop();
@@ -238,7 +238,7 @@ u8 Task::op_mod(int line)
                 double divisor = AS_NUMBER(b);
                 if (divisor == 0)
                 {
-                    vm->Error("division by zero [line %d]", line);
+                    vm->Error("division by zero [line %d]", currentLine());
 
                     return ABORTED;
                 }
@@ -252,7 +252,7 @@ u8 Task::op_mod(int line)
             }
             else
             {
-                vm->Error("invalid 'mod' operands [line %d]", line);
+                vm->Error("invalid 'mod' operands [line %d]", currentLine());
 
                 return ABORTED;
             }
@@ -0,0 +1,106 @@
+#include "pch.h"
+
+#include "Utils.hpp"
+#include "Vm.hpp"
+#include "Aot.hpp"
+
+// bulang-aot: compiles scripts the way the host does and writes their chunks
+// as C++ for the host to link (see Aot.hpp). The natives and globals the host
+// registers before Compile are part of the bytecode, give them in the same
+// order; a chunk that doesn't match at load time just stays interpreted.
+//
+//   bulang-aot [-native name:arity]... [-global name]... -o out.cpp script.pc...
+
+static int native_stub(VirtualMachine *vm, int argc, Value *args)
+{
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    Vector<const char *> natives;
+    Vector<int> arities;
+    Vector<const char *> globals;
+    Vector<const char *> scripts;
+    const char *output = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-native") == 0 && i + 1 < argc)
+        {
+            char *arg = argv[++i];
+            char *colon = strchr(arg, ':');
+            arities.push_back(colon ? atoi(colon + 1) : -1);
+            if (colon)
+                *colon = '\0';
+            natives.push_back(arg);
+        }
+        else if (strcmp(argv[i], "-global") == 0 && i + 1 < argc)
+            globals.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            scripts.push_back(argv[i]);
+    }
+    if (!output || scripts.empty())
+    {
+        fprintf(stderr, "usage: bulang-aot [-native name:arity]... [-global name]... -o out.cpp script.pc...\n");
+        return 1;
+    }
+
+    // written next to the output and renamed, a failed run leaves the old file
+    String temp = String(output) + ".tmp";
+    FILE *out = fopen(temp.c_str(), "w");
+    if (!out)
+    {
+        fprintf(stderr, "Failed to write %s\n", temp.c_str());
+        return 1;
+    }
+    fprintf(out, "// generated by bulang-aot, do not edit\n#include \"pch.h\"\n#include \"Aot.hpp\"\n\n");
+
+    int written = 0;
+    for (size_t i = 0; i < scripts.size(); i++)
+    {
+        char *text = LoadTextFile(scripts[i]);
+        if (!text)
+        {
+            fprintf(stderr, "Failed to load %s\n", scripts[i]);
+            fclose(out);
+            remove(temp.c_str());
+            return 1;
+        }
+        String source(text);
+        FreeTextFile(text);
+
+        VirtualMachine vm;
+        for (size_t j = 0; j < natives.size(); j++)
+            vm.registerFunction(natives[j], native_stub, arities[j]);
+        for (size_t j = 0; j < globals.size(); j++)
+            vm.registerNil(globals[j]);
+
+        if (!vm.Compile(source))
+        {
+            fprintf(stderr, "Failed to compile %s\n", scripts[i]);
+            fclose(out);
+            remove(temp.c_str());
+            return 1;
+        }
+
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "aot%zu", i);
+        if (Aot::write(&vm, out, prefix))
+            written++;
+        else
+            fprintf(stderr, "%s: no chunk verified, nothing written\n", scripts[i]);
+    }
+
+    fclose(out);
+    if (rename(temp.c_str(), output) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", output);
+        remove(temp.c_str());
+        return 1;
+    }
+    fprintf(stderr, "bulang-aot: %d of %zu scripts written to %s\n", written, scripts.size(), output);
+    return 0;
+}
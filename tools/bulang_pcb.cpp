@@ -0,0 +1,74 @@
+#include "pch.h"
+
+#include "Utils.hpp"
+#include "Vm.hpp"
+
+// bulang-pcb: compiles a script the way the host does and saves the program
+// as a .pcb for VirtualMachine::Load. The natives and globals the host
+// registers before Load are slots in the bytecode, give them in the same
+// order; Load fails on a vm that registered them differently.
+//
+//   bulang-pcb [-native name:arity]... [-global name]... -o out.pcb script.pc
+
+static int native_stub(VirtualMachine *vm, int argc, Value *args)
+{
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    Vector<const char *> natives;
+    Vector<int> arities;
+    Vector<const char *> globals;
+    const char *script = nullptr;
+    const char *output = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-native") == 0 && i + 1 < argc)
+        {
+            char *arg = argv[++i];
+            char *colon = strchr(arg, ':');
+            arities.push_back(colon ? atoi(colon + 1) : -1);
+            if (colon)
+                *colon = '\0';
+            natives.push_back(arg);
+        }
+        else if (strcmp(argv[i], "-global") == 0 && i + 1 < argc)
+            globals.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else
+            script = argv[i];
+    }
+    if (!output || !script)
+    {
+        fprintf(stderr, "usage: bulang-pcb [-native name:arity]... [-global name]... -o out.pcb script.pc\n");
+        return 1;
+    }
+
+    char *text = LoadTextFile(script);
+    if (!text)
+    {
+        fprintf(stderr, "Failed to load %s\n", script);
+        return 1;
+    }
+    String source(text);
+    FreeTextFile(text);
+
+    VirtualMachine vm;
+    for (size_t i = 0; i < natives.size(); i++)
+        vm.registerFunction(natives[i], native_stub, arities[i]);
+    for (size_t i = 0; i < globals.size(); i++)
+        vm.registerNil(globals[i]);
+
+    if (!vm.Compile(source))
+    {
+        fprintf(stderr, "Failed to compile %s\n", script);
+        return 1;
+    }
+    if (!vm.Save(output))
+        return 1;
+    fprintf(stderr, "bulang-pcb: %s written to %s\n", script, output);
+    return 0;
+}